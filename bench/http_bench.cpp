@@ -0,0 +1,423 @@
+// HTTP/1.1 load generator on the same event loop as the server
+//
+// usage: shs_bench [--host H] [--port P] [--threads N] [--connections N] [--depth N]
+//                  [--rate REQ_PER_SEC] [--duration SEC] [--request METHOD:PATH[:BODY_BYTES[:WEIGHT]]]...
+//                  [--in-process [--server-threads N] [--response-size N]] [--json]
+//
+// every connection keeps up to --depth requests in flight (pipelining). Without --rate it sends
+// the next request as soon as a response arrives (closed loop) and latency is service time.
+// With --rate requests follow a fixed schedule spread over all connections and latency is
+// measured from the time a request should have been sent, so a stalled server is charged for
+// every request it delayed (coordinated omission correction).
+// --in-process starts a server with a fixed-size response on --port in this process, so
+// single-machine runs do not depend on the configuration of another binary.
+// --json prints the results as one JSON object instead of a table.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "http_server.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include "tcp_socket.hpp"
+#include "llhttp.h"
+
+using namespace SHS1;
+using namespace SNL1;
+
+namespace {
+
+struct RequestTemplate {
+    std::string bytes;
+    unsigned weight;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int threads = 2;
+    int connections = 64;
+    int depth = 1;
+    double rate = 0;  // requests per second over all connections, 0 for closed loop
+    double duration = 10;
+    bool inProcess = false;
+    int serverThreads = 2;
+    size_t responseSize = 128;
+    bool json = false;
+    std::vector<RequestTemplate> requests;
+};
+
+bool parseRequest(const std::string &spec, const std::string &host, RequestTemplate &t) {
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    for (;;) {
+        size_t next = spec.find(':', pos);
+        parts.push_back(spec.substr(pos, next - pos));
+        if (next == std::string::npos) break;
+        pos = next + 1;
+    }
+    if (parts.size() < 2 || parts.size() > 4 || parts[0].empty() || parts[1].empty() || parts[1][0] != '/') {
+        return false;
+    }
+    size_t body = parts.size() > 2 ? strtoul(parts[2].c_str(), nullptr, 10) : 0;
+    t.weight = parts.size() > 3 ? unsigned(strtoul(parts[3].c_str(), nullptr, 10)) : 1;
+    t.bytes = parts[0] + " " + parts[1] + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: shs_bench\r\n";
+    if (body || parts[0] == "POST" || parts[0] == "PUT") {
+        t.bytes += "Content-Type: application/octet-stream\r\nContent-Length: " + std::to_string(body) + "\r\n";
+    }
+    t.bytes += "\r\n";
+    t.bytes.append(body, 'x');
+    return t.weight > 0;
+}
+
+bool parseArgs(int argc, char **argv, Options &opt) {
+    std::vector<std::string> specs;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--in-process")) {
+            opt.inProcess = true;
+        } else if (!strcmp(argv[i], "--json")) {
+            opt.json = true;
+        } else if (!strcmp(argv[i], "--host") && hasValue) {
+            opt.host = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && hasValue) {
+            opt.port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            opt.threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--connections") && hasValue) {
+            opt.connections = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--depth") && hasValue) {
+            opt.depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rate") && hasValue) {
+            opt.rate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--duration") && hasValue) {
+            opt.duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--server-threads") && hasValue) {
+            opt.serverThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--response-size") && hasValue) {
+            opt.responseSize = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--request") && hasValue) {
+            specs.emplace_back(argv[++i]);
+        } else {
+            fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+            return false;
+        }
+    }
+    if (specs.empty()) specs.emplace_back("GET:/");
+    for (auto &&s: specs) {
+        RequestTemplate t;
+        if (!parseRequest(s, opt.host, t)) {
+            fprintf(stderr, "bad --request %s, expected METHOD:PATH[:BODY_BYTES[:WEIGHT]]\n", s.c_str());
+            return false;
+        }
+        opt.requests.push_back(std::move(t));
+    }
+    if (opt.threads < 1 || opt.connections < 1 || opt.depth < 1 || opt.duration <= 0 || opt.rate < 0) {
+        fprintf(stderr, "threads, connections, depth and duration must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+using Clock = MetricsClock;
+
+std::atomic<bool> stopping{false};
+
+// one client connection, only touched by the loop thread owning it; the pacer only reads
+// nextDue and flips write interest
+struct BenchConn final : private DisableCopy, public std::enable_shared_from_this<BenchConn> {
+    const Options &opt;
+    std::shared_ptr<Connection> conn;
+    llhttp_t parser;
+    llhttp_settings_t settings;
+    std::mt19937 rng;
+    unsigned totalWeight;
+    std::deque<std::pair<Clock::time_point, Clock::time_point>> inflight;  // intended, actual send
+    std::string out;
+    size_t outPos;
+    Clock::time_point start;
+    Clock::duration interval;  // between two scheduled requests, with --rate
+    uint64_t scheduled;
+    std::atomic<int64_t> nextDue;  // ns since start, read by the pacer
+    std::atomic<bool> armed;
+
+    LatencyHistogram corrected, service;
+    std::atomic<uint64_t> done{0}, non2xx{0}, errors{0}, bytesIn{0};
+
+    BenchConn(const Options &opt, std::shared_ptr<Connection> c, unsigned seed, Clock::time_point start,
+              Clock::duration interval, Clock::duration offset) :
+            opt(opt), conn(std::move(c)), parser{}, settings{}, rng(seed), totalWeight(0), outPos(0),
+            start(start + offset), interval(interval), scheduled(0), nextDue(0), armed(true) {
+        for (auto &&t: opt.requests) totalWeight += t.weight;
+        settings.on_message_complete = [](llhttp_t *p) {
+            static_cast<BenchConn *>(p->data)->complete_(llhttp_get_status_code(p));
+            return 0;
+        };
+        llhttp_init(&parser, HTTP_RESPONSE, &settings);
+        parser.data = this;
+    }
+
+    void enable() {
+        conn->enableHandler([ptr = shared_from_this()](EventType e) {
+            ptr->handler(e);
+        }, true, true);
+    }
+
+    void handler(EventType e) {
+        int ec = 0;
+        if (e & EVENT_IN) {
+            char buf[65536];
+            for (;;) {
+                size_t n = conn->hRead(buf, sizeof(buf), ec);
+                if (n == 0) break;
+                bump(bytesIn, uint64_t(n));
+                if (llhttp_execute(&parser, buf, n) != HPE_OK) {
+                    fail_();
+                    return;
+                }
+            }
+            if (ec || conn->hIsReadClosed()) {
+                fail_();
+                return;
+            }
+        }
+        fill_();
+        while (outPos < out.size()) {
+            size_t n = conn->hWrite(out.data() + outPos, out.size() - outPos, ec);
+            if (n == 0) break;
+            outPos += n;
+        }
+        if (ec) {
+            fail_();
+            return;
+        }
+        if (outPos == out.size()) {
+            out.clear();
+            outPos = 0;
+        }
+        // with a rate the pacer re-arms write interest when the next request is due
+        bool more = outPos < out.size();
+        if (armed.load(std::memory_order_relaxed) != more) {
+            armed.store(more, std::memory_order_relaxed);
+            conn->hSetWrite(more);
+        }
+    }
+
+    void pace(Clock::time_point now) {
+        if (!armed.load(std::memory_order_relaxed) &&
+            std::chrono::nanoseconds(nextDue.load(std::memory_order_relaxed)) <= now - start) {
+            armed.store(true, std::memory_order_relaxed);
+            conn->hSetWrite(true);
+        }
+    }
+
+private:
+    void fill_() {
+        if (stopping.load(std::memory_order_relaxed)) return;
+        Clock::time_point now = Clock::now();
+        while (inflight.size() < size_t(opt.depth)) {
+            Clock::time_point intended = now;
+            if (opt.rate > 0) {
+                intended = start + interval * scheduled;
+                if (intended > now) break;
+            }
+            unsigned pick = rng() % totalWeight;
+            const RequestTemplate *t = opt.requests.data();
+            while (pick >= t->weight) pick -= (t++)->weight;
+            out.append(t->bytes);
+            inflight.emplace_back(intended, now);
+            ++scheduled;
+        }
+        if (opt.rate > 0) {
+            // nothing is due while every slot is in flight, the next response triggers fill_()
+            nextDue.store(inflight.size() < size_t(opt.depth) ?
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(interval * scheduled).count() :
+                          INT64_MAX, std::memory_order_relaxed);
+        }
+    }
+
+    void complete_(int status) {
+        if (inflight.empty()) return;
+        auto [intended, sent] = inflight.front();
+        inflight.pop_front();
+        if (stopping.load(std::memory_order_relaxed)) return;
+        Clock::time_point now = Clock::now();
+        corrected.record(uint64_t((now - intended).count()));
+        service.record(uint64_t((now - sent).count()));
+        bump(done, uint64_t(1));
+        if (status < 200 || status >= 300) bump(non2xx, uint64_t(1));
+    }
+
+    void fail_() {
+        if (!stopping.load(std::memory_order_relaxed)) bump(errors, uint64_t(1));
+        inflight.clear();
+        conn->hShutdown(true, true);
+    }
+};
+
+constexpr double QUANTILES[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+constexpr const char *QUANTILE_NAMES[] = {"p50", "p90", "p99", "p99.9", "max"};
+
+struct Summary {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(LatencyHistogram::BUCKETS);
+    uint64_t sum = 0, total = 0;
+
+    void add(const LatencyHistogram &h) {
+        h.addTo(counts, sum);
+    }
+
+    // upper bound of the bucket holding quantile q, in ms
+    double quantile(double q) {
+        total = 0;
+        for (uint64_t c: counts) total += c;
+        if (total == 0) return 0;
+        auto rank = uint64_t(q * double(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) return double(LatencyHistogram::bucketEnd(i)) / 1e6;
+        }
+        return 0;
+    }
+
+    double mean() const {
+        return total ? double(sum) / double(total) / 1e6 : 0;
+    }
+
+    void print(const char *name) {
+        printf("%-10s", name);
+        for (double q: QUANTILES) printf(" %10.3f", quantile(q));
+        printf(" %10.3f\n", mean());
+    }
+
+    void printJson(const char *name) {
+        printf(",\"%s\":{", name);
+        for (size_t i = 0; i < std::size(QUANTILES); ++i) {
+            printf("\"%s\":%.4f,", QUANTILE_NAMES[i], quantile(QUANTILES[i]));
+        }
+        printf("\"mean\":%.4f}", mean());
+    }
+};
+
+std::shared_ptr<HttpServer> startServer(Context &ctx, const Options &opt) {
+    int ec;
+    std::shared_ptr<Listener> lis = ctx.newTcpServer(opt.port, 4096, ec);
+    if (!lis) {
+        panic(std::string("in-process server: ") + strerror(ec));
+    }
+    std::shared_ptr<HttpServer> server = HttpServer::create(std::move(lis));
+    auto payload = std::make_shared<const std::string>(opt.responseSize, 'x');
+    server->enableHandler([payload]() {
+        return [payload](HttpHeader *header, HttpData *, std::unique_ptr<Response> &resp) {
+            if (header) {
+                header->result = HeaderAction::OK;
+                return;
+            }
+            if (resp) return;
+            resp = std::make_unique<Response>();
+            resp->version = "1.1";
+            resp->status = 200;
+            resp->message = "OK";
+            resp->header["Content-Type"] = "application/octet-stream";
+            resp->body = std::make_unique<StringResponse>(*payload);
+        };
+    });
+    return server;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) return 2;
+    Context::ignorePipeSignal();
+
+    std::unique_ptr<Context> serverCtx;
+    std::shared_ptr<HttpServer> server;
+    if (opt.inProcess) {
+        serverCtx = std::make_unique<Context>(opt.serverThreads, 65536, 65536);
+        server = startServer(*serverCtx, opt);
+    }
+
+    Context ctx(opt.threads, 65536, 65536);
+    Clock::time_point start = Clock::now();
+    Clock::duration interval{};
+    if (opt.rate > 0) {
+        interval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(double(opt.connections) / opt.rate));
+    }
+    std::vector<std::shared_ptr<BenchConn>> conns;
+    for (int i = 0; i < opt.connections; ++i) {
+        int ec;
+        std::shared_ptr<Connection> c = ctx.newTcpClient(opt.host, opt.port, ec);
+        if (!c) {
+            fprintf(stderr, "connect %s:%d: %s\n", opt.host.c_str(), opt.port, strerror(ec));
+            return 1;
+        }
+        // stagger the schedules so a rate does not arrive as one burst per interval
+        conns.push_back(std::make_shared<BenchConn>(opt, std::move(c), unsigned(i + 1), start, interval,
+                                                    interval * i / opt.connections));
+    }
+    for (auto &&c: conns) c->enable();
+
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(opt.duration));
+    while (Clock::now() < end) {
+        if (opt.rate > 0) {
+            Clock::time_point now = Clock::now();
+            for (auto &&c: conns) c->pace(now);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(opt.rate > 0 ? 200 : 10000));
+    }
+    stopping = true;
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Summary corrected, service;
+    uint64_t done = 0, non2xx = 0, errors = 0, bytesIn = 0;
+    for (auto &&c: conns) {
+        corrected.add(c->corrected);
+        service.add(c->service);
+        done += c->done.load(std::memory_order_relaxed);
+        non2xx += c->non2xx.load(std::memory_order_relaxed);
+        errors += c->errors.load(std::memory_order_relaxed);
+        bytesIn += c->bytesIn.load(std::memory_order_relaxed);
+    }
+    for (auto &&c: conns) c->conn->hShutdown(true, true);
+
+    if (opt.json) {
+        printf("{\"connections\":%d,\"depth\":%d,\"rate\":%.0f,\"seconds\":%.3f,\"requests\":%llu,"
+               "\"non_2xx\":%llu,\"errors\":%llu,\"throughput\":%.1f", opt.connections, opt.depth, opt.rate,
+               elapsed, (unsigned long long) done, (unsigned long long) non2xx, (unsigned long long) errors,
+               double(done) / elapsed);
+        if (opt.rate > 0) {
+            corrected.printJson("corrected_ms");
+        }
+        service.printJson("service_ms");
+        printf("}\n");
+    } else {
+        printf("%d connections, depth %d, %s, %.1f s\n", opt.connections, opt.depth,
+               opt.rate > 0 ? ("rate " + std::to_string(int64_t(opt.rate)) + " req/s").c_str() : "closed loop",
+               elapsed);
+        printf("requests   %llu (%llu non-2xx), %llu connection errors\n", (unsigned long long) done,
+               (unsigned long long) non2xx, (unsigned long long) errors);
+        printf("throughput %.0f req/s, %.2f MB/s received\n", double(done) / elapsed,
+               double(bytesIn) / elapsed / 1e6);
+        printf("latency ms        p50        p90        p99      p99.9        max       mean\n");
+        if (opt.rate > 0) {
+            corrected.print("corrected");
+        }
+        service.print("service");
+    }
+
+    if (server) server->stop();
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+// compression ratio and throughput of zstd with and without a trained dictionary
+// over echo-style JSON responses
+//
+// usage: shs_zstd_bench [--dict-size N] [--save-dict PATH] [PAYLOAD_FILE...]
+// each payload file holds one captured response body; without files, synthetic
+// payloads shaped like the echo handler output are generated
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include "json.h"
+#include "zstd.h"
+#include "zdict.h"
+
+namespace {
+
+std::vector<std::string> syntheticPayloads(size_t n) {
+    static const char *methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    static const char *paths[] = {"/api/v1/users/", "/api/v1/orders/", "/api/v1/items/", "/health", "/echo/"};
+    static const char *agents[] = {
+            "curl/7.88.1",
+            "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+            "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Safari/537.36",
+            "okhttp/4.11.0",
+    };
+    std::mt19937 rng(42);
+    std::vector<std::string> r;
+    r.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        Json::Value rd = Json::objectValue;
+        rd["method"] = methods[rng() % std::size(methods)];
+        rd["target"] = std::string(paths[rng() % std::size(paths)]) + std::to_string(rng() % 100000);
+        rd["version"] = "1.1";
+        rd["header"] = Json::objectValue;
+        rd["header"]["Host"] = "api.example.com";
+        rd["header"]["User-Agent"] = agents[rng() % std::size(agents)];
+        rd["header"]["Accept"] = "application/json";
+        rd["header"]["Accept-Encoding"] = "gzip, deflate, zstd";
+        rd["header"]["X-Request-Id"] = std::to_string(rng()) + "-" + std::to_string(rng());
+        if (rng() % 3 == 0) {
+            std::string body(16 + rng() % 96, 'A');
+            for (char &c: body) c = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[rng() % 64];
+            rd["header"]["Content-Type"] = "application/json";
+            rd["header"]["Content-Length"] = std::to_string(body.size() * 3 / 4);
+            rd["body"] = body;
+        }
+        r.push_back(rd.toStyledString());
+    }
+    return r;
+}
+
+struct Result {
+    double ratio, mbps;
+};
+
+Result run(const std::vector<std::string> &samples, int level, const ZSTD_CDict *cdict) {
+    ZSTD_CCtx *c = ZSTD_createCCtx();
+    std::string out;
+    size_t in = 0, compressed = 0, rounds = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    do {
+        for (auto &&s: samples) {
+            out.resize(ZSTD_compressBound(s.size()));
+            size_t r = cdict ? ZSTD_compress_usingCDict(c, out.data(), out.size(), s.data(), s.size(), cdict)
+                             : ZSTD_compressCCtx(c, out.data(), out.size(), s.data(), s.size(), level);
+            if (ZSTD_isError(r)) {
+                fprintf(stderr, "compress: %s\n", ZSTD_getErrorName(r));
+                exit(1);
+            }
+            if (rounds == 0) {
+                in += s.size();
+                compressed += r;
+            }
+        }
+        ++rounds;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed.count() < 0.5);
+    ZSTD_freeCCtx(c);
+    return {double(in) / double(compressed), double(in) * double(rounds) / elapsed.count() / 1e6};
+}
+
+}
+
+int main(int argc, char **argv) {
+    size_t dictSize = 16 * 1024;
+    const char *saveDict = nullptr;
+    std::vector<std::string> samples;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--dict-size") && i + 1 < argc) {
+            dictSize = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--save-dict") && i + 1 < argc) {
+            saveDict = argv[++i];
+        } else {
+            std::ifstream f(argv[i], std::ios::binary);
+            if (!f) {
+                fprintf(stderr, "cannot open %s\n", argv[i]);
+                return 1;
+            }
+            samples.emplace_back(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        }
+    }
+    if (samples.empty()) samples = syntheticPayloads(4000);
+    if (samples.size() < 16) {
+        fprintf(stderr, "need at least 16 payloads to train a dictionary\n");
+        return 1;
+    }
+
+    // train on even samples, measure on odd ones
+    std::vector<std::string> test;
+    std::string trainBuf;
+    std::vector<size_t> trainSizes;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        if (i % 2) {
+            test.push_back(samples[i]);
+        } else {
+            trainBuf.append(samples[i]);
+            trainSizes.push_back(samples[i].size());
+        }
+    }
+    std::string dict(dictSize, '\0');
+    size_t n = ZDICT_trainFromBuffer(dict.data(), dict.size(), trainBuf.data(), trainSizes.data(),
+                                     (unsigned) trainSizes.size());
+    if (ZDICT_isError(n)) {
+        fprintf(stderr, "train: %s\n", ZDICT_getErrorName(n));
+        return 1;
+    }
+    dict.resize(n);
+    if (saveDict) {
+        std::ofstream(saveDict, std::ios::binary).write(dict.data(), (std::streamsize) dict.size());
+    }
+
+    size_t total = 0;
+    for (auto &&s: test) total += s.size();
+    printf("%zu payloads, avg %zu bytes, dictionary %zu bytes\n\n", test.size(), total / test.size(), dict.size());
+    printf("%-6s %14s %14s %14s %14s\n", "level", "ratio", "MB/s", "ratio+dict", "MB/s+dict");
+    for (int level: {1, 3, 6, 9, 19}) {
+        ZSTD_CDict *cdict = ZSTD_createCDict(dict.data(), dict.size(), level);
+        Result plain = run(test, level, nullptr);
+        Result withDict = run(test, level, cdict);
+        printf("%-6d %14.2f %14.1f %14.2f %14.1f\n", level, plain.ratio, plain.mbps, withDict.ratio, withDict.mbps);
+        ZSTD_freeCDict(cdict);
+    }
+    return 0;
+}
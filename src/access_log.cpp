@@ -0,0 +1,159 @@
+#include "access_log.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <chrono>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr size_t RING_SIZE = 4096;  // records per thread, power of 2
+constexpr size_t WRITE_BATCH = 256 * 1024;
+constexpr auto IDLE_WAIT = std::chrono::milliseconds(20);
+
+std::atomic<uint64_t> nextLogId{1};
+
+// rings of this thread, by log id (a process normally has a single access log)
+thread_local std::vector<std::pair<uint64_t, AccessRing *>> localRings;
+
+}
+
+struct AccessRing {
+    AccessRecord records[RING_SIZE];
+    alignas(64) std::atomic<uint64_t> head{0};  // written by the producer
+    alignas(64) std::atomic<uint64_t> tail{0};  // written by the writer thread
+    std::atomic<uint64_t> dropped{0};
+};
+
+AccessLog::AccessLog(int fd, AccessLogFormat format) :
+        fd_(fd), format_(format), id_(nextLogId++), stopping_(false), reportedDrops_(0) {}
+
+AccessLog::~AccessLog() {
+    close();
+    ::close(fd_);
+}
+
+AccessRing *AccessLog::ring_() {
+    for (auto &&[id, ring]: localRings) {
+        if (id == id_) return ring;
+    }
+    std::lock_guard guard(lock_);
+    rings_.push_back(std::make_unique<AccessRing>());
+    localRings.emplace_back(id_, rings_.back().get());
+    return rings_.back().get();
+}
+
+void AccessLog::log(const AccessRecord &r) {
+    AccessRing *ring = ring_();
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    if (h - ring->tail.load(std::memory_order_acquire) == RING_SIZE) {
+        bump(ring->dropped, uint64_t(1));
+        return;
+    }
+    AccessRecord &slot = ring->records[h & (RING_SIZE - 1)];
+    // the target is copied only as far as it is used
+    memcpy(&slot, &r, offsetof(AccessRecord, target) + r.keptTargetLen());
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+uint64_t AccessLog::dropped() const {
+    uint64_t n = 0;
+    std::lock_guard guard(lock_);
+    for (auto &&r: rings_) {
+        n += r->dropped.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+void AccessLog::close() {
+    {
+        std::lock_guard guard(lock_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    if (writer_.joinable()) writer_.join();
+}
+
+void AccessLog::run_() {
+    for (;;) {
+        size_t n = drain_();
+        size_t pending = format_ == AccessLogFormat::JSON ? buf_.size() : encoder_.size();
+        if (pending >= WRITE_BATCH || (n == 0 && pending)) {
+            flush_();
+        }
+        uint64_t drops = dropped();
+        if (drops != reportedDrops_) {
+            Logger::global->log(LOG_WARN, "access log: " + std::to_string(drops - reportedDrops_) +
+                                          " records dropped, writer cannot keep up");
+            reportedDrops_ = drops;
+        }
+        if (n == 0) {
+            std::unique_lock guard(lock_);
+            if (stopping_) break;
+            cond_.wait_for(guard, IDLE_WAIT);
+        }
+    }
+    drain_();
+    flush_();
+}
+
+size_t AccessLog::drain_() {
+    std::vector<AccessRing *> rings;
+    {
+        std::lock_guard guard(lock_);
+        for (auto &&r: rings_) rings.push_back(r.get());
+    }
+    size_t n = 0;
+    for (AccessRing *ring: rings) {
+        uint64_t t = ring->tail.load(std::memory_order_relaxed);
+        uint64_t h = ring->head.load(std::memory_order_acquire);
+        for (; t != h; ++t, ++n) {
+            const AccessRecord &r = ring->records[t & (RING_SIZE - 1)];
+            if (format_ == AccessLogFormat::JSON) {
+                appendAccessJson(buf_, r);
+            } else {
+                encoder_.add(r);
+            }
+        }
+        ring->tail.store(t, std::memory_order_release);
+    }
+    return n;
+}
+
+// one write per batch, a binary batch is one block
+void AccessLog::flush_() {
+    encoder_.finish(buf_);
+    size_t pos = 0;
+    while (pos < buf_.size()) {
+        ssize_t n = ::write(fd_, buf_.data() + pos, buf_.size() - pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            Logger::global->log(LOG_WARN, std::string("access log: ") + strerror(errno));
+            break;
+        }
+        pos += n;
+    }
+    buf_.clear();
+}
+
+std::shared_ptr<AccessLog> AccessLog::create(const std::string &path, AccessLogFormat format, int &ec) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ec = errno;
+        return nullptr;
+    }
+    ec = 0;
+    std::shared_ptr<AccessLog> log(new AccessLog(fd, format));
+    log->writer_ = std::thread([ptr = log.get()]() {
+        ptr->run_();
+    });
+    return log;
+}
+
+}
@@ -0,0 +1,63 @@
+#ifndef SIMPLE_HTTP_SERVER_ACCESS_LOG_HPP
+#define SIMPLE_HTTP_SERVER_ACCESS_LOG_HPP
+
+#include "io_context.hpp"
+#include "access_log_format.hpp"
+#include<atomic>
+#include<condition_variable>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+#include<memory>
+#include<cstdint>
+
+namespace SHS1 {
+
+struct AccessRing;
+
+// access log written by a background thread: every loop thread pushes records into its own
+// single-producer ring, the writer drains all rings, formats and writes them in batches;
+// a full ring drops the record (counted) rather than blocking or waking the writer
+class AccessLog final : private SNL1::DisableCopy {
+public:
+    ~AccessLog();
+
+    // any thread, never blocks and never enters the kernel
+    void log(const AccessRecord &r);
+
+    // records dropped because a ring was full
+    uint64_t dropped() const;
+
+    // drain what is queued and stop the writer, later records are dropped
+    void close();
+
+    static std::shared_ptr<AccessLog> create(const std::string &path, AccessLogFormat format, int &ec);
+
+private:
+    int fd_;
+    AccessLogFormat format_;
+    uint64_t id_;
+    mutable std::mutex lock_;  // guards rings_ and stopping_
+    std::condition_variable cond_;
+    std::vector<std::unique_ptr<AccessRing>> rings_;
+    bool stopping_;
+    std::thread writer_;
+    uint64_t reportedDrops_;
+    std::string buf_;
+    AccessLogEncoder encoder_;
+
+    AccessLog(int fd, AccessLogFormat format);
+
+    AccessRing *ring_();
+
+    void run_();
+
+    size_t drain_();
+
+    void flush_();
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_ACCESS_LOG_HPP
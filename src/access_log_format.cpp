@@ -0,0 +1,309 @@
+#include "access_log_format.hpp"
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+
+#ifdef SHS_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace SHS1 {
+
+namespace {
+
+constexpr char BLOCK_MAGIC[4] = {'S', 'H', 'L', '1'};
+constexpr size_t BLOCK_HEADER = 13;
+constexpr size_t MAX_BLOCK = 64 * 1024 * 1024;  // sanity bound for the decoder
+constexpr uint8_t BLOCK_STORED = 0, BLOCK_ZLIB = 1;
+
+enum StringField {
+    FIELD_METHOD, FIELD_AGENT, FIELD_TARGET
+};
+
+void putVarint(std::string &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+bool getVarint(const char *p, size_t n, size_t &pos, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && pos < n; shift += 7) {
+        auto b = (uint8_t) p[pos++];
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+void put32(std::string &out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back(char(v >> (8 * i)));
+}
+
+uint32_t get32(const char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= uint32_t((uint8_t) p[i]) << (8 * i);
+    return v;
+}
+
+void appendEscaped(std::string &out, const char *s, size_t n, bool csv) {
+    out.push_back('"');
+    for (size_t i = 0; i < n; ++i) {
+        auto c = (unsigned char) s[i];
+        if (csv) {
+            if (c == '"') out.push_back('"');
+            out.push_back(char(c));
+        } else if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(char(c));
+        } else if (c < 0x20 || c == 0x7f) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out.append(esc);
+        } else {
+            out.push_back(char(c));
+        }
+    }
+    out.push_back('"');
+}
+
+void appendTime(std::string &out, int64_t ns) {
+    time_t sec = ns / 1000000000;
+    tm t{};
+    gmtime_r(&sec, &t);
+    char ts[48];
+    snprintf(ts, sizeof(ts), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+             t.tm_hour, t.tm_min, t.tm_sec, int(ns / 1000000 % 1000));
+    out.append(ts);
+}
+
+}
+
+void AccessRecord::setMethod(const std::string &m) {
+    memset(method, 0, sizeof(method));
+    memcpy(method, m.data(), std::min(m.size(), sizeof(method)));
+}
+
+void AccessRecord::setAgent(const std::string &a) {
+    agentLen = uint16_t(std::min(a.size(), ACCESS_AGENT_MAX));
+    memcpy(agent, a.data(), agentLen);
+}
+
+void AccessRecord::setTarget(const std::string &t) {
+    targetLen = uint16_t(std::min<size_t>(t.size(), UINT16_MAX));
+    memcpy(target, t.data(), keptTargetLen());
+}
+
+size_t AccessRecord::methodLen() const {
+    return strnlen(method, sizeof(method));
+}
+
+size_t AccessRecord::keptTargetLen() const {
+    return std::min<size_t>(targetLen, ACCESS_TARGET_MAX);
+}
+
+uint8_t AccessRecord::versionOf(const std::string &v) {
+    return v.size() == 3 && v[1] == '.' ? uint8_t((v[0] - '0') * 10 + (v[2] - '0')) : 0;
+}
+
+int64_t AccessRecord::wallTime(uint64_t ago) {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - int64_t(ago);
+}
+
+void appendAccessJson(std::string &out, const AccessRecord &r) {
+    out.append("{\"time\":\"");
+    appendTime(out, r.time);
+    out.append("\",\"method\":");
+    appendEscaped(out, r.method, r.methodLen(), false);
+    out.append(",\"target\":");
+    appendEscaped(out, r.target, r.keptTargetLen(), false);
+    if (r.targetLen > ACCESS_TARGET_MAX) {
+        out.append(",\"target_len\":").append(std::to_string(r.targetLen));
+    }
+    char rest[160];
+    snprintf(rest, sizeof(rest),
+             ",\"version\":\"%d.%d\",\"status\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"latency_us\":%.1f",
+             r.version / 10, r.version % 10, unsigned(r.status), (unsigned long long) r.bytesIn,
+             (unsigned long long) r.bytesOut, double(r.latency) / 1e3);
+    out.append(rest).append(",\"user_agent\":");
+    appendEscaped(out, r.agent, r.agentLen, false);
+    out.append("}\n");
+}
+
+void appendAccessCsv(std::string &out, const AccessRecord &r) {
+    appendTime(out, r.time);
+    out.push_back(',');
+    appendEscaped(out, r.method, r.methodLen(), true);
+    out.push_back(',');
+    appendEscaped(out, r.target, r.keptTargetLen(), true);
+    char rest[128];
+    snprintf(rest, sizeof(rest), ",%d.%d,%u,%llu,%llu,%.1f,",
+             r.version / 10, r.version % 10, unsigned(r.status), (unsigned long long) r.bytesIn,
+             (unsigned long long) r.bytesOut, double(r.latency) / 1e3);
+    out.append(rest);
+    appendEscaped(out, r.agent, r.agentLen, true);
+    out.push_back('\n');
+}
+
+AccessLogEncoder::AccessLogEncoder() : prevTime_(0) {}
+
+void AccessLogEncoder::add(const AccessRecord &r) {
+    // records from different loop threads interleave, so the time delta may be negative
+    int64_t delta = r.time - prevTime_;
+    prevTime_ = r.time;
+    putVarint(raw_, (uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+    putVarint(raw_, r.latency);
+    putVarint(raw_, r.status);
+    putVarint(raw_, r.version);
+    putVarint(raw_, r.bytesIn);
+    putVarint(raw_, r.bytesOut);
+    string_(FIELD_METHOD, r.method, r.methodLen());
+    string_(FIELD_AGENT, r.agent, r.agentLen);
+    string_(FIELD_TARGET, r.target, r.keptTargetLen());
+    putVarint(raw_, r.targetLen);
+}
+
+void AccessLogEncoder::string_(int field, const char *s, size_t n) {
+    auto [it, added] = dict_[field].emplace(std::string(s, n), dict_[field].size() + 1);
+    if (!added) {
+        putVarint(raw_, it->second);
+        return;
+    }
+    putVarint(raw_, 0);
+    putVarint(raw_, n);
+    raw_.append(s, n);
+}
+
+size_t AccessLogEncoder::size() const {
+    return raw_.size();
+}
+
+void AccessLogEncoder::finish(std::string &out) {
+    if (raw_.empty())return;
+    uint8_t method = BLOCK_STORED;
+    std::string packed;
+#ifdef SHS_ENABLE_ZLIB
+    uLongf len = compressBound(raw_.size());
+    packed.resize(len);
+    if (compress2(reinterpret_cast<Bytef *>(packed.data()), &len,
+                  reinterpret_cast<const Bytef *>(raw_.data()), raw_.size(), Z_DEFAULT_COMPRESSION) == Z_OK &&
+        len < raw_.size()) {
+        packed.resize(len);
+        method = BLOCK_ZLIB;
+    }
+#endif
+    const std::string &payload = method == BLOCK_ZLIB ? packed : raw_;
+    out.append(BLOCK_MAGIC, sizeof(BLOCK_MAGIC));
+    out.push_back(char(method));
+    put32(out, uint32_t(raw_.size()));
+    put32(out, uint32_t(payload.size()));
+    out.append(payload);
+    raw_.clear();
+    for (auto &&d: dict_) d.clear();
+    prevTime_ = 0;
+}
+
+bool AccessLogDecoder::feed(const char *data, size_t len, const std::function<void(const AccessRecord &)> &cb,
+                            std::string &error) {
+    in_.append(data, len);
+    size_t pos = 0;
+    while (in_.size() - pos >= BLOCK_HEADER) {
+        const char *h = in_.data() + pos;
+        if (memcmp(h, BLOCK_MAGIC, sizeof(BLOCK_MAGIC)) != 0) {
+            error = "bad block magic at offset " + std::to_string(pos);
+            return false;
+        }
+        uint32_t raw = get32(h + 5), payload = get32(h + 9);
+        if (raw > MAX_BLOCK || payload > MAX_BLOCK) {
+            error = "block too large";
+            return false;
+        }
+        if (in_.size() - pos - BLOCK_HEADER < payload)break;
+        const char *p = h + BLOCK_HEADER;
+        std::string inflated;
+        if (h[4] == BLOCK_ZLIB) {
+#ifdef SHS_ENABLE_ZLIB
+            inflated.resize(raw);
+            uLongf out = raw;
+            if (uncompress(reinterpret_cast<Bytef *>(inflated.data()), &out,
+                           reinterpret_cast<const Bytef *>(p), payload) != Z_OK || out != raw) {
+                error = "corrupt compressed block";
+                return false;
+            }
+            p = inflated.data();
+#else
+            error = "compressed block, rebuild with zlib";
+            return false;
+#endif
+        } else if (h[4] != BLOCK_STORED || raw != payload) {
+            error = "unknown block method";
+            return false;
+        }
+        if (!block_(p, raw, cb, error)) return false;
+        pos += BLOCK_HEADER + payload;
+    }
+    in_.erase(0, pos);
+    return true;
+}
+
+bool AccessLogDecoder::idle() const {
+    return in_.empty();
+}
+
+bool AccessLogDecoder::block_(const char *p, size_t n, const std::function<void(const AccessRecord &)> &cb,
+                              std::string &error) {
+    std::vector<std::string> dict[3];
+    size_t pos = 0;
+    int64_t time = 0;
+    auto string = [&](int field, std::string &s) {
+        uint64_t id, len;
+        if (!getVarint(p, n, pos, id)) return false;
+        if (id == 0) {
+            if (!getVarint(p, n, pos, len) || len > n - pos) return false;
+            dict[field].emplace_back(p + pos, len);
+            pos += len;
+            s = dict[field].back();
+            return true;
+        }
+        if (id > dict[field].size()) return false;
+        s = dict[field][id - 1];
+        return true;
+    };
+    std::string method, agent, target;
+    while (pos < n) {
+        AccessRecord r{};
+        uint64_t v[6], targetLen;
+        for (uint64_t &x: v) {
+            if (!getVarint(p, n, pos, x)) {
+                error = "truncated record";
+                return false;
+            }
+        }
+        time += int64_t(v[0] >> 1) ^ -int64_t(v[0] & 1);
+        if (!string(FIELD_METHOD, method) || !string(FIELD_AGENT, agent) || !string(FIELD_TARGET, target) ||
+            !getVarint(p, n, pos, targetLen)) {
+            error = "bad string reference";
+            return false;
+        }
+        r.time = time;
+        r.latency = v[1];
+        r.status = uint16_t(v[2]);
+        r.version = uint8_t(v[3]);
+        r.bytesIn = v[4];
+        r.bytesOut = v[5];
+        r.setMethod(method);
+        r.setAgent(agent);
+        r.setTarget(target);
+        r.targetLen = uint16_t(std::max<uint64_t>(targetLen, r.targetLen));
+        cb(r);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,102 @@
+#ifndef SIMPLE_HTTP_SERVER_ACCESS_LOG_FORMAT_HPP
+#define SIMPLE_HTTP_SERVER_ACCESS_LOG_FORMAT_HPP
+
+#include<functional>
+#include<string>
+#include<unordered_map>
+#include<cstdint>
+#include<cstddef>
+
+namespace SHS1 {
+
+constexpr size_t ACCESS_AGENT_MAX = 128;
+constexpr size_t ACCESS_TARGET_MAX = 192;
+
+// one request, fixed size so the loop thread only copies it into its ring
+struct AccessRecord {
+    int64_t time;           // request start, ns since the Unix epoch
+    uint64_t latency;       // ns until the last response byte was written
+    uint64_t bytesIn;       // request body
+    uint64_t bytesOut;      // response, header included
+    uint16_t status;
+    uint8_t version;        // 10, 11 or 20
+    char method[8];         // NUL padded, truncated
+    uint16_t agentLen;      // User-Agent, truncated
+    char agent[ACCESS_AGENT_MAX];
+    uint16_t targetLen;     // full length, only the first ACCESS_TARGET_MAX bytes are kept
+    char target[ACCESS_TARGET_MAX];  // last, so copies can stop at the end of the target
+
+    void setMethod(const std::string &m);
+
+    void setAgent(const std::string &a);
+
+    void setTarget(const std::string &t);
+
+    size_t methodLen() const;
+
+    size_t keptTargetLen() const;
+
+    static uint8_t versionOf(const std::string &v);
+
+    // wall clock time ago ns before now, in ns since the Unix epoch
+    static int64_t wallTime(uint64_t ago);
+};
+
+enum class AccessLogFormat {
+    JSON,   // one object per line
+    BINARY  // AccessLogEncoder blocks
+};
+
+void appendAccessJson(std::string &out, const AccessRecord &r);
+
+constexpr char ACCESS_CSV_HEADER[] = "time,method,target,version,status,bytes_in,bytes_out,latency_us,user_agent\n";
+
+void appendAccessCsv(std::string &out, const AccessRecord &r);
+
+// binary access log: a sequence of independent blocks, so a file may be appended to across
+// restarts and a torn last block only loses itself
+//   block:  "SHL1" | method (0 stored, 1 zlib) | raw length (u32le) | payload length (u32le) | payload
+//   record: zigzag varint time delta | varint latency, status, version, bytes in, bytes out |
+//           method, agent, target as strings | varint full target length
+//   string: varint 0 followed by varint length and bytes adds a literal to the field's dictionary,
+//           any other varint n refers to entry n - 1; dictionaries start empty in every block
+class AccessLogEncoder final {
+public:
+    AccessLogEncoder();
+
+    void add(const AccessRecord &r);
+
+    // raw bytes of the pending block
+    size_t size() const;
+
+    // append the pending block (if any) to out and start a new one
+    void finish(std::string &out);
+
+private:
+    std::string raw_;
+    std::unordered_map<std::string, uint64_t> dict_[3];
+    int64_t prevTime_;
+
+    void string_(int field, const char *s, size_t n);
+};
+
+class AccessLogDecoder final {
+public:
+    // data may end anywhere, an incomplete block is kept for the next call;
+    // returns false with error set on corrupt input
+    bool feed(const char *data, size_t len, const std::function<void(const AccessRecord &)> &cb,
+              std::string &error);
+
+    // true if no partial block is pending
+    bool idle() const;
+
+private:
+    std::string in_;
+
+    static bool block_(const char *p, size_t n, const std::function<void(const AccessRecord &)> &cb,
+                       std::string &error);
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_ACCESS_LOG_FORMAT_HPP
@@ -0,0 +1,164 @@
+#include "body_spool.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+
+namespace SHS1 {
+
+namespace {
+
+bool writeAll(int fd, const char *p, size_t n, int &ec) {
+    while (n > 0) {
+        ssize_t r = ::write(fd, p, n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            ec = errno;
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+// unlinked file in dir, O_TMPFILE where the filesystem supports it
+int openTemporary(const std::string &dir, int &ec) {
+    int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+    std::string path = dir + "/shs-body-XXXXXX";
+    fd = mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        ec = errno;
+        return -1;
+    }
+    unlink(path.c_str());
+    return fd;
+}
+
+}
+
+SpoolBudget::SpoolBudget(size_t limit) : limit_(limit), used_(0) {}
+
+bool SpoolBudget::take(size_t n) {
+    size_t used = used_.load(std::memory_order_relaxed);
+    do {
+        if (n > limit_ - std::min(used, limit_)) return false;
+    } while (!used_.compare_exchange_weak(used, used + n, std::memory_order_relaxed));
+    return true;
+}
+
+void SpoolBudget::give(size_t n) {
+    used_.fetch_sub(n, std::memory_order_relaxed);
+}
+
+size_t SpoolBudget::used() const {
+    return used_.load(std::memory_order_relaxed);
+}
+
+BodySpool::BodySpool(size_t memoryLimit, std::string dir, std::shared_ptr<SpoolBudget> budget) :
+        memoryLimit_(memoryLimit), dir_(std::move(dir)), budget_(std::move(budget)), taken_(0), fd_(-1), size_(0),
+        map_(nullptr), mapLen_(0) {}
+
+BodySpool::~BodySpool() {
+    unmap_();
+    if (fd_ >= 0) ::close(fd_);
+    if (budget_) budget_->give(taken_);
+}
+
+bool BodySpool::spill_(int &ec) {
+    fd_ = openTemporary(dir_, ec);
+    if (fd_ < 0) return false;
+    if (!writeAll(fd_, mem_.data(), mem_.size(), ec)) {
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    std::string().swap(mem_);
+    if (budget_) budget_->give(taken_);
+    taken_ = 0;
+    return true;
+}
+
+void BodySpool::unmap_() {
+    if (map_) munmap(map_, size_t(mapLen_));
+    map_ = nullptr;
+    mapLen_ = 0;
+}
+
+bool BodySpool::append(const char *data, size_t len, int &ec) {
+    ec = 0;
+    if (fd_ < 0) {
+        bool fits = mem_.size() + len <= memoryLimit_ && (!budget_ || budget_->take(len));
+        if (fits) {
+            taken_ += len;
+        } else if (!spill_(ec)) {
+            return false;
+        }
+    }
+    if (fd_ >= 0) {
+        if (!writeAll(fd_, data, len, ec)) return false;
+    } else {
+        mem_.append(data, len);
+    }
+    size_ += len;
+    return true;
+}
+
+std::pair<const char *, uint64_t> BodySpool::view(int &ec) {
+    ec = 0;
+    if (fd_ < 0) return {mem_.data(), size_};
+    if (!size_) return {"", 0};
+    if (mapLen_ != size_) {
+        unmap_();
+        void *p = mmap(nullptr, size_t(size_), PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) {
+            ec = errno;
+            return {nullptr, 0};
+        }
+        madvise(p, size_t(size_), MADV_SEQUENTIAL);
+        map_ = p;
+        mapLen_ = size_;
+    }
+    return {(const char *) map_, size_};
+}
+
+int BodySpool::fd(int &ec) {
+    ec = 0;
+    if (fd_ < 0 && !spill_(ec)) return -1;
+    return fd_;
+}
+
+size_t BodySpool::read(uint64_t offset, char *buf, size_t len, int &ec) const {
+    ec = 0;
+    if (offset >= size_) return 0;
+    len = size_t(std::min<uint64_t>(len, size_ - offset));
+    if (fd_ < 0) {
+        memcpy(buf, mem_.data() + offset, len);
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = ::pread(fd_, buf + done, len - done, off_t(offset + done));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            ec = r < 0 ? errno : EIO;
+            break;
+        }
+        done += r;
+    }
+    return done;
+}
+
+uint64_t BodySpool::size() const {
+    return size_;
+}
+
+bool BodySpool::inMemory() const {
+    return fd_ < 0;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef SIMPLE_HTTP_SERVER_BODY_SPOOL_HPP
+#define SIMPLE_HTTP_SERVER_BODY_SPOOL_HPP
+
+#include "io_context.hpp"
+#include<string>
+#include<memory>
+#include<atomic>
+#include<utility>
+#include<cstdint>
+#include<cstddef>
+
+namespace SHS1 {
+
+// memory shared by the spools of all connections, so a burst of uploads cannot exhaust RAM;
+// a spool that gets no more moves to disk early
+class SpoolBudget final : private SNL1::DisableCopy {
+public:
+    explicit SpoolBudget(size_t limit);
+
+    // false, taking nothing, when n more bytes would exceed the limit
+    bool take(size_t n);
+
+    void give(size_t n);
+
+    size_t used() const;
+
+private:
+    size_t limit_;
+    std::atomic<size_t> used_;
+};
+
+// append-only byte store for a request body: kept in memory up to memoryLimit bytes, and while
+// budget allows, moved to an unnamed temporary file in dir beyond that, so a large upload costs
+// disk, not RAM
+class BodySpool final : private SNL1::DisableCopy {
+public:
+    explicit BodySpool(size_t memoryLimit = 256 * 1024, std::string dir = "/tmp",
+                       std::shared_ptr<SpoolBudget> budget = nullptr);
+
+    ~BodySpool();
+
+    bool append(const char *data, size_t len, int &ec);
+
+    // up to len bytes from offset, fewer only at the end; file reads block
+    size_t read(uint64_t offset, char *buf, size_t len, int &ec) const;
+
+    // the whole body as one range: the memory buffer, or the file mapped read-only.
+    // Valid until the next append; nullptr with ec set when the file cannot be mapped
+    std::pair<const char *, uint64_t> view(int &ec);
+
+    // the body as a file, moved there first if still in memory; owned by the spool,
+    // -1 with ec set on failure
+    int fd(int &ec);
+
+    uint64_t size() const;
+
+    bool inMemory() const;
+
+private:
+    size_t memoryLimit_;
+    std::string dir_;
+    std::shared_ptr<SpoolBudget> budget_;
+    std::string mem_;
+    size_t taken_;  // of budget_, for mem_
+    int fd_;
+    uint64_t size_;
+    void *map_;
+    uint64_t mapLen_;
+
+    bool spill_(int &ec);
+
+    void unmap_();
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_BODY_SPOOL_HPP
@@ -0,0 +1,23 @@
+#ifndef SIMPLE_HTTP_SERVER_DIGEST_HPP
+#define SIMPLE_HTTP_SERVER_DIGEST_HPP
+
+#include<array>
+#include<cstdint>
+#include<cstddef>
+#include<string>
+
+namespace SHS1 {
+
+using Sha256Digest = std::array<uint8_t, 32>;
+using Sha1Digest = std::array<uint8_t, 20>;
+
+Sha256Digest sha256(const void *data, size_t len);
+
+// only for protocol handshakes that mandate it (WebSocket), not for anything security related
+Sha1Digest sha1(const void *data, size_t len);
+
+std::string base64Encode(const void *data, size_t len);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_DIGEST_HPP
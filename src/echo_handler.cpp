@@ -0,0 +1,226 @@
+#include "echo_handler.hpp"
+#include "json_writer.hpp"
+#include "websocket.hpp"
+#include "logger.hpp"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+// every message sent to /ws is relayed to all connected clients
+WebSocketGroup wsRoom;
+
+WebSocketHandler wsRoomHandler() {
+    WebSocketHandler h;
+    h.onOpen = [](const std::shared_ptr<WebSocket> &ws) {
+        wsRoom.add(ws);
+    };
+    h.onMessage = [](const std::shared_ptr<WebSocket> &, WsOpcode op, const char *data, size_t len) {
+        wsRoom.broadcast(op, data, len);
+    };
+    return h;
+}
+
+constexpr size_t ECHO_RAW_CHUNK = 48 * 1024;  // a multiple of 3, so chunks encode without padding
+constexpr size_t ECHO_SPOOL_MEMORY = 256 * 1024;
+
+// JSON before the body, base64 of the spooled body encoded one chunk at a time straight from
+// the spool's view, JSON after it; the length is known before anything is encoded
+class EchoStreamBody final : public ResponseBody {
+public:
+    EchoStreamBody(std::string prefix, std::shared_ptr<BodySpool> spool, std::string suffix) :
+            prefix_(std::move(prefix)), suffix_(std::move(suffix)), spool_(std::move(spool)),
+            offset_(0), stage_(0), aborted_(false) {}
+
+    std::pair<const char *, size_t> get() override {
+        if (stage_ == 0) {
+            stage_ = 1;
+            return {prefix_.data(), prefix_.size()};
+        }
+        if (stage_ == 1 && spool_ && offset_ < spool_->size()) {
+            int ec;
+            auto [data, size] = spool_->view(ec);
+            if (!data) {
+                Logger::global->log(LOG_WARN, std::string("echo body spool: ") + strerror(ec));
+                stage_ = 3;
+                aborted_ = true;
+                return {nullptr, 0};
+            }
+            size_t n = size_t(std::min<uint64_t>(ECHO_RAW_CHUNK, size - offset_)), len;
+            if (out_.empty()) out_.resize(ECHO_RAW_CHUNK / 3 * 4);
+            base64_encode(data + offset_, n, out_.data(), &len, 0);
+            offset_ += n;
+            return {out_.data(), len};
+        }
+        if (stage_ <= 2) {
+            stage_ = 3;
+            return {suffix_.data(), suffix_.size()};
+        }
+        return {nullptr, 0};
+    }
+
+    ssize_t len() override {
+        uint64_t n = spool_ ? spool_->size() : 0;
+        return ssize_t(prefix_.size() + (n + 2) / 3 * 4 + suffix_.size());
+    }
+
+    bool aborted() override {
+        return aborted_;
+    }
+
+private:
+    std::string prefix_, suffix_;
+    std::shared_ptr<BodySpool> spool_;
+    uint64_t offset_;
+    int stage_;  // 0 prefix, 1 body, 2 suffix, 3 done
+    bool aborted_;
+    std::string out_;
+};
+
+}
+
+EchoHandler::EchoHandler(EchoFormat format, std::shared_ptr<SpoolBudget> spoolBudget) :
+        format(format), rd{}, bs{}, hasBody{}, b64s{}, spool{}, spoolBudget(std::move(spoolBudget)),
+        spoolFailed{} {}
+
+void EchoHandler::operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+    if (header) {
+        header->result = HeaderAction::OK;
+        if (header->target == "/ws" && acceptWebSocket(header, resp, wsRoomHandler())) {
+            return;
+        }
+        auto expect = header->header.find(normalizeFieldName("Expect"));
+        if (expect != header->header.end() && !hasToken(expect->second, "100-continue")) {
+            // refused before the client sends its body
+            resp = std::make_unique<Response>();
+            resp->version = "1.1";
+            resp->status = 417;
+            resp->message = "Expectation Failed";
+            resp->header.emplace(normalizeFieldName("Server"), "simple-http-server");
+            header->result = HeaderAction::SKIP_BODY;
+            return;
+        }
+        hasBody = false;
+        bs.clear();
+        if (format == EchoFormat::STREAMING) {
+            spool = std::make_shared<BodySpool>(ECHO_SPOOL_MEMORY, "/tmp", spoolBudget);
+            spoolFailed = false;
+        }
+        if (format != EchoFormat::STYLED) {
+            size_t size = 64 + header->method.size() + header->target.size();
+            for (auto &&[k, v]: header->header) size += k.size() + v.size() + 6;
+            bs.reserve(size);
+            JsonWriter w(bs);
+            w.beginObject();
+            w.key("method", 6);
+            w.string(header->method);
+            w.key("target", 6);
+            w.string(header->target);
+            w.key("version", 7);
+            w.string(header->version);
+            w.key("header", 6);
+            w.beginObject();
+            for (auto &&[k, v]: header->header) {
+                w.key(k);
+                w.string(v);
+            }
+            w.endObject();
+            return;
+        }
+        rd = Json::objectValue;
+        rd["method"] = header->method;
+        rd["target"] = header->target;
+        rd["version"] = header->version;
+        rd["header"] = Json::objectValue;
+        for (auto &&[k, v]: header->header) {
+            rd["header"][k] = v;
+        }
+    } else if (body) {
+        if (format == EchoFormat::STREAMING) {
+            int ec;
+            if (!spoolFailed && !spool->append(body->data, body->length, ec)) {
+                Logger::global->log(LOG_WARN, std::string("echo body spool: ") + strerror(ec));
+                spoolFailed = true;
+            }
+            hasBody = true;
+            return;
+        }
+        if (!hasBody) {
+            hasBody = true;
+            base64_stream_encode_init(&b64s, 0);
+            if (format == EchoFormat::COMPACT) {
+                JsonWriter w(bs, true);
+                w.key("body", 4);
+                w.beginStringValue();
+            }
+        }
+        size_t len, old = bs.size();
+        bs.resize(old + (body->length * 4 / 3 + 4));
+        base64_stream_encode(&b64s, body->data, body->length, bs.data() + old, &len);
+        bs.resize(old + len);
+    } else {
+        if (format == EchoFormat::STREAMING) {
+            streamResponse_(resp);
+            return;
+        }
+        if (hasBody) {
+            size_t len, old = bs.size();
+            bs.resize(old + 4);
+            base64_stream_encode_final(&b64s, bs.data() + old, &len);
+            bs.resize(old + len);
+        }
+        std::string out;
+        if (format == EchoFormat::COMPACT) {
+            JsonWriter w(bs, true);
+            if (hasBody) w.endStringValue();
+            w.endObject();
+            out = std::move(bs);
+            bs.clear();
+        } else {
+            if (hasBody) rd["body"] = bs;
+            out = rd.toStyledString();
+        }
+        resp = std::make_unique<Response>();
+        resp->version = "1.1";
+        resp->status = 200;
+        resp->message = "OK";
+        resp->header.emplace(normalizeFieldName("Server"), "simple-http-server");
+        resp->header.emplace(normalizeFieldName("Content-Type"), "application/json");
+        resp->header.emplace(normalizeFieldName("Cache-Control"), "max-age=0");
+        resp->body = std::make_unique<StringResponse>(std::move(out));
+    }
+}
+
+void EchoHandler::streamResponse_(std::unique_ptr<Response> &resp) {
+    resp = std::make_unique<Response>();
+    resp->version = "1.1";
+    resp->header.emplace(normalizeFieldName("Server"), "simple-http-server");
+    resp->header.emplace(normalizeFieldName("Cache-Control"), "max-age=0");
+    if (spoolFailed) {
+        resp->status = 500;
+        resp->message = "Internal Server Error";
+        resp->body = std::make_unique<StringResponse>("cannot store request body\n");
+    } else {
+        std::string suffix;
+        JsonWriter prefix(bs, true), end(suffix, true);
+        if (hasBody) {
+            prefix.key("body", 4);
+            prefix.beginStringValue();
+            end.endStringValue();
+        }
+        end.endObject();
+        resp->status = 200;
+        resp->message = "OK";
+        resp->header.emplace(normalizeFieldName("Content-Type"), "application/json");
+        resp->body = std::make_unique<EchoStreamBody>(std::move(bs), hasBody ? std::move(spool) : nullptr,
+                                                      std::move(suffix));
+    }
+    bs.clear();
+    spool.reset();
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef SIMPLE_HTTP_SERVER_ECHO_HANDLER_HPP
+#define SIMPLE_HTTP_SERVER_ECHO_HANDLER_HPP
+
+#include "http_server.hpp"
+#include "body_spool.hpp"
+#include "json.h"
+#include "libbase64.h"
+#include<string>
+#include<memory>
+
+namespace SHS1 {
+
+enum class EchoFormat {
+    COMPACT,  // written with JsonWriter while the request arrives, in request order
+    STYLED,   // Json::Value tree serialized by toStyledString(), keys sorted and indented
+    STREAMING // as COMPACT, but the request body is spooled (to disk when large) and base64
+              // encoded chunk by chunk while the response is written
+};
+
+// demo handler: answers with the request line, header and base64 body as JSON,
+// "/ws" joins a WebSocket room relaying every message to all members
+struct EchoHandler {
+    EchoFormat format;
+    Json::Value rd;
+    std::string bs;  // STYLED: the base64 body, COMPACT: the whole response body, STREAMING: the part before it
+    bool hasBody;
+    base64_state b64s;
+    std::shared_ptr<BodySpool> spool;  // STREAMING only
+    std::shared_ptr<SpoolBudget> spoolBudget;  // shared by the spools of all connections, may be null
+    bool spoolFailed;
+
+    explicit EchoHandler(EchoFormat format = EchoFormat::COMPACT, std::shared_ptr<SpoolBudget> spoolBudget = nullptr);
+
+    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp);
+
+private:
+    void streamResponse_(std::unique_ptr<Response> &resp);
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_ECHO_HANDLER_HPP
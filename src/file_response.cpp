@@ -0,0 +1,387 @@
+#include "file_response.hpp"
+#include "logger.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <random>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr size_t FILE_CHUNK = 64 * 1024;
+constexpr size_t MAX_RANGES = 16;  // more is treated as no Range at all
+
+std::string httpDate(time_t t) {
+    tm g{};
+    gmtime_r(&t, &g);
+    char buf[40];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &g);
+    return buf;
+}
+
+// IMF-fixdate only, -1 for anything else
+time_t parseHttpDate(const std::string &s) {
+    tm g{};
+    const char *end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &g);
+    return end && *end == '\0' ? timegm(&g) : time_t(-1);
+}
+
+const std::string *find(const std::unordered_map<std::string, std::string> &m, const char *name) {
+    auto it = m.find(normalizeFieldName(name));
+    return it == m.end() ? nullptr : &it->second;
+}
+
+// If-None-Match: "*" or a list of entity tags, compared weakly (W/ ignored)
+bool noneMatch(const std::string &list, const std::string &etag) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        size_t b = list.find_first_not_of(" \t", pos);
+        size_t e = list.find_last_not_of(" \t", end - 1);
+        if (b < end) {
+            std::string tag = list.substr(b, e - b + 1);
+            if (tag == "*") return false;
+            if (tag.compare(0, 2, "W/") == 0) tag.erase(0, 2);
+            if (tag == etag) return false;
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+bool parseNumber(const std::string &s, size_t b, size_t e, uint64_t &v) {
+    if (b >= e || e - b > 19) return false;
+    v = 0;
+    for (size_t i = b; i < e; ++i) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        v = v * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+enum class RangeResult {
+    IGNORE, UNSATISFIABLE, OK
+};
+
+// "bytes=" range set (RFC 9110 14.1.2), sorted and coalesced into out
+RangeResult parseRanges(const std::string &spec, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>> &out) {
+    if (spec.compare(0, 6, "bytes=") != 0) return RangeResult::IGNORE;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    size_t pos = 6, count = 0;
+    while (pos <= spec.size()) {
+        size_t end = std::min(spec.find(',', pos), spec.size());
+        size_t b = spec.find_first_not_of(" \t", pos);
+        size_t e = spec.find_last_not_of(" \t", end - 1) + 1;
+        pos = end + 1;
+        if (b >= end) continue;
+        if (++count > MAX_RANGES) return RangeResult::IGNORE;
+        size_t dash = spec.find('-', b);
+        if (dash >= e) return RangeResult::IGNORE;
+        uint64_t first, last;
+        if (dash == b) {  // suffix
+            if (!parseNumber(spec, dash + 1, e, last)) return RangeResult::IGNORE;
+            if (last == 0 || size == 0) continue;
+            ranges.emplace_back(size - std::min(last, size), size - 1);
+            continue;
+        }
+        if (!parseNumber(spec, b, dash, first)) return RangeResult::IGNORE;
+        if (dash + 1 == e) {
+            last = UINT64_MAX;
+        } else if (!parseNumber(spec, dash + 1, e, last) || last < first) {
+            return RangeResult::IGNORE;
+        }
+        if (first >= size) continue;
+        ranges.emplace_back(first, std::min(last, size - 1));
+    }
+    if (count == 0) return RangeResult::IGNORE;
+    if (ranges.empty()) return RangeResult::UNSATISFIABLE;
+    std::sort(ranges.begin(), ranges.end());
+    out.clear();
+    for (auto &&r: ranges) {
+        if (!out.empty() && r.first <= out.back().second + 1) {
+            out.back().second = std::max(out.back().second, r.second);
+        } else {
+            out.push_back(r);
+        }
+    }
+    return RangeResult::OK;
+}
+
+std::string contentRange(uint64_t first, uint64_t last, uint64_t size) {
+    return "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size);
+}
+
+std::string boundary() {
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) rng());
+    return std::string("shs-") + buf;
+}
+
+void setStatus(Response &resp, int status, const char *message) {
+    resp.status = status;
+    resp.message = message;
+}
+
+const char *mimeType(const std::string &path) {
+    static const std::pair<const char *, const char *> types[] = {
+            {".html", "text/html; charset=utf-8"}, {".htm", "text/html; charset=utf-8"},
+            {".css", "text/css"}, {".js", "text/javascript"}, {".json", "application/json"},
+            {".txt", "text/plain; charset=utf-8"}, {".svg", "image/svg+xml"}, {".png", "image/png"},
+            {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"}, {".webp", "image/webp"},
+            {".wasm", "application/wasm"}, {".pdf", "application/pdf"}, {".mp4", "video/mp4"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+        for (auto &&[ext, type]: types) {
+            if (strcasecmp(path.c_str() + dot, ext) == 0) return type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+// percent-decoded path of target below root, empty if it could leave root
+std::string mapPath(const std::string &root, const std::string &rest) {
+    std::string path;
+    size_t end = std::min(rest.find('?'), rest.size());
+    for (size_t i = 0; i < end; ++i) {
+        char c = rest[i];
+        if (c == '%' && i + 2 < end && isxdigit((unsigned char) rest[i + 1]) &&
+            isxdigit((unsigned char) rest[i + 2])) {
+            c = char(std::stoi(rest.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        }
+        if (c == '\0') return {};
+        path.push_back(c);
+    }
+    size_t pos = 0;
+    while (pos <= path.size()) {
+        size_t slash = std::min(path.find('/', pos), path.size());
+        if (path.compare(pos, slash - pos, "..") == 0 && slash - pos == 2) return {};
+        pos = slash + 1;
+    }
+    if (path.empty() || path[0] != '/') path.insert(0, "/");
+    return root + path;
+}
+
+class StaticFileHandler final {
+public:
+    StaticFileHandler(std::string prefix, std::string root, long maxAge, RequestHandler inner) :
+            prefix_(std::move(prefix)), root_(std::move(root)), maxAge_(maxAge), inner_(std::move(inner)),
+            active_(false) {}
+
+    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+        if (header) {
+            active_ = header->target.compare(0, prefix_.size(), prefix_) == 0 &&
+                      (header->method == "GET" || header->method == "HEAD");
+            if (active_) path_ = mapPath(root_, header->target.substr(prefix_.size()));
+        }
+        if (!active_) {
+            inner_(header, body, resp);
+            return;
+        }
+        if (header || body) return;
+        resp = std::make_unique<Response>();
+        resp->version = "1.1";
+        int ec = ENOENT;
+        std::unique_ptr<FileResponse> file = path_.empty() ? nullptr : FileResponse::create(path_, ec);
+        if (!file) {
+            bool missing = ec == ENOENT || ec == ENOTDIR || ec == EISDIR;
+            setStatus(*resp, missing ? 404 : 403, missing ? "Not Found" : "Forbidden");
+            resp->header.emplace(normalizeFieldName("Content-Type"), "text/plain");
+            resp->body = std::make_unique<StringResponse>(missing ? "not found\n" : "forbidden\n");
+            return;
+        }
+        setStatus(*resp, 200, "OK");
+        resp->header.emplace(normalizeFieldName("Content-Type"), mimeType(path_));
+        if (maxAge_ > 0) {
+            resp->header.emplace(normalizeFieldName("Cache-Control"), "max-age=" + std::to_string(maxAge_));
+        }
+        resp->body = std::move(file);
+    }
+
+private:
+    std::string prefix_, root_;
+    long maxAge_;
+    RequestHandler inner_;
+    bool active_;
+    std::string path_;
+};
+
+}
+
+FileResponse::FileResponse(std::string path, uint64_t size, time_t mtime, std::string etag) :
+        path_(std::move(path)), fd_(-1), size_(size), mtime_(mtime), etag_(std::move(etag)),
+        segments_{{std::string(), 0, size}}, seg_(0), textDone_(false), aborted_(false), done_(0) {}
+
+FileResponse::~FileResponse() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+std::unique_ptr<FileResponse> FileResponse::create(const std::string &path, int &ec) {
+    struct stat st{};
+    if (::stat(path.c_str(), &st) < 0) {
+        ec = errno;
+        return nullptr;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        ec = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return nullptr;
+    }
+    ec = 0;
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long) st.st_ino,
+             (unsigned long long) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+             (unsigned long long) st.st_size);
+    return std::unique_ptr<FileResponse>(new FileResponse(path, st.st_size, st.st_mtim.tv_sec, etag));
+}
+
+const std::string &FileResponse::etag() const {
+    return etag_;
+}
+
+time_t FileResponse::lastModified() const {
+    return mtime_;
+}
+
+uint64_t FileResponse::size() const {
+    return size_;
+}
+
+void FileResponse::setRanges(const std::vector<std::pair<uint64_t, uint64_t>> &ranges,
+                             const std::string &contentType, const std::string &boundary) {
+    segments_.clear();
+    if (ranges.size() == 1) {
+        segments_.push_back({std::string(), ranges[0].first, ranges[0].second - ranges[0].first + 1});
+        return;
+    }
+    for (auto &&[first, last]: ranges) {
+        std::string part = "\r\n--" + boundary + "\r\n";
+        if (!contentType.empty()) part += "Content-Type: " + contentType + "\r\n";
+        part += "Content-Range: " + contentRange(first, last, size_) + "\r\n\r\n";
+        segments_.push_back({std::move(part), first, last - first + 1});
+    }
+    segments_.push_back({"\r\n--" + boundary + "--\r\n", 0, 0});
+}
+
+ssize_t FileResponse::len() {
+    uint64_t n = 0;
+    for (auto &&s: segments_) n += s.text.size() + s.length;
+    return ssize_t(n);
+}
+
+bool FileResponse::aborted() {
+    return aborted_;
+}
+
+std::pair<const char *, size_t> FileResponse::get() {
+    while (seg_ < segments_.size()) {
+        Segment &s = segments_[seg_];
+        if (!textDone_) {
+            textDone_ = true;
+            if (!s.text.empty()) return {s.text.data(), s.text.size()};
+        }
+        if (done_ == s.length) {
+            ++seg_;
+            textDone_ = false;
+            done_ = 0;
+            continue;
+        }
+        if (fd_ < 0 && (fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+            Logger::global->log(LOG_WARN, path_ + ": " + strerror(errno));
+            aborted_ = true;
+            break;
+        }
+        buf_.resize(size_t(std::min<uint64_t>(FILE_CHUNK, s.length - done_)));
+        ssize_t n;
+        do {
+            n = ::pread(fd_, buf_.data(), buf_.size(), off_t(s.offset + done_));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {  // the file shrank or failed after its length was sent
+            Logger::global->log(LOG_WARN, path_ + ": " + (n < 0 ? strerror(errno) : "truncated while sending"));
+            aborted_ = true;
+            break;
+        }
+        done_ += n;
+        return {buf_.data(), size_t(n)};
+    }
+    seg_ = segments_.size();
+    return {nullptr, 0};
+}
+
+void applyFileConditionals(const std::string &method, const std::unordered_map<std::string, std::string> &request,
+                           Response &resp) {
+    auto file = dynamic_cast<FileResponse *>(resp.body.get());
+    if (!file || resp.status != 200) return;
+    std::string lastModified = httpDate(file->lastModified());
+    resp.header[normalizeFieldName("ETag")] = file->etag();
+    resp.header[normalizeFieldName("Last-Modified")] = lastModified;
+    resp.header[normalizeFieldName("Accept-Ranges")] = "bytes";
+    bool get = method == "GET" || method == "HEAD";
+    if (!get) return;
+
+    // If-Modified-Since only counts without If-None-Match (RFC 9110 13.2.2)
+    bool notModified;
+    if (const std::string *inm = find(request, "If-None-Match")) {
+        notModified = !noneMatch(*inm, file->etag());
+    } else if (const std::string *ims = find(request, "If-Modified-Since")) {
+        time_t since = parseHttpDate(*ims);
+        notModified = since != time_t(-1) && file->lastModified() <= since;
+    } else {
+        notModified = false;
+    }
+    if (notModified) {
+        setStatus(resp, 304, "Not Modified");
+        resp.header.erase(normalizeFieldName("Content-Type"));
+        resp.body.reset();
+        return;
+    }
+
+    const std::string *range = method == "GET" ? find(request, "Range") : nullptr;
+    if (!range) return;
+    if (const std::string *ifRange = find(request, "If-Range")) {
+        // an entity tag must match strongly, a date exactly
+        bool current = (*ifRange)[0] == '"' ? *ifRange == file->etag() : *ifRange == lastModified;
+        if (!current) return;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    switch (parseRanges(*range, file->size(), ranges)) {
+        case RangeResult::IGNORE:
+            return;
+        case RangeResult::UNSATISFIABLE:
+            setStatus(resp, 416, "Range Not Satisfiable");
+            resp.header[normalizeFieldName("Content-Range")] = "bytes */" + std::to_string(file->size());
+            resp.header.erase(normalizeFieldName("Content-Type"));
+            resp.body.reset();
+            return;
+        case RangeResult::OK:
+            break;
+    }
+    setStatus(resp, 206, "Partial Content");
+    auto type = resp.header.find(normalizeFieldName("Content-Type"));
+    std::string contentType = type == resp.header.end() ? std::string() : type->second;
+    if (ranges.size() == 1) {
+        resp.header[normalizeFieldName("Content-Range")] = contentRange(ranges[0].first, ranges[0].second,
+                                                                        file->size());
+        file->setRanges(ranges, contentType, std::string());
+        return;
+    }
+    std::string b = boundary();
+    resp.header[normalizeFieldName("Content-Type")] = "multipart/byteranges; boundary=" + b;
+    file->setRanges(ranges, contentType, b);
+}
+
+NewClientHandler staticFiles(NewClientHandler h, const std::string &prefix, const std::string &root,
+                             long maxAge) {
+    return [prefix, root, maxAge, h = std::move(h)]() {
+        return RequestHandler(StaticFileHandler(prefix, root, maxAge, h()));
+    };
+}
+
+}
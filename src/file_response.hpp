@@ -0,0 +1,75 @@
+#ifndef SIMPLE_HTTP_SERVER_FILE_RESPONSE_HPP
+#define SIMPLE_HTTP_SERVER_FILE_RESPONSE_HPP
+
+#include "http_server.hpp"
+#include<ctime>
+#include<string>
+#include<vector>
+#include<memory>
+#include<unordered_map>
+#include<cstdint>
+
+namespace SHS1 {
+
+// response body read from a regular file; validators come from the stat() done at creation,
+// the file itself is opened on the first get(), so a 304, 416 or HEAD answer never opens it
+class FileResponse final : public ResponseBody {
+public:
+    ~FileResponse() override;
+
+    std::pair<const char *, size_t> get() override;
+
+    ssize_t len() override;
+
+    bool aborted() override;
+
+    // strong validator derived from inode, mtime and size
+    const std::string &etag() const;
+
+    time_t lastModified() const;
+
+    uint64_t size() const;
+
+    // send only the given byte ranges (first, last inclusive; sorted, disjoint, within the file),
+    // more than one range becomes a multipart/byteranges body using boundary
+    void setRanges(const std::vector<std::pair<uint64_t, uint64_t>> &ranges, const std::string &contentType,
+                   const std::string &boundary);
+
+    // nullptr with ec set unless path is a regular file
+    static std::unique_ptr<FileResponse> create(const std::string &path, int &ec);
+
+private:
+    struct Segment {
+        std::string text;         // written before the file bytes
+        uint64_t offset, length;  // file bytes
+    };
+
+    std::string path_;
+    int fd_;
+    uint64_t size_;
+    time_t mtime_;
+    std::string etag_;
+    std::vector<Segment> segments_;
+    size_t seg_;
+    bool textDone_, aborted_;
+    uint64_t done_;  // file bytes of the current segment already returned
+    std::string buf_;
+
+    FileResponse(std::string path, uint64_t size, time_t mtime, std::string etag);
+};
+
+// evaluates If-None-Match, If-Modified-Since, Range and If-Range of a request against a 200
+// response carrying a FileResponse, turning it into 304, 206 or 416 and adding ETag,
+// Last-Modified and Accept-Ranges; other responses are left alone. Called by the server
+// right before a response is queued, so every handler returning a FileResponse gets it.
+void applyFileConditionals(const std::string &method, const std::unordered_map<std::string, std::string> &request,
+                           Response &resp);
+
+// serves GET and HEAD for targets under prefix from files under root, with Cache-Control max-age
+// when maxAge > 0; every other request goes to the handlers created by h
+NewClientHandler staticFiles(NewClientHandler h, const std::string &prefix, const std::string &root,
+                             long maxAge = 0);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_FILE_RESPONSE_HPP
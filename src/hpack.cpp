@@ -0,0 +1,403 @@
+#include "hpack.hpp"
+#include <cstring>
+#include <algorithm>
+
+namespace SHS1 {
+
+namespace {
+
+constexpr size_t ENTRY_OVERHEAD = 32;
+
+const HeaderField STATIC_TABLE[] = {
+        {":authority",                  ""},
+        {":method",                     "GET"},
+        {":method",                     "POST"},
+        {":path",                       "/"},
+        {":path",                       "/index.html"},
+        {":scheme",                     "http"},
+        {":scheme",                     "https"},
+        {":status",                     "200"},
+        {":status",                     "204"},
+        {":status",                     "206"},
+        {":status",                     "304"},
+        {":status",                     "400"},
+        {":status",                     "404"},
+        {":status",                     "500"},
+        {"accept-charset",              ""},
+        {"accept-encoding",             "gzip, deflate"},
+        {"accept-language",             ""},
+        {"accept-ranges",               ""},
+        {"accept",                      ""},
+        {"access-control-allow-origin", ""},
+        {"age",                         ""},
+        {"allow",                       ""},
+        {"authorization",               ""},
+        {"cache-control",               ""},
+        {"content-disposition",         ""},
+        {"content-encoding",            ""},
+        {"content-language",            ""},
+        {"content-length",              ""},
+        {"content-location",            ""},
+        {"content-range",               ""},
+        {"content-type",                ""},
+        {"cookie",                      ""},
+        {"date",                        ""},
+        {"etag",                        ""},
+        {"expect",                      ""},
+        {"expires",                     ""},
+        {"from",                        ""},
+        {"host",                        ""},
+        {"if-match",                    ""},
+        {"if-modified-since",           ""},
+        {"if-none-match",               ""},
+        {"if-range",                    ""},
+        {"if-unmodified-since",         ""},
+        {"last-modified",               ""},
+        {"link",                        ""},
+        {"location",                    ""},
+        {"max-forwards",                ""},
+        {"proxy-authenticate",          ""},
+        {"proxy-authorization",         ""},
+        {"range",                       ""},
+        {"referer",                     ""},
+        {"refresh",                     ""},
+        {"retry-after",                 ""},
+        {"server",                      ""},
+        {"set-cookie",                  ""},
+        {"strict-transport-security",   ""},
+        {"transfer-encoding",           ""},
+        {"user-agent",                  ""},
+        {"vary",                        ""},
+        {"via",                         ""},
+        {"www-authenticate",            ""},
+};
+
+constexpr size_t STATIC_COUNT = std::size(STATIC_TABLE);
+
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// RFC 7541 Appendix B, symbol 256 is EOS
+constexpr HuffmanCode HUFFMAN_TABLE[257] = {
+        {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+        {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+        {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+        {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+        {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+        {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+        {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+        {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+        {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+        {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+        {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+        {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+        {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+        {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+        {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+        {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+        {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+        {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+        {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+        {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+        {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+        {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+        {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+        {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+        {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+        {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+        {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+        {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+        {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+        {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+        {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+        {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+        {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+        {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+        {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+        {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+        {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+        {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+        {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+        {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+        {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+        {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+        {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+struct HuffmanNode {
+    int16_t child[2];
+    int16_t sym;
+};
+
+// decoding tree built from HUFFMAN_TABLE, node 0 is the root
+const std::vector<HuffmanNode> &huffmanTree() {
+    static const std::vector<HuffmanNode> tree = [] {
+        std::vector<HuffmanNode> t{{{-1, -1}, -1}};
+        for (int s = 0; s < 257; ++s) {
+            size_t n = 0;
+            for (int b = HUFFMAN_TABLE[s].bits - 1; b >= 0; --b) {
+                int bit = (HUFFMAN_TABLE[s].code >> b) & 1;
+                if (t[n].child[bit] < 0) {
+                    t[n].child[bit] = (int16_t) t.size();
+                    t.push_back({{-1, -1}, -1});
+                }
+                n = t[n].child[bit];
+            }
+            t[n].sym = (int16_t) s;
+        }
+        return t;
+    }();
+    return tree;
+}
+
+bool decodeInt(const uint8_t *&p, const uint8_t *end, int prefix, uint64_t &v) {
+    if (p == end)return false;
+    uint64_t mask = (1u << prefix) - 1;
+    v = *p++ & mask;
+    if (v < mask)return true;
+    for (int m = 0; p < end && m <= 28; m += 7) {
+        uint8_t b = *p++;
+        v += uint64_t(b & 0x7f) << m;
+        if (!(b & 0x80))return true;
+    }
+    return false;
+}
+
+void encodeInt(std::string &out, uint8_t first, int prefix, uint64_t v) {
+    uint64_t mask = (1u << prefix) - 1;
+    if (v < mask) {
+        out.push_back(char(first | v));
+        return;
+    }
+    out.push_back(char(first | mask));
+    for (v -= mask; v >= 128; v >>= 7) {
+        out.push_back(char(0x80 | (v & 0x7f)));
+    }
+    out.push_back(char(v));
+}
+
+bool decodeString(const uint8_t *&p, const uint8_t *end, std::string &out) {
+    if (p == end)return false;
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if (!decodeInt(p, end, 7, len) || len > uint64_t(end - p))return false;
+    out.clear();
+    if (huffman) {
+        if (!huffmanDecode(p, len, out))return false;
+    } else {
+        out.assign(reinterpret_cast<const char *>(p), len);
+    }
+    p += len;
+    return true;
+}
+
+void encodeString(std::string &out, const std::string &s) {
+    size_t hl = huffmanLength(s);
+    if (hl < s.size()) {
+        encodeInt(out, 0x80, 7, hl);
+        huffmanEncode(s, out);
+    } else {
+        encodeInt(out, 0x00, 7, s.size());
+        out.append(s);
+    }
+}
+
+// 1-based HPACK index space: static table followed by the dynamic table
+const HeaderField *lookup(const HpackTable &table, uint64_t index) {
+    if (index == 0)return nullptr;
+    if (index <= STATIC_COUNT)return &STATIC_TABLE[index - 1];
+    return table.get(index - STATIC_COUNT - 1);
+}
+
+enum class Indexing {
+    INCREMENTAL, NONE, NEVER
+};
+
+Indexing indexingOf(const std::string &name) {
+    if (name == "set-cookie" || name == "authorization")return Indexing::NEVER;
+    if (name == "content-length" || name == "date" || name == "etag" || name == "last-modified" ||
+        name == "content-range" || name == "age" || name == "expires")
+        return Indexing::NONE;
+    return Indexing::INCREMENTAL;
+}
+
+}
+
+
+HpackTable::HpackTable(size_t maxSize) : size_(0), maxSize_(maxSize) {}
+
+void HpackTable::insert(std::string name, std::string value) {
+    size_t sz = name.size() + value.size() + ENTRY_OVERHEAD;
+    if (sz > maxSize_) {  // an entry larger than the table empties it
+        entries_.clear();
+        size_ = 0;
+        return;
+    }
+    size_ += sz;
+    entries_.emplace_front(std::move(name), std::move(value));
+    evict_();
+}
+
+void HpackTable::resize(size_t maxSize) {
+    maxSize_ = maxSize;
+    evict_();
+}
+
+const HeaderField *HpackTable::get(size_t i) const {
+    return i < entries_.size() ? &entries_[i] : nullptr;
+}
+
+void HpackTable::evict_() {
+    while (size_ > maxSize_) {
+        size_ -= entries_.back().first.size() + entries_.back().second.size() + ENTRY_OVERHEAD;
+        entries_.pop_back();
+    }
+}
+
+
+HpackDecoder::HpackDecoder(size_t maxTableSize, size_t maxListSize) :
+        table_(maxTableSize), maxTableSize_(maxTableSize), maxListSize_(maxListSize) {}
+
+bool HpackDecoder::decode(const uint8_t *p, size_t len, std::vector<HeaderField> &out) {
+    const uint8_t *end = p + len;
+    size_t listSize = 0;
+    bool fieldSeen = false;
+    std::string name, value;
+    while (p < end) {
+        uint8_t b = *p;
+        uint64_t index;
+        if (b & 0x80) {  // indexed header field
+            const HeaderField *f;
+            if (!decodeInt(p, end, 7, index) || !(f = lookup(table_, index)))return false;
+            name = f->first;
+            value = f->second;
+        } else if ((b & 0xe0) == 0x20) {  // dynamic table size update, only allowed before any field
+            if (fieldSeen || !decodeInt(p, end, 5, index) || index > maxTableSize_)return false;
+            table_.resize(index);
+            continue;
+        } else {
+            int prefix = (b & 0x40) ? 6 : 4;
+            if (!decodeInt(p, end, prefix, index))return false;
+            if (index) {
+                const HeaderField *f = lookup(table_, index);
+                if (!f)return false;
+                name = f->first;
+            } else if (!decodeString(p, end, name)) {
+                return false;
+            }
+            if (!decodeString(p, end, value))return false;
+            if (b & 0x40) table_.insert(name, value);
+        }
+        fieldSeen = true;
+        if ((listSize += name.size() + value.size() + ENTRY_OVERHEAD) > maxListSize_)return false;
+        out.emplace_back(std::move(name), std::move(value));
+    }
+    return true;
+}
+
+
+HpackEncoder::HpackEncoder(size_t maxTableSize) :
+        table_(maxTableSize), limit_(maxTableSize), pendingSize_(maxTableSize), sizeChanged_(false) {}
+
+void HpackEncoder::setMaxTableSize(size_t size) {
+    pendingSize_ = std::min(size, limit_);
+    sizeChanged_ = pendingSize_ != table_.maxSize();
+}
+
+void HpackEncoder::begin(std::string &out) {
+    if (sizeChanged_) {
+        sizeChanged_ = false;
+        table_.resize(pendingSize_);
+        encodeInt(out, 0x20, 5, pendingSize_);
+    }
+}
+
+void HpackEncoder::encode(const std::string &name, const std::string &value, std::string &out) {
+    size_t nameIndex = 0;
+    Indexing indexing = indexingOf(name);
+    for (size_t i = 0; i < STATIC_COUNT; ++i) {
+        if (STATIC_TABLE[i].first != name)continue;
+        if (STATIC_TABLE[i].second == value && indexing != Indexing::NEVER) {
+            encodeInt(out, 0x80, 7, i + 1);
+            return;
+        }
+        if (!nameIndex) nameIndex = i + 1;
+    }
+    for (size_t i = 0; i < table_.count(); ++i) {
+        const HeaderField *f = table_.get(i);
+        if (f->first != name)continue;
+        if (f->second == value && indexing != Indexing::NEVER) {
+            encodeInt(out, 0x80, 7, STATIC_COUNT + i + 1);
+            return;
+        }
+        if (!nameIndex) nameIndex = STATIC_COUNT + i + 1;
+    }
+    switch (indexing) {
+        case Indexing::INCREMENTAL:
+            encodeInt(out, 0x40, 6, nameIndex);
+            break;
+        case Indexing::NONE:
+            encodeInt(out, 0x00, 4, nameIndex);
+            break;
+        case Indexing::NEVER:
+            encodeInt(out, 0x10, 4, nameIndex);
+            break;
+    }
+    if (!nameIndex) encodeString(out, name);
+    encodeString(out, value);
+    if (indexing == Indexing::INCREMENTAL) table_.insert(name, value);
+}
+
+
+bool huffmanDecode(const uint8_t *p, size_t len, std::string &out) {
+    const std::vector<HuffmanNode> &tree = huffmanTree();
+    size_t n = 0;
+    int depth = 0;
+    bool ones = true;
+    for (size_t i = 0; i < len; ++i) {
+        for (int b = 7; b >= 0; --b) {
+            int bit = (p[i] >> b) & 1;
+            if (tree[n].child[bit] < 0)return false;
+            n = tree[n].child[bit];
+            ++depth;
+            ones = ones && bit;
+            if (tree[n].sym >= 0) {
+                if (tree[n].sym == 256)return false;
+                out.push_back(char(tree[n].sym));
+                n = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    // padding must be a prefix of EOS shorter than 8 bits
+    return depth < 8 && ones;
+}
+
+void huffmanEncode(const std::string &s, std::string &out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (unsigned char c: s) {
+        acc = (acc << HUFFMAN_TABLE[c].bits) | HUFFMAN_TABLE[c].code;
+        bits += HUFFMAN_TABLE[c].bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back(char(acc >> bits));
+        }
+    }
+    if (bits > 0) {
+        out.push_back(char((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+size_t huffmanLength(const std::string &s) {
+    size_t bits = 0;
+    for (unsigned char c: s) {
+        bits += HUFFMAN_TABLE[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef SIMPLE_HTTP_SERVER_HPACK_HPP
+#define SIMPLE_HTTP_SERVER_HPACK_HPP
+
+#include<string>
+#include<deque>
+#include<vector>
+#include<utility>
+#include<cstdint>
+#include<cstddef>
+
+namespace SHS1 {
+
+using HeaderField = std::pair<std::string, std::string>;
+
+// HPACK dynamic table (RFC 7541 section 2.3.2), index 0 is the newest entry
+class HpackTable {
+public:
+    explicit HpackTable(size_t maxSize);
+
+    void insert(std::string name, std::string value);
+
+    void resize(size_t maxSize);
+
+    [[nodiscard]] const HeaderField *get(size_t i) const;
+
+    [[nodiscard]] size_t count() const { return entries_.size(); }
+
+    [[nodiscard]] size_t maxSize() const { return maxSize_; }
+
+private:
+    std::deque<HeaderField> entries_;
+    size_t size_, maxSize_;
+
+    void evict_();
+};
+
+class HpackDecoder {
+public:
+    // maxTableSize is our SETTINGS_HEADER_TABLE_SIZE, maxListSize bounds the decoded header list
+    HpackDecoder(size_t maxTableSize, size_t maxListSize);
+
+    // decode a complete header block, returns false on COMPRESSION_ERROR
+    bool decode(const uint8_t *p, size_t len, std::vector<HeaderField> &out);
+
+private:
+    HpackTable table_;
+    size_t maxTableSize_, maxListSize_;
+};
+
+class HpackEncoder {
+public:
+    explicit HpackEncoder(size_t maxTableSize);
+
+    // peer changed SETTINGS_HEADER_TABLE_SIZE, a size update is emitted with the next block
+    void setMaxTableSize(size_t size);
+
+    // name must be lowercase
+    void encode(const std::string &name, const std::string &value, std::string &out);
+
+    // start of a header block
+    void begin(std::string &out);
+
+private:
+    HpackTable table_;
+    size_t limit_, pendingSize_;
+    bool sizeChanged_;
+};
+
+bool huffmanDecode(const uint8_t *p, size_t len, std::string &out);
+
+void huffmanEncode(const std::string &s, std::string &out);
+
+size_t huffmanLength(const std::string &s);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_HPACK_HPP
@@ -0,0 +1,792 @@
+#include "http2.hpp"
+#include "file_response.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr uint8_t FRAME_DATA = 0x0;
+constexpr uint8_t FRAME_HEADERS = 0x1;
+constexpr uint8_t FRAME_PRIORITY = 0x2;
+constexpr uint8_t FRAME_RST_STREAM = 0x3;
+constexpr uint8_t FRAME_SETTINGS = 0x4;
+constexpr uint8_t FRAME_PUSH_PROMISE = 0x5;
+constexpr uint8_t FRAME_PING = 0x6;
+constexpr uint8_t FRAME_GOAWAY = 0x7;
+constexpr uint8_t FRAME_WINDOW_UPDATE = 0x8;
+constexpr uint8_t FRAME_CONTINUATION = 0x9;
+
+constexpr uint8_t FLAG_END_STREAM = 0x1;
+constexpr uint8_t FLAG_ACK = 0x1;
+constexpr uint8_t FLAG_END_HEADERS = 0x4;
+constexpr uint8_t FLAG_PADDED = 0x8;
+constexpr uint8_t FLAG_PRIORITY = 0x20;
+
+constexpr uint32_t ERR_NO_ERROR = 0x0;
+constexpr uint32_t ERR_PROTOCOL = 0x1;
+constexpr uint32_t ERR_INTERNAL = 0x2;
+constexpr uint32_t ERR_FLOW_CONTROL = 0x3;
+constexpr uint32_t ERR_STREAM_CLOSED = 0x5;
+constexpr uint32_t ERR_FRAME_SIZE = 0x6;
+constexpr uint32_t ERR_REFUSED_STREAM = 0x7;
+constexpr uint32_t ERR_CANCEL = 0x8;
+constexpr uint32_t ERR_COMPRESSION = 0x9;
+constexpr uint32_t ERR_ENHANCE_YOUR_CALM = 0xb;
+
+constexpr uint16_t SETTINGS_HEADER_TABLE_SIZE = 0x1;
+constexpr uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+constexpr uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+constexpr uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+constexpr uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+constexpr uint16_t SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+constexpr size_t HEADER_TABLE_SIZE = 4096;
+constexpr size_t MAX_HEADER_LIST_SIZE = 64 * 1024;
+constexpr size_t MAX_HEADER_BLOCK_SIZE = 256 * 1024;
+constexpr uint32_t MAX_CONCURRENT_STREAMS = 100;
+constexpr uint32_t MAX_FRAME_SIZE = 16384;
+constexpr int64_t DEFAULT_WINDOW = 65535;
+constexpr int64_t MAX_WINDOW = 0x7fffffff;
+constexpr int64_t STREAM_WINDOW = 1024 * 1024;
+constexpr int64_t CONNECTION_WINDOW = 16 * 1024 * 1024;
+constexpr size_t OUT_HIGH_WATER = 256 * 1024;
+// pending output that stops reading: DATA stops at OUT_HIGH_WATER, beyond it out_ only grows by
+// frames answering the peer (PING and SETTINGS ACKs), so a peer that sends but never reads is held back
+constexpr size_t OUT_READ_LIMIT = 1024 * 1024;
+constexpr int DEFAULT_WEIGHT = 16;
+
+const std::string H2_VERSION = "2.0";
+
+thread_local std::vector<char> h2RecvBuffer(256 * 1024);
+
+uint32_t read32(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+void append32(std::string &s, uint32_t v) {
+    s.push_back(char(v >> 24));
+    s.push_back(char(v >> 16));
+    s.push_back(char(v >> 8));
+    s.push_back(char(v));
+}
+
+void appendSetting(std::string &s, uint16_t id, uint32_t v) {
+    s.push_back(char(id >> 8));
+    s.push_back(char(id));
+    append32(s, v);
+}
+
+bool isConnectionSpecific(const std::string &lower) {
+    return lower == "connection" || lower == "keep-alive" || lower == "proxy-connection" ||
+           lower == "transfer-encoding" || lower == "upgrade";
+}
+
+std::string base64UrlDecode(const std::string &s) {
+    std::string r;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char c: s) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else continue;
+        acc = acc << 6 | v;
+        if ((bits += 6) >= 8) {
+            bits -= 8;
+            r.push_back(char(acc >> bits));
+        }
+    }
+    return r;
+}
+
+}
+
+struct Http2Stream {
+    uint32_t id;
+    RequestHandler handler;
+    std::string method, target;
+    std::unordered_map<std::string, std::string> header;
+    std::unique_ptr<Response> resp;
+    const char *buf;
+    size_t cur, size;
+    int64_t sendWindow;
+    uint64_t recvUnacked;
+    uint64_t pass;      // virtual finish time for weighted fair scheduling
+    int weight;
+    bool remoteClosed, skip, head, responding, bodyDone;
+    AsyncResponseBody *async;  // resp's body when it is produced elsewhere
+    bool awaitingHead, awaitingData;
+    MetricsClock::time_point begin, queued;
+    uint64_t handlerNs;
+    uint64_t bytesIn, bytesOut;
+
+    Http2Stream(uint32_t id, int64_t sendWindow, int weight, uint64_t pass) :
+            id(id), buf(nullptr), cur(0), size(0),
+            sendWindow(sendWindow), recvUnacked(0), pass(pass), weight(weight),
+            remoteClosed(false), skip(false), head(false), responding(false), bodyDone(false),
+            async(nullptr), awaitingHead(false), awaitingData(false),
+            begin(MetricsClock::now()), queued{}, handlerNs(0), bytesIn(0), bytesOut(0) {}
+
+    void call(HttpHeader *header, HttpData *data, std::unique_ptr<Response> &resp) {
+        auto start = MetricsClock::now();
+        handler(header, data, resp);
+        handlerNs += elapsedNs(start);
+    }
+};
+
+
+Http2Session::Http2Session(std::shared_ptr<Transport> conn, NewClientHandler newHandler,
+                           std::shared_ptr<AccessLog> accessLog) :
+        conn_(std::move(conn)), newHandler_(std::move(newHandler)), accessLog_(std::move(accessLog)),
+        decoder_(HEADER_TABLE_SIZE, MAX_HEADER_LIST_SIZE), encoder_(HEADER_TABLE_SIZE),
+        inPos_(0), lastStreamId_(0), continuationId_(0), peerMaxFrame_(MAX_FRAME_SIZE),
+        sendWindow_(DEFAULT_WINDOW), peerInitialWindow_(DEFAULT_WINDOW),
+        recvUnacked_(0), passBase_(0), transferred_(0), headerWeight_(DEFAULT_WEIGHT),
+        continuationEnd_(false), prefacePending_(false), goaway_(false), closing_(false) {}
+
+Http2Session::~Http2Session() = default;
+
+void Http2Session::start(const char *data, size_t len) {
+    std::string s;
+    appendSetting(s, SETTINGS_MAX_CONCURRENT_STREAMS, MAX_CONCURRENT_STREAMS);
+    appendSetting(s, SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW);
+    appendSetting(s, SETTINGS_MAX_HEADER_LIST_SIZE, MAX_HEADER_LIST_SIZE);
+    frameHeader_(s.size(), FRAME_SETTINGS, 0, 0);
+    out_.append(s);
+    frameHeader_(4, FRAME_WINDOW_UPDATE, 0, 0);
+    append32(out_, CONNECTION_WINDOW - DEFAULT_WINDOW);
+    feed_(data, len);
+}
+
+void Http2Session::startUpgraded(const std::string &settings, std::unique_ptr<Response> resp, bool head,
+                                 const char *data, size_t len) {
+    out_.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    std::string s = base64UrlDecode(settings);
+    if (s.size() % 6 || !settings_(reinterpret_cast<const uint8_t *>(s.data()), s.size())) {
+        closing_ = true;
+        return;
+    }
+    prefacePending_ = true;
+    lastStreamId_ = 1;
+    auto stream = std::make_unique<Http2Stream>(1, peerInitialWindow_, DEFAULT_WEIGHT, passBase_);
+    stream->remoteClosed = true;
+    stream->head = head;
+    Http2Stream &ref = *stream;
+    streams_.emplace(1, std::move(stream));
+    start(nullptr, 0);
+    respond_(ref, std::move(resp));
+    feed_(data, len);
+}
+
+void Http2Session::handler(EventType e) {
+    if ((e & EVENT_IN) && !closing_) {
+        int ec;
+        size_t n;
+        do {
+            n = conn_->hRead(h2RecvBuffer.data(), h2RecvBuffer.size(), ec);
+            if (n > 0) {
+                bump(MetricsShard::local().bytesIn, uint64_t(n));
+                transferred_ += n;
+                feed_(h2RecvBuffer.data(), n);
+            } else if (ec) {
+                Logger::global->log(LOG_WARN, strerror(ec));
+                conn_->hShutdown(true, true);
+            }
+        } while (n > 0 && !closing_ && out_.size() < OUT_READ_LIMIT);
+    }
+    pollAsync_();
+    flush_();
+
+    bool idle = streams_.empty() && out_.empty();
+    if (wakeGate_) {
+        // a notification arriving after pollAsync_ must not be lost to clearing write interest
+        std::lock_guard guard(wakeGate_->lock);
+        conn_->hSetWrite(!out_.empty() || asyncNotified_());
+    } else {
+        conn_->hSetWrite(!out_.empty());
+    }
+    conn_->hSetRead(!closing_ && out_.size() < OUT_READ_LIMIT);
+    if (conn_->hIsWriteClosed() || (closing_ && out_.empty()) ||
+        (idle && (goaway_ || conn_->hIsReadClosed()))) {
+        conn_->hShutdown(true, true);
+    }
+}
+
+void Http2Session::feed_(const char *data, size_t len) {
+    if (len) in_.append(data, len);
+    if (prefacePending_) {
+        size_t m = std::min(in_.size(), H2_PREFACE_LEN);
+        if (in_.compare(0, m, H2_PREFACE, m) != 0) {
+            connectionError_(ERR_PROTOCOL);
+            return;
+        }
+        if (m < H2_PREFACE_LEN)return;
+        inPos_ = H2_PREFACE_LEN;
+        prefacePending_ = false;
+    }
+    while (!closing_ && in_.size() - inPos_ >= 9) {
+        auto h = reinterpret_cast<const uint8_t *>(in_.data()) + inPos_;
+        size_t flen = size_t(h[0]) << 16 | size_t(h[1]) << 8 | h[2];
+        if (flen > MAX_FRAME_SIZE) {
+            connectionError_(ERR_FRAME_SIZE);
+            break;
+        }
+        if (in_.size() - inPos_ < 9 + flen)break;
+        inPos_ += 9 + flen;
+        if (!frame_(h[3], h[4], read32(h + 5) & 0x7fffffff, h + 9, flen))break;
+    }
+    in_.erase(0, inPos_);
+    inPos_ = 0;
+    if (closing_)return;
+
+    // handlers consume DATA synchronously, so hand back flow-control credit in batches
+    if (recvUnacked_ >= CONNECTION_WINDOW / 2) {
+        frameHeader_(4, FRAME_WINDOW_UPDATE, 0, 0);
+        append32(out_, recvUnacked_);
+        recvUnacked_ = 0;
+    }
+    for (auto &&[id, s]: streams_) {
+        if (!s->remoteClosed && s->recvUnacked >= STREAM_WINDOW / 2) {
+            frameHeader_(4, FRAME_WINDOW_UPDATE, 0, id);
+            append32(out_, s->recvUnacked);
+            s->recvUnacked = 0;
+        }
+    }
+}
+
+bool Http2Session::frame_(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (continuationId_ && (type != FRAME_CONTINUATION || id != continuationId_)) {
+        return connectionError_(ERR_PROTOCOL);
+    }
+    switch (type) {
+        case FRAME_DATA:
+            return data_(flags, id, p, len);
+        case FRAME_HEADERS:
+            return headers_(flags, id, p, len);
+        case FRAME_CONTINUATION:
+            if (!continuationId_)return connectionError_(ERR_PROTOCOL);
+            if (headerBlock_.size() + len > MAX_HEADER_BLOCK_SIZE)return connectionError_(ERR_ENHANCE_YOUR_CALM);
+            headerBlock_.append(reinterpret_cast<const char *>(p), len);
+            if (flags & FLAG_END_HEADERS) {
+                continuationId_ = 0;
+                return headerBlockDone_(id, continuationEnd_);
+            }
+            return true;
+        case FRAME_PRIORITY:
+            if (id == 0)return connectionError_(ERR_PROTOCOL);
+            if (len != 5) {
+                resetStream_(id, ERR_FRAME_SIZE);
+            } else if ((read32(p) & 0x7fffffff) == id) {
+                resetStream_(id, ERR_PROTOCOL);
+            } else if (auto it = streams_.find(id); it != streams_.end()) {
+                it->second->weight = p[4] + 1;
+            }
+            return true;
+        case FRAME_RST_STREAM:
+            if (id == 0 || id > lastStreamId_)return connectionError_(ERR_PROTOCOL);
+            if (len != 4)return connectionError_(ERR_FRAME_SIZE);
+            closeStream_(id);
+            return true;
+        case FRAME_SETTINGS:
+            if (id != 0)return connectionError_(ERR_PROTOCOL);
+            if (flags & FLAG_ACK) {
+                return len == 0 || connectionError_(ERR_FRAME_SIZE);
+            }
+            if (len % 6)return connectionError_(ERR_FRAME_SIZE);
+            if (!settings_(p, len))return false;
+            frameHeader_(0, FRAME_SETTINGS, FLAG_ACK, 0);
+            return true;
+        case FRAME_PUSH_PROMISE:
+            return connectionError_(ERR_PROTOCOL);
+        case FRAME_PING:
+            if (id != 0)return connectionError_(ERR_PROTOCOL);
+            if (len != 8)return connectionError_(ERR_FRAME_SIZE);
+            if (!(flags & FLAG_ACK)) {
+                frameHeader_(8, FRAME_PING, FLAG_ACK, 0);
+                out_.append(reinterpret_cast<const char *>(p), 8);
+            }
+            return true;
+        case FRAME_GOAWAY:
+            if (id != 0)return connectionError_(ERR_PROTOCOL);
+            goaway_ = true;
+            return true;
+        case FRAME_WINDOW_UPDATE:
+            return windowUpdate_(id, p, len);
+        default:  // unknown frame types must be ignored
+            return true;
+    }
+}
+
+bool Http2Session::headers_(uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (id == 0)return connectionError_(ERR_PROTOCOL);
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (len < 1)return connectionError_(ERR_PROTOCOL);
+        pad = p[0];
+        ++p, --len;
+    }
+    headerWeight_ = DEFAULT_WEIGHT;
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5)return connectionError_(ERR_PROTOCOL);
+        headerWeight_ = p[4] + 1;
+        p += 5, len -= 5;
+    }
+    if (pad > len)return connectionError_(ERR_PROTOCOL);
+    headerBlock_.assign(reinterpret_cast<const char *>(p), len - pad);
+    if (!(flags & FLAG_END_HEADERS)) {
+        continuationId_ = id;
+        continuationEnd_ = flags & FLAG_END_STREAM;
+        return true;
+    }
+    return headerBlockDone_(id, flags & FLAG_END_STREAM);
+}
+
+bool Http2Session::headerBlockDone_(uint32_t id, bool endStream) {
+    // always decode so the dynamic table stays in sync, even for streams we refuse
+    std::vector<HeaderField> fields;
+    if (!decoder_.decode(reinterpret_cast<const uint8_t *>(headerBlock_.data()), headerBlock_.size(), fields)) {
+        return connectionError_(ERR_COMPRESSION);
+    }
+
+    if (auto it = streams_.find(id); it != streams_.end()) {  // trailers
+        Http2Stream &s = *it->second;
+        if (s.remoteClosed) {
+            resetStream_(id, ERR_STREAM_CLOSED);
+        } else if (!endStream) {
+            resetStream_(id, ERR_PROTOCOL);
+        } else {
+            s.remoteClosed = true;
+            endOfRequest_(s);
+        }
+        return true;
+    }
+    if (id % 2 == 0)return connectionError_(ERR_PROTOCOL);
+    if (id <= lastStreamId_)return true;  // stream we already closed
+    lastStreamId_ = id;
+    if (goaway_)return true;
+    if (streams_.size() >= MAX_CONCURRENT_STREAMS) {
+        resetStream_(id, ERR_REFUSED_STREAM);
+        return true;
+    }
+
+    auto stream = std::make_unique<Http2Stream>(id, peerInitialWindow_, headerWeight_, passBase_);
+    Http2Stream &s = *stream;
+    std::string scheme, authority;
+    bool regular = false, malformed = false;
+    for (auto &&[k, v]: fields) {
+        if (k.empty()) {
+            malformed = true;
+        } else if (k[0] == ':') {
+            malformed |= regular;
+            if (k == ":method") s.method = v;
+            else if (k == ":path") s.target = v;
+            else if (k == ":scheme") scheme = v;
+            else if (k == ":authority") authority = v;
+            else malformed = true;
+        } else {
+            regular = true;
+            malformed |= std::any_of(k.begin(), k.end(), [](char c) { return std::isupper((unsigned char) c); });
+            malformed |= isConnectionSpecific(k) || (k == "te" && v != "trailers");
+            auto [it, succ] = s.header.emplace(normalizeFieldName(k), v);
+            if (!succ) {  // combine same header, cookies may be split into several fields
+                it->second.append(k == "cookie" ? "; " : ",");
+                it->second.append(v);
+            }
+        }
+    }
+    if (malformed || s.method.empty() || (s.method != "CONNECT" && (s.target.empty() || scheme.empty()))) {
+        resetStream_(id, ERR_PROTOCOL);
+        return true;
+    }
+    if (!authority.empty()) {
+        s.header.emplace(normalizeFieldName("Host"), authority);
+    }
+    s.head = s.method == "HEAD";
+    s.remoteClosed = endStream;
+    s.handler = newHandler_();
+    streams_.emplace(id, std::move(stream));
+
+    HttpHeader header{s.method, s.target, H2_VERSION, s.header};
+    std::unique_ptr<Response> response;
+    s.call(&header, nullptr, response);
+    switch (header.result) {
+        case HeaderAction::CLOSE:
+        case HeaderAction::UPGRADE:  // no extended CONNECT (RFC 8441), nothing to hand over
+            resetStream_(id, ERR_CANCEL);
+            break;
+        case HeaderAction::SKIP_BODY:
+            if (!response) {
+                resetStream_(id, ERR_INTERNAL);
+                break;
+            }
+            s.skip = true;
+            respond_(s, std::move(response));
+            break;
+        case HeaderAction::OK:
+            if (endStream) endOfRequest_(s);
+            break;
+    }
+    return true;
+}
+
+bool Http2Session::data_(uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (id == 0)return connectionError_(ERR_PROTOCOL);
+    if ((recvUnacked_ += len) > CONNECTION_WINDOW)return connectionError_(ERR_FLOW_CONTROL);
+    size_t flen = len, pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (len < 1)return connectionError_(ERR_PROTOCOL);
+        pad = p[0];
+        ++p, --len;
+        if (pad > len)return connectionError_(ERR_PROTOCOL);
+        len -= pad;
+    }
+    auto it = streams_.find(id);
+    if (it == streams_.end()) {  // frames racing with our RST_STREAM are ignored
+        return id <= lastStreamId_ || connectionError_(ERR_PROTOCOL);
+    }
+    Http2Stream &s = *it->second;
+    if (s.remoteClosed) {
+        resetStream_(id, ERR_STREAM_CLOSED);
+        return true;
+    }
+    if ((s.recvUnacked += flen) > STREAM_WINDOW) {
+        resetStream_(id, ERR_FLOW_CONTROL);
+        return true;
+    }
+    s.bytesIn += len;
+    if (len > 0 && !s.skip) {
+        HttpData data{reinterpret_cast<const char *>(p), len};
+        std::unique_ptr<Response> response;
+        s.call(nullptr, &data, response);
+        // ignoring supplied response
+    }
+    if (flags & FLAG_END_STREAM) {
+        s.remoteClosed = true;
+        endOfRequest_(s);
+    }
+    return true;
+}
+
+bool Http2Session::settings_(const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t key = uint16_t(p[i] << 8 | p[i + 1]);
+        uint32_t v = read32(p + i + 2);
+        switch (key) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                encoder_.setMaxTableSize(v);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (v > 1)return connectionError_(ERR_PROTOCOL);
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (v > MAX_WINDOW)return connectionError_(ERR_FLOW_CONTROL);
+                int64_t delta = int64_t(v) - peerInitialWindow_;
+                for (auto &&[id, s]: streams_) {
+                    if ((s->sendWindow += delta) > MAX_WINDOW)return connectionError_(ERR_FLOW_CONTROL);
+                }
+                peerInitialWindow_ = v;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (v < 16384 || v > 16777215)return connectionError_(ERR_PROTOCOL);
+                peerMaxFrame_ = v;
+                break;
+            default:  // MAX_CONCURRENT_STREAMS only limits server push, others are advisory
+                break;
+        }
+    }
+    return true;
+}
+
+bool Http2Session::windowUpdate_(uint32_t id, const uint8_t *p, size_t len) {
+    if (len != 4)return connectionError_(ERR_FRAME_SIZE);
+    uint32_t inc = read32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (inc == 0 || (sendWindow_ += inc) > MAX_WINDOW)return connectionError_(inc ? ERR_FLOW_CONTROL : ERR_PROTOCOL);
+        return true;
+    }
+    auto it = streams_.find(id);
+    if (it == streams_.end()) {
+        return id <= lastStreamId_ || connectionError_(ERR_PROTOCOL);
+    }
+    if (inc == 0) {
+        resetStream_(id, ERR_PROTOCOL);
+    } else if ((it->second->sendWindow += inc) > MAX_WINDOW) {
+        resetStream_(id, ERR_FLOW_CONTROL);
+    }
+    return true;
+}
+
+void Http2Session::endOfRequest_(Http2Stream &s) {
+    if (s.skip) {  // response already under way (or done) since headers
+        if (s.bodyDone) closeStream_(s.id);
+        return;
+    }
+    std::unique_ptr<Response> response;
+    s.call(nullptr, nullptr, response);
+    if (!response) {  // no response means to reset the stream
+        resetStream_(s.id, ERR_INTERNAL);
+        return;
+    }
+    respond_(s, std::move(response));
+}
+
+void Http2Session::respond_(Http2Stream &s, std::unique_ptr<Response> resp) {
+    MetricsShard::local().record(LatencyStage::HANDLER, s.handlerNs);
+    if (!s.method.empty()) applyFileConditionals(s.method, s.header, *resp);
+    s.queued = MetricsClock::now();
+    s.resp = std::move(resp);
+    if ((s.async = dynamic_cast<AsyncResponseBody *>(s.resp->body.get()))) {
+        if (!wakeGate_) wakeGate_ = std::make_shared<WakeGate>(conn_);
+        s.async->setWaker([gate = wakeGate_]() {
+            gate->wake();
+        });
+        s.async->takeNotification();
+        if (!s.async->headReady(*s.resp)) {
+            s.awaitingHead = true;
+            return;
+        }
+    }
+    sendHead_(s);
+}
+
+void Http2Session::sendHead_(Http2Stream &s) {
+    ssize_t len = s.resp->body ? s.resp->body->len() : 0;
+    if (len == 0 || s.head) {
+        s.resp->body.reset();
+        s.async = nullptr;
+    }
+    writeHeaders_(s, len);
+    if (s.resp->body) {
+        auto [p, sz] = s.resp->body->get();
+        s.buf = p;
+        s.size = sz;
+        s.cur = 0;
+        s.responding = true;
+        s.awaitingData = p && sz == 0;
+        return;
+    }
+    s.bodyDone = true;
+    responded_(s);
+    if (s.remoteClosed) {
+        closeStream_(s.id);
+    } else {  // answered before the request ended, tell the client to stop sending
+        resetStream_(s.id, ERR_NO_ERROR);
+    }
+}
+
+void Http2Session::pollAsync_() {
+    std::vector<Http2Stream *> ready;
+    for (auto &&[id, st]: streams_) {
+        if ((st->awaitingHead || st->awaitingData) && st->async->takeNotification()) ready.push_back(st.get());
+    }
+    for (Http2Stream *s: ready) {
+        if (s->awaitingHead) {
+            if (s->async->headReady(*s->resp)) {
+                s->awaitingHead = false;
+                sendHead_(*s);
+            }
+            continue;
+        }
+        auto [p, sz] = s->resp->body->get();
+        s->awaitingData = p && sz == 0;
+        s->buf = p;
+        s->size = sz;
+        s->cur = 0;
+    }
+}
+
+bool Http2Session::asyncNotified_() const {
+    for (auto &&[id, st]: streams_) {
+        if ((st->awaitingHead || st->awaitingData) && st->async->notified()) return true;
+    }
+    return false;
+}
+
+void Http2Session::writeHeaders_(Http2Stream &s, ssize_t len) {
+    std::string block;
+    encoder_.begin(block);
+    encoder_.encode(":status", std::to_string(s.resp->status), block);
+    if (len > 0) {
+        encoder_.encode("content-length", std::to_string(len), block);
+    }
+    std::string name;
+    for (auto &&[k, v]: s.resp->header) {
+        name.resize(k.size());
+        std::transform(k.begin(), k.end(), name.begin(), [](char c) { return (char) std::tolower((unsigned char) c); });
+        if (isConnectionSpecific(name) || name == "content-length")continue;
+        encoder_.encode(name, v, block);
+    }
+    bool end = !s.resp->body;
+    size_t pos = 0;
+    do {
+        size_t n = std::min<size_t>(block.size() - pos, peerMaxFrame_);
+        uint8_t flags = (pos == 0 && end ? FLAG_END_STREAM : 0) | (pos + n == block.size() ? FLAG_END_HEADERS : 0);
+        frameHeader_(n, pos == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, s.id);
+        out_.append(block, pos, n);
+        s.bytesOut += 9 + n;
+        pos += n;
+    } while (pos < block.size());
+}
+
+void Http2Session::writeData_() {
+    while (out_.size() < OUT_HIGH_WATER) {
+        // weighted fair share: the stream with the smallest virtual finish time goes next
+        Http2Stream *s = nullptr;
+        for (auto &&[id, st]: streams_) {
+            if (!st->responding || st->bodyDone || st->awaitingData)continue;
+            if (st->buf && (st->sendWindow <= 0 || sendWindow_ <= 0))continue;
+            if (!s || st->pass < s->pass) s = st.get();
+        }
+        if (!s)break;
+        passBase_ = s->pass;
+
+        size_t n = 0;
+        if (s->buf) {
+            n = std::min({s->size - s->cur, (size_t) s->sendWindow, (size_t) sendWindow_, (size_t) peerMaxFrame_});
+        }
+        frameHeader_(n, FRAME_DATA, 0, s->id);
+        size_t flagPos = out_.size() - 5;
+        out_.append(s->buf + s->cur, n);
+        s->bytesOut += 9 + n;
+        s->cur += n;
+        s->sendWindow -= (int64_t) n;
+        sendWindow_ -= (int64_t) n;
+        s->pass += (n + 1) * 256 / s->weight;
+        if (s->cur == s->size) {
+            if (s->buf) {
+                auto [p, sz] = s->resp->body->get();
+                s->buf = p;
+                s->size = sz;
+                s->cur = 0;
+                s->awaitingData = p && sz == 0;
+            }
+            if (!s->buf && s->resp->body->aborted()) {
+                s->bodyDone = true;
+                responded_(*s);
+                resetStream_(s->id, ERR_INTERNAL);
+            } else if (!s->buf) {
+                out_[flagPos] = char(out_[flagPos] | FLAG_END_STREAM);
+                s->bodyDone = true;
+                responded_(*s);
+                if (s->remoteClosed) {
+                    closeStream_(s->id);
+                } else {
+                    resetStream_(s->id, ERR_NO_ERROR);
+                }
+            }
+        }
+    }
+}
+
+// the response is serialized into out_, which is written out together for every stream,
+// so drain and total time are taken up to that point
+void Http2Session::responded_(Http2Stream &s) {
+    MetricsShard &metrics = MetricsShard::local();
+    metrics.record(LatencyStage::WRITE_DRAIN, elapsedNs(s.queued));
+    metrics.record(LatencyStage::TOTAL, elapsedNs(s.begin));
+    bump(metrics.requests, uint64_t(1));
+    if (accessLog_) {
+        AccessRecord r;
+        uint64_t total = elapsedNs(s.begin);
+        r.time = AccessRecord::wallTime(total);
+        r.latency = total;
+        r.bytesIn = s.bytesIn;
+        r.bytesOut = s.bytesOut;
+        r.status = uint16_t(s.resp->status);
+        r.version = 20;
+        r.setMethod(s.method);
+        r.setTarget(s.target);
+        auto agent = s.header.find(normalizeFieldName("User-Agent"));
+        r.setAgent(agent != s.header.end() ? agent->second : std::string());
+        accessLog_->log(r);
+    }
+}
+
+void Http2Session::flush_() {
+    for (;;) {
+        if (!closing_) writeData_();
+        if (out_.empty())return;
+        int ec;
+        size_t n = conn_->hWrite(out_.data(), out_.size(), ec);
+        if (n > 0) {
+            bump(MetricsShard::local().bytesOut, uint64_t(n));
+            transferred_ += n;
+            out_.erase(0, n);
+            if (!out_.empty())return;
+        } else {
+            if (ec) {
+                Logger::global->log(LOG_WARN, strerror(ec));
+                conn_->hShutdown(true, true);
+            }
+            return;
+        }
+    }
+}
+
+void Http2Session::resetStream_(uint32_t id, uint32_t code) {
+    frameHeader_(4, FRAME_RST_STREAM, 0, id);
+    append32(out_, code);
+    closeStream_(id);
+}
+
+void Http2Session::closeStream_(uint32_t id) {
+    streams_.erase(id);
+}
+
+void Http2Session::goAway() {
+    if (goaway_ || closing_) return;
+    goaway_ = true;
+    frameHeader_(8, FRAME_GOAWAY, 0, 0);
+    append32(out_, lastStreamId_);
+    append32(out_, ERR_NO_ERROR);
+}
+
+uint64_t Http2Session::transferred() const {
+    return transferred_;
+}
+
+bool Http2Session::writePending() const {
+    if (!out_.empty()) return true;
+    for (auto &&[id, s]: streams_) {
+        if (s->buf && s->cur < s->size) return true;  // held back by a window
+    }
+    return false;
+}
+
+bool Http2Session::producing() const {
+    for (auto &&[id, s]: streams_) {
+        if (s->awaitingHead || s->awaitingData) return true;
+    }
+    return false;
+}
+
+bool Http2Session::connectionError_(uint32_t code) {
+    Logger::global->log(LOG_WARN, "http2 connection error " + std::to_string(code));
+    frameHeader_(8, FRAME_GOAWAY, 0, 0);
+    append32(out_, lastStreamId_);
+    append32(out_, code);
+    closing_ = true;
+    streams_.clear();
+    return false;
+}
+
+void Http2Session::frameHeader_(size_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    out_.push_back(char(len >> 16));
+    out_.push_back(char(len >> 8));
+    out_.push_back(char(len));
+    out_.push_back(char(type));
+    out_.push_back(char(flags));
+    append32(out_, id);
+}
+
+}
@@ -0,0 +1,112 @@
+#ifndef SIMPLE_HTTP_SERVER_HTTP2_HPP
+#define SIMPLE_HTTP_SERVER_HTTP2_HPP
+
+#include "http_server.hpp"
+#include "hpack.hpp"
+#include<map>
+#include<string>
+#include<memory>
+#include<cstdint>
+
+namespace SHS1 {
+
+constexpr char H2_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t H2_PREFACE_LEN = sizeof(H2_PREFACE) - 1;
+
+struct Http2Stream;
+
+// server side of an HTTP/2 connection (RFC 9113), each stream gets its own RequestHandler
+class Http2Session final : private DisableCopy,
+                           public std::enable_shared_from_this<Http2Session> {
+public:
+    Http2Session(std::shared_ptr<Transport> conn, NewClientHandler newHandler, std::shared_ptr<AccessLog> accessLog);
+
+    ~Http2Session();
+
+    // prior knowledge: the client preface has already been consumed,
+    // data holds whatever followed it in the same read
+    void start(const char *data, size_t len);
+
+    // h2c upgrade (RFC 7540 section 3.2): settings is the HTTP2-Settings header value,
+    // resp answers the upgraded request as stream 1, data holds bytes read after that request
+    void startUpgraded(const std::string &settings, std::unique_ptr<Response> resp, bool head,
+                       const char *data, size_t len);
+
+    void handler(EventType e);
+
+    // graceful shutdown: GOAWAY, streams already open are finished and new ones ignored,
+    // the connection closes once idle
+    void goAway();
+
+    // for the connection's deadlines: bytes read and written so far
+    uint64_t transferred() const;
+
+    // frames wait for the client to read them, or for it to open its flow-control window
+    bool writePending() const;
+
+    // a handler still produces a response, which is not timed
+    bool producing() const;
+
+private:
+    std::shared_ptr<Transport> conn_;
+    std::shared_ptr<WakeGate> wakeGate_;  // created with the first async response
+    NewClientHandler newHandler_;
+    std::shared_ptr<AccessLog> accessLog_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::map<uint32_t, std::unique_ptr<Http2Stream>> streams_;
+    std::string in_, out_, headerBlock_;
+    size_t inPos_;
+    uint32_t lastStreamId_, continuationId_, peerMaxFrame_;
+    int64_t sendWindow_, peerInitialWindow_;
+    uint64_t recvUnacked_, passBase_, transferred_;
+    int headerWeight_;
+    bool continuationEnd_, prefacePending_, goaway_, closing_;
+
+    void feed_(const char *data, size_t len);
+
+    bool frame_(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+
+    bool headers_(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+
+    bool headerBlockDone_(uint32_t id, bool endStream);
+
+    bool data_(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+
+    bool settings_(const uint8_t *p, size_t len);
+
+    bool windowUpdate_(uint32_t id, const uint8_t *p, size_t len);
+
+    void endOfRequest_(Http2Stream &s);
+
+    void respond_(Http2Stream &s, std::unique_ptr<Response> resp);
+
+    // headers (and the start of the body) once the response head is known
+    void sendHead_(Http2Stream &s);
+
+    // resume streams whose async body was notified
+    void pollAsync_();
+
+    // a stream still waits for an async body notification that may have arrived meanwhile
+    bool asyncNotified_() const;
+
+    void writeHeaders_(Http2Stream &s, ssize_t len);
+
+    void writeData_();
+
+    void responded_(Http2Stream &s);
+
+    void flush_();
+
+    void resetStream_(uint32_t id, uint32_t code);
+
+    void closeStream_(uint32_t id);
+
+    bool connectionError_(uint32_t code);
+
+    void frameHeader_(size_t len, uint8_t type, uint8_t flags, uint32_t id);
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_HTTP2_HPP
@@ -1,4 +1,9 @@
 #include "http_server.hpp"
+#include "http2.hpp"
+#include "file_response.hpp"
+#include "response_cache.hpp"
+#include "metrics.hpp"
+#include "timer_wheel.hpp"
 #include "llhttp.h"
 #include "tcp_socket.hpp"
 #include "logger.hpp"
@@ -6,9 +11,13 @@
 #include <unordered_map>
 #include <queue>
 #include <cstring>
+#include <strings.h>
 #include <thread>
 #include <chrono>
 #include <vector>
+#include <list>
+#include <optional>
+#include <condition_variable>
 
 namespace SHS1 {
 
@@ -16,42 +25,289 @@ namespace {
 using namespace SNL1;
 }
 
+size_t ResponseBody::spliceTo(Transport &) {
+    return 0;
+}
+
+bool ResponseBody::aborted() {
+    return false;
+}
+
 ResponseBody::~ResponseBody() = default;
 
+void AsyncResponseBody::notify() {
+    notified_ = true;
+    std::lock_guard guard(wakerLock_);
+    if (waker_) waker_();
+}
+
+void AsyncResponseBody::setWaker(std::function<void()> waker) {
+    std::lock_guard guard(wakerLock_);
+    waker_ = std::move(waker);
+}
+
+bool AsyncResponseBody::notified() const {
+    return notified_;
+}
+
+bool AsyncResponseBody::takeNotification() {
+    return notified_.exchange(false);
+}
+
+UpgradedConnection::~UpgradedConnection() = default;
+
+void BodyFlow::pause() {
+    paused_ = true;
+}
+
+void BodyFlow::resume() {
+    if (!paused_.exchange(false)) return;
+    std::lock_guard guard(wakerLock_);
+    if (waker_) waker_();
+}
+
+bool BodyFlow::paused() const {
+    return paused_;
+}
+
+void BodyFlow::setWaker(std::function<void()> waker) {
+    std::lock_guard guard(wakerLock_);
+    waker_ = std::move(waker);
+}
+
 enum class ResponseState {
     NEW, HEADER, BODY
 };
 
 struct PendingResponse {
     std::unique_ptr<Response> resp;
+    std::shared_ptr<const CachedResponse> cached;  // written instead of resp when set
+    AsyncResponseBody *async;                       // resp's body when it is produced elsewhere
     ResponseState state;
     std::string hs;
     const char *buf;
     size_t cur, size;
+    bool chunked, ended;
+    bool interim;  // a 100 Continue in hs, ahead of the final response
+    MetricsClock::time_point begin, queued;
+    uint64_t sent;
+    AccessRecord access;  // filled in only when an access log is set
 
-    explicit PendingResponse(std::unique_ptr<Response> resp) :
-            resp(std::move(resp)),
+    PendingResponse(std::unique_ptr<Response> resp, std::shared_ptr<const CachedResponse> cached,
+                    MetricsClock::time_point begin) :
+            resp(std::move(resp)), cached(std::move(cached)), async(nullptr),
             state(ResponseState::NEW),
             hs{}, buf{nullptr},
-            cur(0), size(0) {}
+            cur(0), size(0), chunked(false), ended(false), interim(false),
+            begin(begin), queued(MetricsClock::now()), sent(0) {}
+};
+
+constexpr char CONTINUE_RESPONSE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+
+constexpr std::chrono::milliseconds TIMER_TICK(100);
+
+// deadline of one connection; when it passes the ticker sets fired and wakes conn
+struct ConnectionTimer : TimerWheel::Timer {
+    Transport *conn = nullptr;
+    std::atomic<bool> fired{false};
 };
 
+// live connections of a server, one list per thread so registering never contends;
+// drain() walks them to wake connections that sit idle.
+// Each thread also has a timer wheel for the deadlines of its connections, advanced by a ticker
+// thread; its lock is taken by the owning loop and the ticker only. Every tick the ticker also
+// wakes one connection of each thread to measure how long that loop takes to get to it
+class ConnectionRegistry final : private DisableCopy {
+public:
+    struct Shard {
+        std::mutex lock;
+        std::list<Transport *> conns;
+        TimerWheel wheel{TIMER_TICK};
+        std::atomic<Transport *> probed{nullptr};
+        std::atomic<int64_t> probedAt{0};  // steady clock nanoseconds, 0 when no probe is pending
+    };
+
+    using Entry = std::pair<Shard *, std::list<Transport *>::iterator>;
+
+    std::atomic<bool> draining{false};
+    std::atomic<size_t> open{0};
+
+    ConnectionRegistry() : id_(nextId_++), stopping_(false) {}
+
+    ~ConnectionRegistry() {
+        {
+            std::lock_guard guard(tickerLock_);
+            stopping_ = true;
+        }
+        tickerWait_.notify_all();
+        if (ticker_.joinable()) ticker_.join();
+    }
+
+    // conn stays valid until remove(), which the connection calls before releasing it
+    Entry add(Transport *conn) {
+        ++open;
+        Shard &s = local_();
+        std::lock_guard guard(s.lock);
+        return {&s, s.conns.insert(s.conns.end(), conn)};
+    }
+
+    void remove(Entry e) {
+        --open;
+        std::lock_guard guard(e.first->lock);
+        if (e.first->probed == *e.second) e.first->probedAt = 0;
+        e.first->conns.erase(e.second);
+    }
+
+    // called by conn on every event, records the loop lag when conn is the one probed
+    static void probe(Entry e, Transport *conn) {
+        Shard &s = *e.first;
+        int64_t at = s.probedAt.load(std::memory_order_acquire);
+        if (!at || s.probed.load(std::memory_order_relaxed) != conn) return;
+        s.probedAt.store(0, std::memory_order_relaxed);
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                MetricsClock::now().time_since_epoch()).count();
+        MetricsShard::local().record(LatencyStage::LOOP_LAG, uint64_t(std::max(now - at, int64_t(0))));
+    }
+
+    // t fires after ms unless armed again or cancelled before
+    static void arm(Entry e, ConnectionTimer &t, long ms) {
+        std::lock_guard guard(e.first->lock);
+        t.fired = false;
+        e.first->wheel.arm(t, std::chrono::milliseconds(ms));
+    }
+
+    static void cancel(Entry e, ConnectionTimer &t) {
+        std::lock_guard guard(e.first->lock);
+        t.fired = false;
+        e.first->wheel.cancel(t);
+    }
+
+    // starts the ticker, once, before deadlines are armed
+    void start() {
+        if (ticker_.joinable()) return;
+        ticker_ = std::thread([this]() {
+            tick_();
+        });
+    }
+
+    // wakes every connection, returns how many there are
+    size_t wakeAll() {
+        size_t n = 0;
+        std::lock_guard guard(shardsLock_);
+        for (auto &&s: shards_) {
+            std::lock_guard shardGuard(s->lock);
+            for (Transport *c: s->conns) {
+                c->wake();
+            }
+            n += s->conns.size();
+        }
+        return n;
+    }
+
+private:
+    static inline std::atomic<uint64_t> nextId_{0};
+    uint64_t id_;
+    std::mutex shardsLock_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex tickerLock_;
+    std::condition_variable tickerWait_;
+    bool stopping_;
+    std::thread ticker_;
+
+    void tick_() {
+        std::unique_lock lock(tickerLock_);
+        while (!tickerWait_.wait_for(lock, TIMER_TICK, [this]() {
+            return stopping_;
+        })) {
+            auto now = TimerWheel::Clock::now();
+            std::lock_guard guard(shardsLock_);
+            for (auto &&s: shards_) {
+                std::lock_guard shardGuard(s->lock);
+                s->wheel.advance(now, [](TimerWheel::Timer &t) {
+                    auto &ct = static_cast<ConnectionTimer &>(t);
+                    ct.fired = true;
+                    ct.conn->wake();
+                });
+                // a probe still pending is left alone, its lag keeps growing
+                if (!s->conns.empty() && !s->probedAt.load(std::memory_order_relaxed)) {
+                    s->probed.store(s->conns.front(), std::memory_order_relaxed);
+                    s->probedAt.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            TimerWheel::Clock::now().time_since_epoch()).count(), std::memory_order_release);
+                    s->conns.front()->wake();
+                }
+            }
+        }
+    }
+
+    Shard &local_() {
+        thread_local std::unordered_map<uint64_t, Shard *> mine;
+        Shard *&s = mine[id_];
+        if (!s) {
+            std::lock_guard guard(shardsLock_);
+            shards_.push_back(std::make_unique<Shard>());
+            s = shards_.back().get();
+        }
+        return *s;
+    }
+};
 
 HttpHeader::HttpHeader(const std::string &method, const std::string &target, const std::string &version,
                        const std::unordered_map<std::string, std::string> &header) :
         method(method), target(target), version(version), header(header),
         result(HeaderAction::OK) {}
 
-constexpr size_t READ_BUFFER_SIZE = 10 * 1024 * 1024;
-thread_local std::vector<char> recvBuffer(READ_BUFFER_SIZE);
+// grown to HttpServerOptions::readBufferSize on first use
+thread_local std::vector<char> recvBuffer;
+
+// sniff_ value once the connection is known to speak HTTP/1.x
+constexpr size_t SNIFF_DONE = SIZE_MAX;
+
+// appendResponseHead length for a body ending with the connection
+constexpr ssize_t UNTIL_CLOSE = -2;
+
+void appendResponseHead(std::string &out, const Response &resp, const char *connection, ssize_t len) {
+    out.append("HTTP/").append(resp.version).append(" ");
+    out.append(std::to_string(resp.status)).append(" ");
+    out.append(resp.message).append("\r\n");
+    out.append("Connection: ").append(connection).append("\r\n");
+    if (len == ResponseBody::CHUNKED) {
+        out.append("Transfer-Encoding: chunked\r\n");
+    } else if (len > 0 || (len == 0 && resp.status >= 200 && resp.status != 204 && resp.status != 304)) {
+        // an empty body still needs its length, or the client reads until close
+        out.append("Content-Length: ").append(std::to_string(len)).append("\r\n");
+    }
+    for (auto &&[k, v]: resp.header) {
+        out.append(k).append(": ").append(v).append("\r\n");
+    }
+    out.append("\r\n");
+}
+
+bool hasToken(const std::string &list, const char *token) {
+    size_t n = strlen(token), pos = 0;
+    while (pos < list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        size_t b = list.find_first_not_of(" \t", pos);
+        size_t e = list.find_last_not_of(" \t", end - 1);
+        if (b < end && e - b + 1 == n && strncasecmp(list.data() + b, token, n) == 0) return true;
+        pos = end + 1;
+    }
+    return false;
+}
 
 class HttpStreamImpl final : private DisableCopy,
                              public std::enable_shared_from_this<HttpStreamImpl> {
 public:
-    explicit HttpStreamImpl(std::shared_ptr<Connection> conn) :
+    HttpStreamImpl(std::shared_ptr<Transport> conn, std::shared_ptr<AccessLog> accessLog,
+                   std::shared_ptr<ResponseCache> cache, std::shared_ptr<ConnectionRegistry> registry,
+                   const HttpServerOptions &options) :
             parser_{}, settings_{},
-            finish_(false), skip_(false), keepalive_(true),
-            conn_(std::move(conn)) {
+            finish_(false), skip_(false), keepalive_(true), h2Upgrade_(false), firstByte_(false), cacheStore_(false),
+            asyncWait_(false), bodyAbort_(false), readPending_(false), inMessage_(false), inBody_(false), served_(false),
+            bodyPaused_(false), expectContinue_(false),
+            sniff_(0), conn_(std::move(conn)), accessLog_(std::move(accessLog)), cache_(std::move(cache)),
+            registry_(std::move(registry)), options_(options),
+            transferred_(0), expired_(false), accepted_(MetricsClock::now()), handlerNs_(0), bodyBytes_(0) {
         settings_.on_message_begin = onMessageBegin;
         settings_.on_method = onMethod;
         settings_.on_version = onVersion;
@@ -63,10 +319,23 @@ public:
         settings_.on_message_complete = onMessageComplete;
         llhttp_init(&parser_, HTTP_REQUEST, &settings_);
         parser_.data = this;
+        bump(MetricsShard::local().connections, int64_t(1));
     }
 
-    void enableHandler(RequestHandler requestHandler) {
-        requestHandler_ = std::move(requestHandler);
+    ~HttpStreamImpl() {
+        if (registered_) {
+            ConnectionRegistry::cancel(*registered_, timer_);
+            registry_->remove(*registered_);
+        }
+        bump(MetricsShard::local().connections, int64_t(-1));
+    }
+
+    void enableHandler(NewClientHandler newClientHandler) {
+        newClientHandler_ = std::move(newClientHandler);
+        requestHandler_ = newClientHandler_();
+        registered_ = registry_->add(conn_.get());
+        timer_.conn = conn_.get();
+        updateTimer_(false, false);
         conn_->enableHandler([ptr = shared_from_this()](EventType e) {
             ptr->handler_(e);
         }, true, false);
@@ -76,55 +345,368 @@ private:
     llhttp_t parser_;
     llhttp_settings_t settings_;
     std::string chf_;
-    bool finish_, skip_, keepalive_;
-    std::shared_ptr<Connection> conn_;
+    bool finish_, skip_, keepalive_, h2Upgrade_, firstByte_;
+    bool cacheStore_;  // the response to the current request may be cached
+    bool asyncWait_, bodyAbort_;  // the front response waits for its async body, or the body broke off
+    bool readPending_;  // the read budget ran out, there may be more to read
+    bool inMessage_;    // a request is partly read
+    bool inBody_;       // and its header block is complete
+    bool served_;       // a request was read completely, later waits are keep-alive idle time
+    bool bodyPaused_;   // the handler paused the body, llhttp stopped and bytes read on go to held_
+    bool expectContinue_;  // the client waits for 100 Continue before it sends the body
+    size_t sniff_;  // bytes of HTTP/2 client preface seen at connection start
+    std::shared_ptr<Transport> conn_;
+    std::shared_ptr<AccessLog> accessLog_;
+    std::shared_ptr<ResponseCache> cache_;
+    std::shared_ptr<const CachedResponse> cached_;  // cache hit answering the current request
+    std::shared_ptr<WakeGate> wakeGate_;            // created with the first async response or body flow
+    std::shared_ptr<BodyFlow> flow_;                // handed to the handler with each header
+    std::string held_;                              // read but not yet parsed while bodyPaused_
+    std::shared_ptr<ConnectionRegistry> registry_;
+    std::optional<ConnectionRegistry::Entry> registered_;
+    HttpServerOptions options_;
+    ConnectionTimer timer_;
+    std::optional<TimeoutKind> deadline_;  // the kind timer_ is armed for
+    MetricsClock::time_point activity_;    // deadline_ counts from here
+    uint64_t transferred_;                 // by h2_ or upgraded_ when last asked
+    bool expired_;                         // h2_ or upgraded_ was told to close at a deadline
+    NewClientHandler newClientHandler_;
     RequestHandler requestHandler_;
+    std::shared_ptr<Http2Session> h2_;
+    std::string h2Settings_;
+    std::unique_ptr<Response> h2Response_;
+    std::shared_ptr<UpgradedConnection> upgrade_, upgraded_;  // pending until the 101 is written, then active
+    std::string upgradeData_;
+    MetricsClock::time_point accepted_, begin_;
+    uint64_t handlerNs_;  // handler time of the current request so far
+    uint64_t bodyBytes_;
 
     std::string method_, target_, version_;
     std::unordered_map<std::string, std::string> header_;
     std::queue<std::unique_ptr<PendingResponse>> resp_;
 
+    // feed llhttp, switching to HTTP/2 on prior-knowledge preface or accepted h2c upgrade
+    bool parse_(const char *data, size_t n) {
+        if (sniff_ < H2_PREFACE_LEN) {
+            size_t m = std::min(n, H2_PREFACE_LEN - sniff_);
+            if (memcmp(data, H2_PREFACE + sniff_, m) == 0) {
+                if ((sniff_ += m) == H2_PREFACE_LEN) {
+                    h2_ = std::make_shared<Http2Session>(conn_, newClientHandler_, accessLog_);
+                    h2_->start(data + m, n - m);
+                }
+                return true;
+            }
+            size_t seen = sniff_;
+            sniff_ = SNIFF_DONE;
+            if (seen && !execute_(H2_PREFACE, seen)) return false;
+        }
+        return execute_(data, n);
+    }
+
+    bool execute_(const char *data, size_t n) {
+        llhttp_errno_t err = llhttp_execute(&parser_, data, n);
+        if (err == HPE_OK) return true;
+        if (bodyPaused_ && err == HPE_PAUSED) {
+            held_.assign(llhttp_get_error_pos(&parser_), data + n);
+            return true;
+        }
+        if (h2Response_ && (err == HPE_PAUSED || err == HPE_PAUSED_UPGRADE)) {
+            const char *pos = llhttp_get_error_pos(&parser_);
+            h2_ = std::make_shared<Http2Session>(conn_, newClientHandler_, accessLog_);
+            h2_->startUpgraded(h2Settings_, std::move(h2Response_), method_ == "HEAD", pos, data + n - pos);
+            return true;
+        }
+        if (skip_ && err == HPE_PAUSED) return true;  // the body of a refused request is not read
+        if (upgrade_ && (err == HPE_PAUSED || err == HPE_PAUSED_UPGRADE)) {
+            const char *pos = llhttp_get_error_pos(&parser_);
+            upgradeData_.assign(pos, data + n);
+            return true;
+        }
+        Logger::global->log(LOG_WARN, std::string("http err: ") + llhttp_errno_name(err));
+        MetricsShard::local().httpError(err);
+        return false;
+    }
+
+    // the body is wanted: a client that asked for it is told to send it
+    void continue_() {
+        if (!expectContinue_) return;
+        expectContinue_ = false;
+        auto r = std::make_unique<PendingResponse>(nullptr, nullptr, begin_);
+        r->interim = true;
+        r->hs = CONTINUE_RESPONSE;
+        r->size = r->hs.size();
+        r->state = ResponseState::HEADER;
+        resp_.push(std::move(r));
+    }
+
+    bool canRead_() const {
+        return !skip_ && (!bodyPaused_ || held_.size() < options_.pausedReadAhead);
+    }
+
+    void callHandler_(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+        auto start = MetricsClock::now();
+        requestHandler_(header, body, resp);
+        handlerNs_ += elapsedNs(start);
+    }
+
+    // resp is null when answering from cache
+    void queue_(std::unique_ptr<Response> resp, std::shared_ptr<const CachedResponse> cached = nullptr) {
+        MetricsShard::local().record(LatencyStage::HANDLER, handlerNs_);
+        if (resp) {
+            applyFileConditionals(method_, header_, *resp);
+            if (cacheStore_) cached = cache_->store(target_, header_, *resp);
+        }
+        auto r = std::make_unique<PendingResponse>(std::move(resp), std::move(cached), begin_);
+        if (r->resp && (r->async = dynamic_cast<AsyncResponseBody *>(r->resp->body.get()))) {
+            if (!wakeGate_) wakeGate_ = std::make_shared<WakeGate>(conn_);
+            r->async->setWaker([gate = wakeGate_]() {
+                gate->wake();
+            });
+        }
+        if (accessLog_) {
+            r->access.time = AccessRecord::wallTime(elapsedNs(begin_));
+            r->access.bytesIn = bodyBytes_;
+            r->access.status = uint16_t(r->cached ? r->cached->status : r->resp->status);
+            r->access.version = AccessRecord::versionOf(version_);
+            r->access.setMethod(method_);
+            r->access.setTarget(target_);
+            auto agent = header_.find(normalizeFieldName("User-Agent"));
+            r->access.setAgent(agent != header_.end() ? agent->second : std::string());
+        }
+        resp_.push(std::move(r));
+    }
+
+    // next piece of the body into r.buf, nullptr at the end; false while an async body has nothing
+    // yet, leaving an empty buffer so the next write event polls again
+    bool nextChunk_(PendingResponse &r) {
+        r.cur = 0;
+        if (r.ended) {
+            r.buf = nullptr;
+            r.size = 0;
+            return true;
+        }
+        if (r.async) r.async->takeNotification();
+        if (!r.chunked) {
+            // counted as written once handed over, the transport sends it after what is queued
+            if (size_t n = r.resp->body->spliceTo(*conn_)) {
+                bump(MetricsShard::local().bytesOut, uint64_t(n));
+                r.sent += n;
+            }
+        }
+        auto [p, s] = r.resp->body->get();
+        if (p && s == 0) {
+            asyncWait_ = true;
+            r.buf = r.hs.data();
+            r.size = 0;
+            return false;
+        }
+        if (!p) {
+            r.ended = true;
+            if (r.resp->body->aborted()) {
+                bodyAbort_ = true;  // a complete-looking response would hide the loss
+                r.buf = nullptr;
+                r.size = 0;
+                return true;
+            }
+            r.hs = r.chunked ? "0\r\n\r\n" : "";
+            r.buf = r.chunked ? r.hs.data() : nullptr;
+            r.size = r.hs.size();
+            return true;
+        }
+        if (r.chunked) {
+            char prefix[24];
+            r.hs.assign(prefix, snprintf(prefix, sizeof(prefix), "%zx\r\n", s)).append(p, s).append("\r\n");
+            p = r.hs.data();
+            s = r.hs.size();
+        }
+        r.buf = p;
+        r.size = s;
+        return true;
+    }
+
+    void logAccess_(PendingResponse &r, uint64_t total) {
+        r.access.latency = total;
+        r.access.bytesOut = r.sent;
+        accessLog_->log(r.access);
+    }
+
+    long timeoutMs_(TimeoutKind kind) const {
+        switch (kind) {
+            case TimeoutKind::IDLE:
+                return options_.idleTimeoutMs;
+            case TimeoutKind::HEADER:
+                return options_.headerTimeoutMs;
+            case TimeoutKind::BODY:
+                return options_.bodyTimeoutMs;
+            case TimeoutKind::WRITE:
+                return options_.writeTimeoutMs;
+        }
+        return 0;
+    }
+
+    // arms the deadline for what the connection waits on now. Progress (bytes moved this event)
+    // pushes body and write deadlines out by noting the time only; a timer firing early is armed
+    // again for the rest, so busy connections never touch the wheel
+    void updateTimer_(bool progress, bool asyncWait) {
+        std::optional<TimeoutKind> kind;
+        if (!resp_.empty()) {
+            if (!asyncWait) kind = TimeoutKind::WRITE;  // a handler producing the body slowly is not timed
+        } else if (inBody_) {
+            if (!bodyPaused_) kind = TimeoutKind::BODY;  // the server holds back, not the client
+        } else if (inMessage_ || !served_) {
+            kind = TimeoutKind::HEADER;
+        } else {
+            kind = TimeoutKind::IDLE;
+        }
+        setDeadline_(kind, progress && (kind == TimeoutKind::BODY || kind == TimeoutKind::WRITE));
+    }
+
+    // HTTP/2 and upgraded connections keep the idle and write deadlines, any byte moved is progress
+    void protocolTimer_() {
+        std::optional<TimeoutKind> kind;
+        uint64_t moved;
+        if (h2_) {
+            moved = h2_->transferred();
+            if (h2_->writePending()) {
+                kind = TimeoutKind::WRITE;
+            } else if (!h2_->producing()) {
+                kind = TimeoutKind::IDLE;
+            }
+        } else {
+            moved = upgraded_->transferred();
+            kind = upgraded_->writePending() ? TimeoutKind::WRITE : TimeoutKind::IDLE;
+        }
+        bool progress = moved != transferred_;
+        transferred_ = moved;
+        setDeadline_(kind, progress);
+    }
+
+    // arms timer_ for kind unless it already is, refresh restarts the armed deadline from now
+    void setDeadline_(std::optional<TimeoutKind> kind, bool refresh) {
+        long ms = kind ? timeoutMs_(*kind) : 0;
+        if (!ms) kind.reset();
+        if (kind == deadline_) {
+            if (refresh) activity_ = MetricsClock::now();
+            return;
+        }
+        deadline_ = kind;
+        if (kind) {
+            activity_ = MetricsClock::now();
+            ConnectionRegistry::arm(*registered_, timer_, ms);
+        } else {
+            ConnectionRegistry::cancel(*registered_, timer_);
+        }
+    }
+
+    // after HTTP/1.x: a missed deadline makes the protocol close gracefully (GOAWAY, close frame),
+    // missing it once more closes the connection
+    void protocolHandler_(EventType e, bool draining) {
+        if (timer_.fired.load(std::memory_order_relaxed) && deadline_) {
+            auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(MetricsClock::now() - activity_);
+            long left = timeoutMs_(*deadline_) - long(idle.count());
+            if (left <= 0) {
+                if (expired_) {
+                    conn_->hShutdown(true, true);
+                    return;
+                }
+                bump(MetricsShard::local().timeouts[int(*deadline_)], uint64_t(1));
+                expired_ = true;
+                if (h2_) {
+                    h2_->goAway();
+                } else {
+                    upgraded_->expire();
+                }
+                activity_ = MetricsClock::now();
+                left = timeoutMs_(*deadline_);
+            }
+            ConnectionRegistry::arm(*registered_, timer_, left);
+        }
+        if (h2_) {
+            if (draining) h2_->goAway();
+            h2_->handler(e);
+        } else {
+            upgraded_->handler(e);
+        }
+        protocolTimer_();
+    }
+
     void handler_(EventType e) {
-        bool httpError = false;
+        ConnectionRegistry::probe(*registered_, conn_.get());
+        bool draining = registry_->draining.load(std::memory_order_relaxed);
+        if (h2_ || upgraded_) {
+            protocolHandler_(e, draining);
+            return;
+        }
+        if (timer_.fired.load(std::memory_order_relaxed) && deadline_) {
+            auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(MetricsClock::now() - activity_);
+            long left = timeoutMs_(*deadline_) - long(idle.count());
+            if (left <= 0) {
+                bump(MetricsShard::local().timeouts[int(*deadline_)], uint64_t(1));
+                conn_->hShutdown(true, true);
+                return;
+            }
+            ConnectionRegistry::arm(*registered_, timer_, left);
+        }
+        bool httpError = false, progress = false;
         if (!resp_.empty()) {
             PendingResponse *r = resp_.front().get();
             int ec;
             size_t n;
             switch (r->state) {
                 case ResponseState::NEW:
-                    r->hs.append("HTTP/").append(r->resp->version).append(" ");
-                    r->hs.append(std::to_string(r->resp->status)).append(" ");
-                    r->hs.append(r->resp->message).append("\r\n");
-                    r->hs.append("Connection: ").append(keepalive_ ? "keep-alive" : "close").append("\r\n");
-                    if (r->resp->body) {
-                        size_t len = r->resp->body->len();
-                        if (len > 0) {
-                            r->hs.append("Content-Length: ").append(std::to_string(len)).append("\r\n");
-                        } else {
+                    if (draining) keepalive_ = false;
+                    if (r->cached) {
+                        const std::string &bytes = r->cached->bytes;
+                        r->size = method_ == "HEAD" ? r->cached->headerLen : bytes.size();
+                        if (!keepalive_) {  // stored for keep-alive, copy once with the token replaced
+                            size_t pos = r->cached->connectionPos;
+                            r->hs.append(bytes, 0, pos).append("close").append(bytes, pos + 10, r->size - pos - 10);
+                            r->size = r->hs.size();
+                        }
+                    } else {
+                        if (r->async) {
+                            r->async->takeNotification();
+                            if (!r->async->headReady(*r->resp)) {
+                                asyncWait_ = true;
+                                break;
+                            }
+                            r->access.status = uint16_t(r->resp->status);
+                        }
+                        ssize_t len = r->resp->body ? r->resp->body->len() : 0;
+                        if (len == 0) {
                             r->resp->body.reset();
+                        } else if (len == ResponseBody::CHUNKED && version_ != "1.1") {
+                            len = UNTIL_CLOSE;
+                            keepalive_ = false;
                         }
+                        r->chunked = len == ResponseBody::CHUNKED;
+                        appendResponseHead(r->hs, *r->resp, r->resp->status == 101 ? "Upgrade" :
+                                                            keepalive_ ? "keep-alive" : "close", len);
+                        r->size = r->hs.size();
                     }
-                    for (auto &&[k, v]: r->resp->header) {
-                        r->hs.append(k).append(": ").append(v).append("\r\n");
-                    }
-                    r->hs.append("\r\n");
                     r->cur = 0;
-                    r->size = r->hs.size();
                     r->state = ResponseState::HEADER;
                     [[fallthrough]];
                 case ResponseState::HEADER:
                     if (!(e & EVENT_OUT)) break;
-                    n = conn_->hWrite(r->hs.data() + r->cur, r->size - r->cur, ec);
+                    n = conn_->hWrite((r->hs.empty() ? r->cached->bytes.data() : r->hs.data()) + r->cur,
+                                      r->size - r->cur, ec);
                     if (n > 0) {
+                        progress = true;
+                        MetricsShard &metrics = MetricsShard::local();
+                        bump(metrics.bytesOut, uint64_t(n));
+                        r->sent += n;
+                        if (!firstByte_) {
+                            firstByte_ = true;
+                            metrics.record(LatencyStage::ACCEPT_TO_FIRST_BYTE, elapsedNs(accepted_));
+                        }
                         if ((r->cur += n) == r->size) {
                             r->cur = 0;
-                            if (method_ == "HEAD" || !r->resp->body) {
+                            if (r->interim || r->cached || method_ == "HEAD" || !r->resp->body) {
                                 r->size = 0;
                                 r->buf = nullptr;
                             } else {
-                                auto [p, s] = r->resp->body->get();
-                                r->size = s;
-                                r->buf = p;
+                                nextChunk_(*r);
                             }
                             r->state = ResponseState::BODY;
                         } else break;
@@ -136,16 +718,19 @@ private:
                         break;
                     }
                     [[fallthrough]];
-                case ResponseState::BODY:
+                case ResponseState::BODY: {
                     if (!(e & EVENT_OUT)) break;
-                    while (r->buf) {
-                        n = conn_->hWrite(r->buf + r->cur, r->size - r->cur, ec);
+                    // write interest stays on, so past the budget the loop comes back after the others
+                    size_t budget = options_.writeBudget ? options_.writeBudget : SIZE_MAX;
+                    while (r->buf && budget) {
+                        n = conn_->hWrite(r->buf + r->cur, std::min(r->size - r->cur, budget), ec);
                         if (n > 0 || (r->size == r->cur && !ec)) {
+                            progress = progress || n > 0;
+                            bump(MetricsShard::local().bytesOut, uint64_t(n));
+                            r->sent += n;
+                            budget -= n;
                             if ((r->cur += n) == r->size) {
-                                auto [p, s] = r->resp->body->get();
-                                r->cur = 0;
-                                r->size = s;
-                                r->buf = p;
+                                if (!nextChunk_(*r)) break;
                             } else break;
                         } else {
                             if (ec) {
@@ -155,54 +740,130 @@ private:
                             break;
                         }
                     }
-                    if (!r->buf) {
+                    if (!r->buf && r->interim) {
+                        resp_.pop();
+                    } else if (!r->buf) {
+                        MetricsShard &metrics = MetricsShard::local();
+                        uint64_t total = elapsedNs(r->begin);
+                        metrics.record(LatencyStage::WRITE_DRAIN, elapsedNs(r->queued));
+                        metrics.record(LatencyStage::TOTAL, total);
+                        bump(metrics.requests, uint64_t(1));
+                        if (accessLog_) logAccess_(*r, total);
                         resp_.pop();
+                        if (resp_.empty() && upgrade_) {
+                            upgraded_ = std::move(upgrade_);
+                            std::string data = std::move(upgradeData_);
+                            upgraded_->start(conn_, data.data(), data.size());
+                            protocolTimer_();
+                            return;
+                        }
                     }
+                }
             }
         } else {
-            if ((e & EVENT_IN) && !skip_) {
+            bool resumed = false;
+            if (bodyPaused_ && !flow_->paused()) {
+                resumed = true;
+                bodyPaused_ = false;
+                continue_();
+                llhttp_resume(&parser_);
+                std::string held = std::move(held_);
+                held_.clear();
+                // run even when nothing is held, a pause on the last body piece leaves the message open
+                if (!parse_(held.data(), held.size())) {
+                    httpError = true;
+                }
+                if (h2_) {
+                    h2_->handler(e);
+                    protocolTimer_();
+                    return;
+                }
+            }
+            if (((e & EVENT_IN) || readPending_ || resumed) && canRead_() && !httpError) {
                 int ec;
                 size_t n;
+                size_t budget = options_.readBudget ? options_.readBudget : SIZE_MAX;
+                readPending_ = false;
                 do {
-                    n = conn_->hRead(recvBuffer.data(), READ_BUFFER_SIZE, ec);
+                    if (recvBuffer.size() < options_.readBufferSize) recvBuffer.resize(options_.readBufferSize);
+                    size_t want = std::min(options_.readBufferSize, budget);
+                    if (bodyPaused_) want = std::min(want, options_.pausedReadAhead - held_.size());
+                    n = conn_->hRead(recvBuffer.data(), want, ec);
                     if (n > 0) {
-                        llhttp_errno_t err;
-                        if ((err = llhttp_execute(&parser_, recvBuffer.data(), n)) != HPE_OK) {
-                            Logger::global->log(LOG_WARN, std::string("http err: ") + llhttp_errno_name(err));
+                        progress = true;
+                        budget -= n;
+                        bump(MetricsShard::local().bytesIn, uint64_t(n));
+                        if (bodyPaused_) {
+                            held_.append(recvBuffer.data(), n);
+                        } else if (!parse_(recvBuffer.data(), n)) {
                             httpError = true;
                         }
+                        if (h2_) {
+                            h2_->handler(e);
+                            protocolTimer_();
+                            return;
+                        }
                     } else {
                         if (ec) {
                             Logger::global->log(LOG_WARN, strerror(ec));
                             conn_->hShutdown(true, true);
                         }
                     }
-                } while (n > 0);
+                } while (n > 0 && budget && canRead_() && !httpError);
+                // a transport may hold decrypted bytes the poller does not see, so the
+                // connection asks for another event instead of relying on EVENT_IN
+                readPending_ = n > 0 && !budget && canRead_();
             }
-            if ((conn_->hIsReadClosed() || !keepalive_) && !finish_ && !skip_) {
+            if (draining && !inMessage_) keepalive_ = false;  // idle between requests
+            if ((conn_->hIsReadClosed() || !keepalive_) && !finish_ && !skip_ && !bodyPaused_) {
                 finish_ = true;
                 llhttp_errno_t err;
                 if ((err = llhttp_finish(&parser_)) != HPE_OK) {
                     Logger::global->log(LOG_WARN, std::string("http err: ") + llhttp_errno_name(err));
+                    MetricsShard::local().httpError(err);
                     httpError = true;
                 }
             }
         }
 
-        conn_->hSetWrite(!resp_.empty());
-        conn_->hSetRead(resp_.empty() && !skip_);
+        updateTimer_(progress, asyncWait_);
+        if (asyncWait_) {
+            // a notification arriving after the poll above must not be lost to clearing write interest
+            std::lock_guard guard(wakeGate_->lock);
+            conn_->hSetWrite(resp_.front()->async->notified());
+            asyncWait_ = false;
+        } else if (bodyPaused_) {
+            // a resume() after the check above must not be lost to clearing write interest
+            std::lock_guard guard(wakeGate_->lock);
+            conn_->hSetWrite(!resp_.empty() || readPending_ || !flow_->paused());
+        } else {
+            conn_->hSetWrite(!resp_.empty() || readPending_);
+        }
+        if (bodyAbort_) {
+            conn_->hShutdown(true, true);
+            return;
+        }
+        conn_->hSetRead(resp_.empty() && canRead_());
         if (skip_ || finish_) {
             conn_->hShutdown(true, false);
         }
-        if (httpError || conn_->hIsWriteClosed() || (conn_->hIsReadClosed() && resp_.empty())) {
+        if (httpError || conn_->hIsWriteClosed() || (conn_->hIsReadClosed() && resp_.empty() && !bodyPaused_)) {
             conn_->hShutdown(true, true);
         }
     }
 
     static int onMessageBegin(llhttp_t *parser) {
         auto o = (HttpStreamImpl *) parser->data;
+        o->inMessage_ = true;
+        o->inBody_ = false;
         o->method_ = o->target_ = o->version_ = "";
         o->header_.clear();
+        o->h2Upgrade_ = false;
+        o->cacheStore_ = false;
+        o->cached_.reset();
+        o->begin_ = MetricsClock::now();
+        o->handlerNs_ = 0;
+        o->bodyBytes_ = 0;
         return 0;
     }
 
@@ -243,33 +904,97 @@ private:
 
     static int onHeadersComplete(llhttp_t *parser) {
         auto o = (HttpStreamImpl *) parser->data;
+        MetricsShard::local().record(LatencyStage::HEADER_PARSE, elapsedNs(o->begin_));
+        o->inBody_ = true;
+        auto expect = o->header_.find(normalizeFieldName("Expect"));
+        o->expectContinue_ = o->version_ == "1.1" && expect != o->header_.end() &&
+                             hasToken(expect->second, "100-continue");
+        auto up = o->header_.find(normalizeFieldName("Upgrade"));
+        auto settings = o->header_.find(normalizeFieldName("HTTP2-Settings"));
+        if (o->version_ == "1.1" && up != o->header_.end() && settings != o->header_.end() &&
+            hasToken(up->second, "h2c")) {
+            o->h2Upgrade_ = true;
+            o->h2Settings_ = settings->second;
+        }
+        if (o->cache_ && !o->h2Upgrade_) {
+            o->cached_ = o->cache_->lookup(o->method_, o->target_, o->header_, o->cacheStore_);
+            if (o->cached_) {  // the handler never sees this request
+                o->continue_();
+                return 0;
+            }
+        }
+        if (!o->flow_ || o->flow_.use_count() > 1) {  // one a handler still holds may be resumed late
+            if (!o->wakeGate_) o->wakeGate_ = std::make_shared<WakeGate>(o->conn_);
+            o->flow_ = std::make_shared<BodyFlow>();
+            o->flow_->setWaker([gate = o->wakeGate_]() {
+                gate->wake();
+            });
+        }
         HttpHeader header{o->method_, o->target_, o->version_, o->header_};
+        header.flow = o->flow_;
         std::unique_ptr<Response> response;
-        o->requestHandler_(&header, nullptr, response);
+        o->callHandler_(&header, nullptr, response);
+        if (header.result != HeaderAction::OK) {
+            o->cacheStore_ = false;
+        } else if (o->flow_->paused()) {
+            o->bodyPaused_ = true;  // 100 Continue waits for resume()
+            return HPE_PAUSED;
+        } else {
+            o->continue_();
+        }
         if (header.result == HeaderAction::SKIP_BODY) {
             if (!response)return -1;
-            o->resp_.push(std::make_unique<PendingResponse>(std::move(response)));
+            o->queue_(std::move(response));
             o->skip_ = true;
+            o->keepalive_ = false;
+            return HPE_PAUSED;  // nothing of the body reaches the handler
+        }
+        if (header.result == HeaderAction::UPGRADE) {
+            if (!response || !header.upgrade)return -1;
+            o->queue_(std::move(response));
+            o->upgrade_ = std::move(header.upgrade);
+            return 2;  // no body, llhttp pauses after the message as for any upgrade
         }
         return header.result == HeaderAction::CLOSE ? -1 : 0;
     }
 
     static int onBody(llhttp_t *parser, const char *at, size_t length) {
         auto o = (HttpStreamImpl *) parser->data;
+        o->bodyBytes_ += length;
+        if (o->cached_) return 0;
         std::unique_ptr<Response> response;
         HttpData data{at, length};
-        o->requestHandler_(nullptr, &data, response);
+        o->callHandler_(nullptr, &data, response);
         // ignoring supplied response
+        if (o->flow_->paused()) {
+            o->bodyPaused_ = true;
+            return HPE_PAUSED;
+        }
         return 0;
     }
 
     static int onMessageComplete(llhttp_t *parser) {
         auto o = (HttpStreamImpl *) parser->data;
+        o->inMessage_ = o->inBody_ = false;
+        o->served_ = true;
         std::unique_ptr<Response> response;
+        if (o->upgrade_) {  // the request handler is done, the 101 is already queued
+            o->keepalive_ = true;
+            return HPE_PAUSED;
+        }
         o->keepalive_ = llhttp_should_keep_alive(parser);
-        o->requestHandler_(nullptr, nullptr, response);
+        if (o->cached_) {
+            o->queue_(nullptr, std::move(o->cached_));
+            return 0;
+        }
+        o->callHandler_(nullptr, nullptr, response);
+        if (response && o->h2Upgrade_) {  // answer on stream 1 once the upgrade completes
+            applyFileConditionals(o->method_, o->header_, *response);
+            o->h2Response_ = std::move(response);
+            return HPE_PAUSED;
+        }
         if (response) {
-            o->resp_.push(std::make_unique<PendingResponse>(std::move(response)));
+            o->queue_(std::move(response));
             return 0;
         }
         // no response means to forcibly close connection
@@ -278,17 +1003,66 @@ private:
 };
 
 
-HttpServer::HttpServer(std::shared_ptr<Listener> lis) : listener_(std::move(lis)) {}
+HttpServer::HttpServer(std::shared_ptr<Listener> lis) :
+        listener_(std::move(lis)), connections_(std::make_shared<ConnectionRegistry>()) {}
 
 void HttpServer::enableHandler(NewClientHandler h) {
     newClientHandler_ = std::move(h);
+    connections_->start();
+    if (!listener_) return;
     listener_->enableHandler([ptr = shared_from_this()](EventType e) {
         ptr->acceptHandler_(e);
     });
 }
 
+void HttpServer::setTransport(TransportFactory f) {
+    transportFactory_ = std::move(f);
+}
+
+void HttpServer::setAccessLog(std::shared_ptr<AccessLog> log) {
+    accessLog_ = std::move(log);
+}
+
+void HttpServer::setCache(std::shared_ptr<ResponseCache> cache) {
+    cache_ = std::move(cache);
+}
+
+void HttpServer::setOptions(const HttpServerOptions &options) {
+    options_ = options;
+}
+
+void HttpServer::serve(std::shared_ptr<Transport> conn) {
+    if (options_.maxConnections && connections_->open >= options_.maxConnections) {
+        conn->hShutdown(true, true);
+        return;
+    }
+    if (transportFactory_) {
+        conn = transportFactory_(std::move(conn));
+    }
+    if (conn) {
+        std::shared_ptr<HttpStreamImpl> hs = std::make_shared<HttpStreamImpl>(std::move(conn), accessLog_, cache_,
+                                                                              connections_, options_);
+        hs->enableHandler(newClientHandler_);
+    }
+}
+
 void HttpServer::stop() {
-    listener_->stop();
+    if (listener_) {
+        listener_->stop();
+    }
+}
+
+size_t HttpServer::drain(std::chrono::milliseconds timeout) {
+    stop();
+    connections_->draining = true;
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    size_t open;
+    // woken every round: a wake-up may race a loop clearing write interest, and a response
+    // finishing only now closes its connection on the next event
+    while ((open = connections_->wakeAll()) && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return open;
 }
 
 void HttpServer::acceptHandler_(EventType e) {
@@ -297,8 +1071,7 @@ void HttpServer::acceptHandler_(EventType e) {
             int ec;
             std::shared_ptr<Connection> c = listener_->hAccept(ec);
             if (c) {
-                std::shared_ptr<HttpStreamImpl> hs = std::make_shared<HttpStreamImpl>(std::move(c));
-                hs->enableHandler(newClientHandler_());
+                serve(plainTransport(std::move(c)));
             } else {
                 if (ec) {
                     Logger::global->log(LOG_WARN, strerror(ec));
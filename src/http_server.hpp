@@ -2,12 +2,17 @@
 #define SIMPLE_HTTP_SERVER_HTTP_SERVER_HPP
 
 #include "io_context.hpp"
+#include "transport.hpp"
+#include "access_log.hpp"
 #include<functional>
 #include<string>
 #include<memory>
+#include<mutex>
+#include<atomic>
 #include<unordered_map>
 #include<variant>
 #include<algorithm>
+#include<chrono>
 #include<cctype>
 
 namespace SHS1 {
@@ -21,9 +26,33 @@ using SNL1::DisableCopy;
 }
 
 enum class HeaderAction {
-    OK,             // continue to process the request normally
-    SKIP_BODY,      // instantly respond to client, then close connection
-    CLOSE           // instantly close connection
+    OK,             // continue to process the request normally, a client expecting it gets 100 Continue
+    SKIP_BODY,      // instantly respond to client without reading the body, then close connection
+    CLOSE,          // instantly close connection
+    UPGRADE         // respond (101) without reading a body, then hand the connection to HttpHeader::upgrade
+};
+
+// protocol taking over an HTTP/1.1 connection after HeaderAction::UPGRADE
+class UpgradedConnection {
+public:
+    // called on the connection's loop once the 101 response is written,
+    // data holds bytes the client sent right after the upgrade request
+    virtual void start(std::shared_ptr<Transport> conn, const char *data, size_t len) = 0;
+
+    virtual void handler(SNL1::EventType e) = 0;
+
+    // for the idle and write deadlines (HttpServerOptions), asked after every event:
+    // bytes read and written so far, any change counts as progress
+    virtual uint64_t transferred() = 0;
+
+    // output waits for the peer to read it (write deadline), otherwise the idle deadline applies
+    virtual bool writePending() = 0;
+
+    // a deadline passed: start closing (e.g. a close frame), the connection is closed when the
+    // deadline passes once more
+    virtual void expire() = 0;
+
+    virtual ~UpgradedConnection();
 };
 
 inline std::string normalizeFieldName(const char *at, size_t len) {
@@ -40,12 +69,48 @@ inline std::string normalizeFieldName(const std::string &s) {
     return normalizeFieldName(s.data(), s.length());
 }
 
+// case-insensitive match of one element in a comma separated header value
+bool hasToken(const std::string &list, const char *token);
+
+struct Response;
+
+// status line and header block of an HTTP/1.1 response whose body is len bytes; with
+// ResponseBody::CHUNKED it announces chunked transfer, any other negative len no framing at all
+void appendResponseHead(std::string &out, const Response &resp, const char *connection, ssize_t len);
+
+class ResponseCache;
+
+class ConnectionRegistry;
+
+// request body flow control: a handler that cannot keep up pauses the body, the connection then
+// stops reading so TCP flow control slows the client down, and resumes when told
+class BodyFlow final : private SNL1::DisableCopy {
+public:
+    // loop thread, from the handler: no body callback follows until resume()
+    void pause();
+
+    // any thread
+    void resume();
+
+    bool paused() const;
+
+    // connection side: waker makes the loop look again, called from resume()
+    void setWaker(std::function<void()> waker);
+
+private:
+    std::mutex wakerLock_;
+    std::function<void()> waker_;
+    std::atomic<bool> paused_{false};
+};
+
 struct HttpHeader {
     const std::string &method;
     const std::string &target;
     const std::string &version;
     const std::unordered_map<std::string, std::string> &header;
     HeaderAction result;
+    std::shared_ptr<UpgradedConnection> upgrade;  // required with HeaderAction::UPGRADE
+    std::shared_ptr<BodyFlow> flow;               // HTTP/1.x only, null on HTTP/2
 
     HttpHeader(const std::string &method, const std::string &target, const std::string &version,
                const std::unordered_map<std::string, std::string> &header);
@@ -60,17 +125,67 @@ class ResponseBody {
 public:
 
     // returning nullptr as buffer pointer indicate EOF
-    // NOTE: currently we don't support non-blocking streaming of real-time generated body,
-    //       do not return 0-sized buffer
+    // NOTE: do not return 0-sized buffer, only AsyncResponseBody may report "nothing yet"
     virtual std::pair<const char *, size_t> get() = 0;
 
+    // body length, even before actual data transfer, or CHUNKED when unknown
+    // (chunked transfer coding on HTTP/1.1, delimited by closing the connection on HTTP/1.0)
     virtual ssize_t len() = 0;
 
+    // optional: hands the rest of the body to conn to move by itself (Transport::hSplice) instead
+    // of through get(), returns the bytes handed over; HTTP/1.x with Content-Length only
+    virtual size_t spliceTo(Transport &conn);
+
+    // checked at EOF: the body broke off before its length (e.g. a file that could not be read),
+    // the connection is reset instead of ending the response
+    virtual bool aborted();
+
     virtual ~ResponseBody();
 
-    // currently we don't support chunked transfer
-    // len() should return body length, even before actual data transfer
-    // static constexpr ssize_t CHUNKED = -1;
+    static constexpr ssize_t CHUNKED = -1;
+
+};
+
+// body of a response whose status and header fields become known later, e.g. from an upstream
+// server; the connection polls it on its own loop and the producer calls notify() from any thread
+class AsyncResponseBody : public ResponseBody {
+public:
+    // loop thread: once known, fill in resp's status, message and header and return true
+    virtual bool headReady(Response &resp) = 0;
+
+    // get() may also return {non-null, 0}: nothing available yet, poll again after notify()
+
+    // any thread
+    void notify();
+
+    // connection side: waker makes the loop poll again, called from notify()
+    void setWaker(std::function<void()> waker);
+
+    bool notified() const;
+
+    bool takeNotification();
+
+private:
+    std::mutex wakerLock_;
+    std::function<void()> waker_;
+    std::atomic<bool> notified_{false};
+};
+
+struct StringResponse : public ResponseBody {
+    std::string s;
+    bool consumed;
+
+    explicit StringResponse(std::string s) : s(std::move(s)), consumed{false} {}
+
+    std::pair<const char *, size_t> get() override {
+        if (consumed)return {nullptr, 0};
+        consumed = true;
+        return {s.data(), s.size()};
+    }
+
+    ssize_t len() override {
+        return (ssize_t) s.size();
+    }
 
 };
 
@@ -90,18 +205,58 @@ using RequestHandler = std::function<void(HttpHeader *, HttpData *, std::unique_
 
 using NewClientHandler = std::function<RequestHandler()>;
 
+// limits, buffer sizes and deadlines of an HttpServer; a deadline of 0 is disabled.
+// Deadlines apply to HTTP/1.x connections until they switch protocols
+struct HttpServerOptions {
+    size_t readBufferSize = 10 * 1024 * 1024;  // per loop thread, the most one HTTP/1.x read takes in
+    size_t maxConnections = 0;                 // more are closed right after accept, 0 for no limit
+    size_t readBudget = 1024 * 1024;           // HTTP/1.x bytes one connection reads per event, 0 for no limit
+    size_t writeBudget = 1024 * 1024;          // and writes; the rest waits until the loop served the others
+    size_t pausedReadAhead = 64 * 1024;        // request body bytes read on while BodyFlow is paused
+    long idleTimeoutMs = 75000;                // keep-alive connection waiting for its next request
+    long headerTimeoutMs = 60000;              // accept or first request byte until the header block is read
+    long bodyTimeoutMs = 60000;                // between two reads of a request body
+    long writeTimeoutMs = 60000;               // between two writes of a response the client does not read
+};
+
 class HttpServer final : private DisableCopy,
                          public std::enable_shared_from_this<HttpServer> {
 public:
     void enableHandler(NewClientHandler h);
 
+    // wrap accepted connections (e.g. TLS), must be called before enableHandler
+    void setTransport(TransportFactory f);
+
+    // log every answered request, must be called before enableHandler
+    void setAccessLog(std::shared_ptr<AccessLog> log);
+
+    // answer HTTP/1.x GET and HEAD from cache when possible, must be called before enableHandler
+    void setCache(std::shared_ptr<ResponseCache> cache);
+
+    // must be called before enableHandler
+    void setOptions(const HttpServerOptions &options);
+
+    // serve a connection accepted by another I/O backend, call on the loop thread owning it
+    void serve(std::shared_ptr<Transport> conn);
+
     void stop();
 
+    // graceful shutdown: stops the listener, answers requests still arriving with Connection: close
+    // (GOAWAY on HTTP/2), closes idle keep-alive connections and waits up to timeout for responses
+    // in flight to be written; returns how many connections were still open at the deadline
+    size_t drain(std::chrono::milliseconds timeout);
+
+    // lis may be null when every connection arrives through serve()
     static std::shared_ptr<HttpServer> create(std::shared_ptr<Listener> lis);
 
 private:
     std::shared_ptr<Listener> listener_;
     NewClientHandler newClientHandler_;
+    TransportFactory transportFactory_;
+    std::shared_ptr<AccessLog> accessLog_;
+    std::shared_ptr<ResponseCache> cache_;
+    std::shared_ptr<ConnectionRegistry> connections_;
+    HttpServerOptions options_;
 
     explicit HttpServer(std::shared_ptr<Listener> lis);
 
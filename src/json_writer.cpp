@@ -0,0 +1,178 @@
+#include "json_writer.hpp"
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace SHS1 {
+
+namespace {
+
+constexpr char HEX[] = "0123456789abcdef";
+
+// length of the valid UTF-8 sequence starting at p, 0 if it is not one
+size_t utf8Sequence(const uint8_t *p, size_t n) {
+    size_t len;
+    uint32_t min, c;
+    if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        len = 4, min = 0x10000, c = p[0] & 0x07;
+    } else if (p[0] >= 0xe0) {
+        len = 3, min = 0x800, c = p[0] & 0x0f;
+    } else if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        len = 2, min = 0x80, c = p[0] & 0x1f;
+    } else {
+        return 0;
+    }
+    if (n < len) return 0;
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80) return 0;
+        c = c << 6 | (p[i] & 0x3f);
+    }
+    return c >= min && c <= 0x10ffff && (c < 0xd800 || c > 0xdfff) ? len : 0;
+}
+
+// bytes before the first one that needs attention: control, '"', '\\' or non-ASCII
+size_t plainPrefix(const char *s, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i space = _mm256_set1_epi8(0x20), quote = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+        // signed compare: bytes from 0x80 are negative and count as below 0x20
+        __m256i m = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bs)));
+        if (auto bits = (uint32_t) _mm256_movemask_epi8(m)) return i + __builtin_ctz(bits);
+    }
+#elif defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(0x20), quote = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i m = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                 _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)));
+        if (auto bits = (uint32_t) _mm_movemask_epi8(m)) return i + __builtin_ctz(bits);
+    }
+#endif
+    for (; i < n; ++i) {
+        auto c = (unsigned char) s[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') break;
+    }
+    return i;
+}
+
+}
+
+void appendJsonString(std::string &out, const char *s, size_t n) {
+    out.push_back('"');
+    size_t i = 0;
+    while (i < n) {
+        size_t plain = plainPrefix(s + i, n - i);
+        out.append(s + i, plain);
+        if ((i += plain) == n) break;
+        auto c = (unsigned char) s[i];
+        if (c >= 0x80) {
+            if (size_t len = utf8Sequence(reinterpret_cast<const uint8_t *>(s + i), n - i)) {
+                out.append(s + i, len);
+                i += len;
+                continue;
+            }
+        }
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                char esc[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 15]};
+                out.append(esc, sizeof(esc));
+        }
+        ++i;
+    }
+    out.push_back('"');
+}
+
+JsonWriter::JsonWriter(std::string &out, bool continued) : out_(out), comma_(continued) {}
+
+void JsonWriter::value_() {
+    if (comma_) out_.push_back(',');
+    comma_ = true;
+}
+
+void JsonWriter::beginObject() {
+    value_();
+    out_.push_back('{');
+    comma_ = false;
+}
+
+void JsonWriter::endObject() {
+    out_.push_back('}');
+    comma_ = true;
+}
+
+void JsonWriter::beginArray() {
+    value_();
+    out_.push_back('[');
+    comma_ = false;
+}
+
+void JsonWriter::endArray() {
+    out_.push_back(']');
+    comma_ = true;
+}
+
+void JsonWriter::key(const char *s, size_t n) {
+    value_();
+    appendJsonString(out_, s, n);
+    out_.push_back(':');
+    comma_ = false;
+}
+
+void JsonWriter::string(const char *s, size_t n) {
+    value_();
+    appendJsonString(out_, s, n);
+}
+
+void JsonWriter::number(int64_t v) {
+    value_();
+    char buf[24];
+    char *e = buf + sizeof(buf), *p = e;
+    auto u = v < 0 ? 0 - uint64_t(v) : uint64_t(v);
+    do {
+        *--p = char('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    out_.append(p, e - p);
+}
+
+void JsonWriter::boolean(bool v) {
+    value_();
+    out_.append(v ? "true" : "false");
+}
+
+void JsonWriter::null() {
+    value_();
+    out_.append("null");
+}
+
+void JsonWriter::beginStringValue() {
+    value_();
+    out_.push_back('"');
+}
+
+void JsonWriter::endStringValue() {
+    out_.push_back('"');
+}
+
+}
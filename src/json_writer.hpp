@@ -0,0 +1,62 @@
+#ifndef SIMPLE_HTTP_SERVER_JSON_WRITER_HPP
+#define SIMPLE_HTTP_SERVER_JSON_WRITER_HPP
+
+#include<string>
+#include<cstdint>
+#include<cstddef>
+
+namespace SHS1 {
+
+// append s as a quoted JSON string; bytes that are not valid UTF-8 are written as \u00XX
+void appendJsonString(std::string &out, const char *s, size_t n);
+
+// compact JSON appended straight to a caller-owned buffer, without building a tree;
+// the caller is responsible for balanced containers and a key before every object member
+class JsonWriter final {
+public:
+    // continued: out already ends with a value inside an open container, e.g. when a document
+    // is written in several steps
+    explicit JsonWriter(std::string &out, bool continued = false);
+
+    void beginObject();
+
+    void endObject();
+
+    void beginArray();
+
+    void endArray();
+
+    void key(const char *s, size_t n);
+
+    void key(const std::string &s) {
+        key(s.data(), s.size());
+    }
+
+    void string(const char *s, size_t n);
+
+    void string(const std::string &s) {
+        string(s.data(), s.size());
+    }
+
+    void number(int64_t v);
+
+    void boolean(bool v);
+
+    void null();
+
+    // a string value whose bytes the caller appends to the buffer between the two calls,
+    // they are not escaped (e.g. base64 produced in place)
+    void beginStringValue();
+
+    void endStringValue();
+
+private:
+    std::string &out_;
+    bool comma_;  // a value was completed, the next one needs a separator
+
+    void value_();
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_JSON_WRITER_HPP
@@ -0,0 +1,205 @@
+#include "listener_handoff.hpp"
+#include "logger.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr size_t MAX_HANDOFF_FDS = 64;
+constexpr int HANDOFF_TIMEOUT_MS = 10000;  // how long either side waits for the other
+
+bool unixAddress(const std::string &path, sockaddr_un &addr) {
+    addr = {};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+}
+
+// false on timeout
+bool readable(int fd, int timeoutMs) {
+    pollfd p{fd, POLLIN, 0};
+    int r;
+    while ((r = poll(&p, 1, timeoutMs)) < 0 && errno == EINTR) {}
+    return r > 0;
+}
+
+}
+
+ListenerHandoff::ListenerHandoff() : listenFd_(-1), stopPipe_{-1, -1} {}
+
+ListenerHandoff::~ListenerHandoff() {
+    if (thread_.joinable()) {
+        char c = 0;
+        if (write(stopPipe_[1], &c, 1) < 0) {
+            Logger::global->log(LOG_WARN, strerror(errno));
+        }
+        thread_.join();
+    }
+    if (listenFd_ >= 0) {  // still offering, path is ours
+        close(listenFd_);
+        unlink(path_.c_str());
+    }
+    for (int fd: stopPipe_) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+std::shared_ptr<ListenerHandoff> ListenerHandoff::offer(const std::string &path, std::vector<int> fds,
+                                                        std::function<void()> onTaken, int &ec) {
+    std::shared_ptr<ListenerHandoff> h(new ListenerHandoff());
+    sockaddr_un addr;
+    if (fds.empty() || fds.size() > MAX_HANDOFF_FDS || !unixAddress(path, addr)) {
+        ec = EINVAL;
+        return nullptr;
+    }
+    h->path_ = path;
+    h->fds_ = std::move(fds);
+    h->onTaken_ = std::move(onTaken);
+    if (pipe2(h->stopPipe_, O_CLOEXEC) < 0) {
+        ec = errno;
+        return nullptr;
+    }
+    // a socket file left by a process that did not exit cleanly
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        ec = errno;
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+    h->listenFd_ = fd;
+    h->thread_ = std::thread([p = h.get()]() {
+        p->run_();
+    });
+    ec = 0;
+    return h;
+}
+
+void ListenerHandoff::run_() {
+    for (;;) {
+        pollfd p[2] = {{listenFd_, POLLIN, 0}, {stopPipe_[0], POLLIN, 0}};
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            Logger::global->log(LOG_WARN, std::string("handoff: ") + strerror(errno));
+            return;
+        }
+        if (p[1].revents) return;
+        int conn = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) continue;
+        if (!serve_(conn)) {
+            close(conn);
+            continue;
+        }
+        // let go of path before the successor learns it may offer there itself
+        close(listenFd_);
+        listenFd_ = -1;
+        unlink(path_.c_str());
+        close(conn);
+        Logger::global->log(LOG_INFO, "handoff: listening sockets taken over");
+        onTaken_();
+        return;
+    }
+}
+
+bool ListenerHandoff::serve_(int conn) {
+    uint32_t n = uint32_t(fds_.size());
+    iovec iov{&n, sizeof(n)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)]{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(c), fds_.data(), sizeof(int) * n);
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(n))) {
+        Logger::global->log(LOG_WARN, std::string("handoff: ") + strerror(errno));
+        return false;
+    }
+    // one byte once the successor accepts on them
+    char ack;
+    if (!readable(conn, HANDOFF_TIMEOUT_MS) || read(conn, &ack, 1) != 1) {
+        Logger::global->log(LOG_WARN, "handoff: successor did not confirm, still serving");
+        return false;
+    }
+    return true;
+}
+
+ListenerTakeover::ListenerTakeover() : conn_(-1) {}
+
+ListenerTakeover::~ListenerTakeover() {
+    if (conn_ >= 0) close(conn_);
+}
+
+const std::vector<int> &ListenerTakeover::fds() const {
+    return fds_;
+}
+
+void ListenerTakeover::accepting() {
+    char ack = 1;
+    if (conn_ < 0 || write(conn_, &ack, 1) != 1) return;
+    // the predecessor closes once path is free
+    if (readable(conn_, HANDOFF_TIMEOUT_MS) && read(conn_, &ack, 1) == 0) {
+        Logger::global->log(LOG_INFO, "handoff: predecessor released its listening sockets");
+    }
+    close(conn_);
+    conn_ = -1;
+}
+
+std::shared_ptr<ListenerTakeover> ListenerTakeover::connect(const std::string &path, int &ec) {
+    std::shared_ptr<ListenerTakeover> t(new ListenerTakeover());
+    sockaddr_un addr;
+    if (!unixAddress(path, addr)) {
+        ec = EINVAL;
+        return nullptr;
+    }
+    t->conn_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (t->conn_ < 0 || ::connect(t->conn_, (sockaddr *) &addr, sizeof(addr)) < 0) {
+        ec = errno;
+        return nullptr;
+    }
+    if (!readable(t->conn_, HANDOFF_TIMEOUT_MS)) {
+        ec = ETIMEDOUT;
+        return nullptr;
+    }
+    uint32_t n = 0;
+    iovec iov{&n, sizeof(n)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)]{};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r = recvmsg(t->conn_, &msg, MSG_CMSG_CLOEXEC);
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); r > 0 && c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t old = t->fds_.size();
+        t->fds_.resize(old + k);
+        memcpy(t->fds_.data() + old, CMSG_DATA(c), sizeof(int) * k);
+    }
+    if (r != ssize_t(sizeof(n)) || (msg.msg_flags & MSG_CTRUNC) || t->fds_.size() != n || !n) {
+        ec = r < 0 ? errno : EPROTO;
+        for (int fd: t->fds_) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    ec = 0;
+    return t;
+}
+
+}
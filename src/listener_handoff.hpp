@@ -0,0 +1,64 @@
+#ifndef SIMPLE_HTTP_SERVER_LISTENER_HANDOFF_HPP
+#define SIMPLE_HTTP_SERVER_LISTENER_HANDOFF_HPP
+
+#include "io_context.hpp"
+#include<functional>
+#include<memory>
+#include<string>
+#include<thread>
+#include<vector>
+
+namespace SHS1 {
+
+// hot restart, old side: listening sockets are offered on a Unix socket at path.
+// A successor connects, receives them (SCM_RIGHTS) and confirms once it accepts on them;
+// only then onTaken runs (on the offering thread) and the offer ends, so the sockets never
+// stop accepting while binaries are swapped
+class ListenerHandoff final : private SNL1::DisableCopy {
+public:
+    ~ListenerHandoff();
+
+    // ec is set (errno value) if path cannot be bound
+    static std::shared_ptr<ListenerHandoff> offer(const std::string &path, std::vector<int> fds,
+                                                  std::function<void()> onTaken, int &ec);
+
+private:
+    std::string path_;
+    std::vector<int> fds_;
+    std::function<void()> onTaken_;
+    int listenFd_, stopPipe_[2];
+    std::thread thread_;
+
+    ListenerHandoff();
+
+    void run_();
+
+    // true once the successor confirmed
+    bool serve_(int conn);
+};
+
+// hot restart, new side: takes the listening sockets a predecessor offers at path
+class ListenerTakeover final : private SNL1::DisableCopy {
+public:
+    ~ListenerTakeover();
+
+    // the listening sockets, owned by the caller from now on
+    const std::vector<int> &fds() const;
+
+    // tells the predecessor we accept on the sockets, so it may drain; returns once it has let go
+    // of path, which can then be offered again
+    void accepting();
+
+    // nullptr with ec set (errno value) when nothing is offered at path
+    static std::shared_ptr<ListenerTakeover> connect(const std::string &path, int &ec);
+
+private:
+    int conn_;
+    std::vector<int> fds_;
+
+    ListenerTakeover();
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_LISTENER_HANDOFF_HPP
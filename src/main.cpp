@@ -1,104 +1,466 @@
 #include <cstring>
 #include <cstdlib>
+#include <csignal>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
 #include <utility>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "http_server.hpp"
+#include "echo_handler.hpp"
+#include "file_response.hpp"
+#include "response_cache.hpp"
+#include "proxy.hpp"
+#include "metrics.hpp"
 #include "logger.hpp"
-#include "json.h"
-#include "libbase64.h"
+
+#ifdef SHS_ENABLE_ZSTD
+#include "zstd_encoding.hpp"
+#endif
+
+#ifdef SHS_ENABLE_TLS
+#include "tls.hpp"
+#endif
+
+#ifdef SHS_ENABLE_URING
+#include "uring_backend.hpp"
+#include "listener_handoff.hpp"
+#endif
 
 using namespace SHS1;
 using namespace SNL1;
 
-struct StringResponse : public ResponseBody {
-    std::string s;
-    bool consumed;
+struct Tuning {
+    int port = 8080;
+    int threads = 8;
+    int events = 65536, eventQueue = 65536;  // second and third Context arguments
+    int backlog = 4096;
+    long drainTimeoutMs = 10000;
+    HttpServerOptions server;
+    bool automatic = false;
+};
 
-    explicit StringResponse(std::string s) : s(std::move(s)), consumed{false} {}
+#ifdef SHS_ENABLE_ZSTD
 
-    std::pair<const char *, size_t> get() override {
-        if (consumed)return {nullptr, 0};
-        consumed = true;
-        return {s.data(), s.size()};
+// --zstd-level N  --zstd-dict NAME=PATH  --zstd-route PREFIX=NAME
+std::shared_ptr<ZstdEncoder> zstdFromArgs(int argc, char **argv) {
+    int level = 3;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--zstd-level")) level = atoi(argv[i + 1]);
+    }
+    std::shared_ptr<ZstdEncoder> encoder = ZstdEncoder::create(level, 256);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 1; i + 1 < argc; ++i) {
+            std::string arg = argv[i + 1];
+            size_t eq = arg.find('=');
+            if (strcmp(argv[i], pass ? "--zstd-route" : "--zstd-dict") != 0)continue;
+            if (eq == std::string::npos) {
+                panic(std::string("bad argument: ") + argv[i] + " " + arg);
+            }
+            std::string k = arg.substr(0, eq), v = arg.substr(eq + 1);
+            int ec;
+            if (pass == 0 && !encoder->loadDictionary(k, v, ec)) {
+                panic("cannot load zstd dictionary " + v + ": " + strerror(ec));
+            }
+            if (pass == 1 && !encoder->addRoute(k, v)) {
+                panic("unknown zstd dictionary " + v);
+            }
+        }
     }
+    return encoder;
+}
 
-    ssize_t len() override {
-        return (ssize_t) s.size();
+#endif
+
+#ifdef SHS_ENABLE_TLS
+
+// --tls-cert FILE --tls-key FILE, plain HTTP when absent
+std::shared_ptr<TlsContext> tlsFromArgs(int argc, char **argv) {
+    const char *cert = nullptr, *key = nullptr;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--tls-cert")) cert = argv[i + 1];
+        if (!strcmp(argv[i], "--tls-key")) key = argv[i + 1];
+    }
+    if (!cert && !key) return nullptr;
+    if (!cert || !key) {
+        panic("--tls-cert and --tls-key must be given together");
     }
+    std::string err;
+    std::shared_ptr<TlsContext> tls = TlsContext::create(cert, key, err);
+    if (!tls) {
+        panic(err);
+    }
+    return tls;
+}
 
-};
+#endif
 
-struct EchoHandler {
-    Json::Value rd;
-    std::string bs;
-    bool hasBody;
-    base64_state b64s;
-
-    EchoHandler() : rd{}, bs{}, hasBody{}, b64s{} {}
-
-    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
-        if (header) {
-            header->result = HeaderAction::OK;
-            rd = Json::objectValue;
-            rd["method"] = header->method;
-            rd["target"] = header->target;
-            rd["version"] = header->version;
-            rd["header"] = Json::objectValue;
-            for (auto &&[k, v]: header->header) {
-                rd["header"][k] = v;
-                if (k == normalizeFieldName("Expect")) {
-                    Logger::global->log(LOG_ERROR, "expect header is not supported yet");
-                    header->result = HeaderAction::CLOSE;
-                }
-            }
-            hasBody = false;
-            bs = "";
-        } else if (body) {
-            if (!hasBody) {
-                hasBody = true;
-                base64_stream_encode_init(&b64s, 0);
+#ifdef SHS_ENABLE_URING
+
+// --io-uring, falls back to epoll if the kernel cannot run the backend
+std::shared_ptr<UringContext> uringFromArgs(int argc, char **argv, const Tuning &tuning,
+                                            const std::vector<int> &inherited) {
+    bool enabled = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--io-uring")) enabled = true;
+    }
+    if (!enabled) return nullptr;
+    int ec;
+    std::shared_ptr<UringContext> uring = UringContext::create(tuning.threads, tuning.port, tuning.backlog, ec,
+                                                                inherited);
+    if (!uring) {
+        Logger::global->log(LOG_WARN, std::string("io_uring unavailable, using epoll: ") + strerror(ec));
+    }
+    return uring;
+}
+
+// --handoff PATH: hot restart, take the listening sockets of a predecessor offering them at PATH,
+// then offer our own there; simple-net-lib keeps its sockets private, so only with --io-uring
+const char *handoffPathFromArgs(int argc, char **argv) {
+    const char *path = nullptr;
+    bool uring = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--io-uring")) uring = true;
+        if (i + 1 < argc && !strcmp(argv[i], "--handoff")) path = argv[i + 1];
+    }
+    if (path && !uring) {
+        panic("--handoff needs --io-uring");
+    }
+    return path;
+}
+
+#endif
+
+// --echo-format compact|styled|streaming
+EchoFormat echoFormatFromArgs(int argc, char **argv) {
+    EchoFormat format = EchoFormat::COMPACT;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--echo-format") != 0) continue;
+        if (!strcmp(argv[i + 1], "styled")) {
+            format = EchoFormat::STYLED;
+        } else if (!strcmp(argv[i + 1], "streaming")) {
+            format = EchoFormat::STREAMING;
+        } else if (strcmp(argv[i + 1], "compact") != 0) {
+            panic(std::string("bad echo format: ") + argv[i + 1]);
+        }
+    }
+    return format;
+}
+
+// --spool-memory MIB, what the streaming echo keeps of request bodies in memory in total
+std::shared_ptr<SpoolBudget> spoolBudgetFromArgs(int argc, char **argv) {
+    size_t mib = 64;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--spool-memory")) mib = size_t(atol(argv[i + 1]));
+    }
+    return std::make_shared<SpoolBudget>(mib << 20);
+}
+
+// --access-log FILE  --access-log-format json|binary
+std::shared_ptr<AccessLog> accessLogFromArgs(int argc, char **argv) {
+    const char *path = nullptr;
+    AccessLogFormat format = AccessLogFormat::JSON;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--access-log")) path = argv[i + 1];
+        if (!strcmp(argv[i], "--access-log-format")) {
+            if (!strcmp(argv[i + 1], "binary")) {
+                format = AccessLogFormat::BINARY;
+            } else if (strcmp(argv[i + 1], "json") != 0) {
+                panic(std::string("bad access log format: ") + argv[i + 1]);
             }
-            size_t len, old = bs.size();
-            bs.resize(old + (body->length * 4 / 3 + 4));
-            base64_stream_encode(&b64s, body->data, body->length, bs.data() + old, &len);
-            bs.resize(old + len);
+        }
+    }
+    if (!path) return nullptr;
+    int ec;
+    std::shared_ptr<AccessLog> log = AccessLog::create(path, format, ec);
+    if (!log) {
+        panic(std::string("cannot open access log ") + path + ": " + strerror(ec));
+    }
+    return log;
+}
+
+// --balance rr|least|p2c|hash:FIELD  --health-check PATH
+UpstreamGroupOptions upstreamOptionsFromArgs(int argc, char **argv) {
+    UpstreamGroupOptions options;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--health-check")) options.healthPath = argv[i + 1];
+        if (strcmp(argv[i], "--balance") != 0) continue;
+        if (!strcmp(argv[i + 1], "rr")) {
+            options.policy = BalancePolicy::ROUND_ROBIN;
+        } else if (!strcmp(argv[i + 1], "least")) {
+            options.policy = BalancePolicy::LEAST_OUTSTANDING;
+        } else if (!strcmp(argv[i + 1], "p2c")) {
+            options.policy = BalancePolicy::P2C_EWMA;
+        } else if (!strncmp(argv[i + 1], "hash:", 5) && argv[i + 1][5]) {
+            options.policy = BalancePolicy::HEADER_HASH;
+            options.hashHeader = argv[i + 1] + 5;
         } else {
-            if (hasBody) {
-                size_t len, old = bs.size();
-                bs.resize(old + 4);
-                base64_stream_encode_final(&b64s, bs.data() + old, &len);
-                bs.resize(old + len);
-                rd["body"] = bs;
+            panic(std::string("bad balancing policy: ") + argv[i + 1]);
+        }
+    }
+    return options;
+}
+
+// --config FILE: each line "NAME VALUE" (or a bare "NAME" for a switch) stands for --NAME VALUE,
+// lines starting with '#' are comments. The file comes before the command line, so where a flag is
+// read once the command line wins
+std::vector<std::string> argsWithConfig(int argc, char **argv) {
+    std::vector<std::string> args{argv[0]};
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--config") != 0) continue;
+        std::ifstream in(argv[i + 1]);
+        if (!in) {
+            panic(std::string("cannot read config file ") + argv[i + 1]);
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t b = line.find_first_not_of(" \t\r");
+            if (b == std::string::npos || line[b] == '#') continue;
+            size_t e = std::min(line.find_first_of(" \t\r", b), line.size());
+            args.push_back("--" + line.substr(b, e - b));
+            size_t vb = line.find_first_not_of(" \t\r", e);
+            if (vb != std::string::npos) {
+                args.push_back(line.substr(vb, line.find_last_not_of(" \t\r") - vb + 1));
             }
-            resp = std::make_unique<Response>();
-            resp->version = "1.1";
-            resp->status = 200;
-            resp->message = "OK";
-            resp->header.emplace(normalizeFieldName("Server"), "simple-http-server");
-            resp->header.emplace(normalizeFieldName("Content-Type"), "application/json");
-            resp->header.emplace(normalizeFieldName("Cache-Control"), "max-age=0");
-            resp->body = std::make_unique<StringResponse>(rd.toStyledString());
         }
     }
+    args.insert(args.end(), argv + 1, argv + argc);
+    return args;
+}
+
+// --auto-tune (or --threads auto): threads from the core count, backlog from net.core.somaxconn,
+// read buffer and connection limit from memory and RLIMIT_NOFILE
+void autoTune(Tuning &t) {
+    t.automatic = true;
+    t.threads = int(std::max(std::thread::hardware_concurrency(), 1u));
+    std::ifstream somaxconn("/proc/sys/net/core/somaxconn");
+    int backlog;
+    if (somaxconn >> backlog && backlog > 0) t.backlog = backlog;
+    long pages = sysconf(_SC_PHYS_PAGES), pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0) {
+        // at most a thousandth of memory in read buffers, and no connection may need more than 64 KiB of it
+        size_t memory = size_t(pages) * size_t(pageSize);
+        t.server.readBufferSize = std::clamp(memory / 1024 / size_t(t.threads), size_t(256) << 10, size_t(10) << 20);
+        t.server.maxConnections = memory / (64 << 10);
+    }
+    rlimit files{};
+    if (!getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur != RLIM_INFINITY && files.rlim_cur > 128) {
+        size_t fdLimit = files.rlim_cur - 64;  // log files, upstream pools, the handoff socket
+        if (!t.server.maxConnections || fdLimit < t.server.maxConnections) t.server.maxConnections = fdLimit;
+    }
+}
 
-};
+// --port N  --threads N|auto  --events N  --event-queue N  --backlog N  --read-buffer KIB
+// --read-budget KIB  --write-budget KIB  --max-connections N  --drain-timeout MS  --idle-timeout MS  --header-timeout MS  --body-timeout MS
+// --write-timeout MS  --paused-read-ahead KIB  --auto-tune; explicit values override the automatic ones
+Tuning tuningFromArgs(int argc, char **argv) {
+    Tuning t;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--auto-tune") || (i + 1 < argc && !strcmp(argv[i], "--threads") &&
+                                                !strcmp(argv[i + 1], "auto"))) {
+            autoTune(t);
+            break;
+        }
+    }
+    auto positive = [](const char *flag, const char *value) {
+        long n = atol(value);
+        if (n <= 0) {
+            panic(std::string("bad argument: ") + flag + " " + value);
+        }
+        return n;
+    };
+    for (int i = 1; i + 1 < argc; ++i) {
+        const char *v = argv[i + 1];
+        if (!strcmp(argv[i], "--port")) t.port = int(positive(argv[i], v));
+        if (!strcmp(argv[i], "--threads") && strcmp(v, "auto") != 0) t.threads = int(positive(argv[i], v));
+        if (!strcmp(argv[i], "--events")) t.events = int(positive(argv[i], v));
+        if (!strcmp(argv[i], "--event-queue")) t.eventQueue = int(positive(argv[i], v));
+        if (!strcmp(argv[i], "--backlog")) t.backlog = int(positive(argv[i], v));
+        if (!strcmp(argv[i], "--read-buffer")) t.server.readBufferSize = size_t(positive(argv[i], v)) << 10;
+        if (!strcmp(argv[i], "--read-budget")) t.server.readBudget = size_t(atol(v)) << 10;
+        if (!strcmp(argv[i], "--write-budget")) t.server.writeBudget = size_t(atol(v)) << 10;
+        if (!strcmp(argv[i], "--max-connections")) t.server.maxConnections = size_t(atol(v));
+        if (!strcmp(argv[i], "--drain-timeout")) t.drainTimeoutMs = atol(v);
+        if (!strcmp(argv[i], "--idle-timeout")) t.server.idleTimeoutMs = atol(v);
+        if (!strcmp(argv[i], "--header-timeout")) t.server.headerTimeoutMs = atol(v);
+        if (!strcmp(argv[i], "--body-timeout")) t.server.bodyTimeoutMs = atol(v);
+        if (!strcmp(argv[i], "--write-timeout")) t.server.writeTimeoutMs = atol(v);
+        if (!strcmp(argv[i], "--paused-read-ahead")) t.server.pausedReadAhead = size_t(atol(v)) << 10;
+    }
+    return t;
+}
+
+std::string describe(const Tuning &t) {
+    return std::string("tuning") + (t.automatic ? " (auto)" : "") + ": threads=" + std::to_string(t.threads) +
+           " events=" + std::to_string(t.events) + " event-queue=" + std::to_string(t.eventQueue) +
+           " backlog=" + std::to_string(t.backlog) +
+           " read-buffer=" + std::to_string(t.server.readBufferSize >> 10) + "KiB" +
+           " read-budget=" + std::to_string(t.server.readBudget >> 10) + "KiB" +
+           " write-budget=" + std::to_string(t.server.writeBudget >> 10) + "KiB" +
+           " max-connections=" + (t.server.maxConnections ? std::to_string(t.server.maxConnections) : "unlimited") +
+           " drain-timeout=" + std::to_string(t.drainTimeoutMs) + "ms" +
+           " idle-timeout=" + std::to_string(t.server.idleTimeoutMs) + "ms" +
+           " header-timeout=" + std::to_string(t.server.headerTimeoutMs) + "ms" +
+           " body-timeout=" + std::to_string(t.server.bodyTimeoutMs) + "ms" +
+           " write-timeout=" + std::to_string(t.server.writeTimeoutMs) + "ms" +
+           " paused-read-ahead=" + std::to_string(t.server.pausedReadAhead >> 10) + "KiB";
+}
+
+// the signals that start a drain; blocked before any thread exists, so all threads inherit the
+// mask and only sigwait() in main sees them
+sigset_t shutdownSignals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    return set;
+}
+
+int main(int argc, char **argv) {
+    // from here on every flag may also come from a --config file
+    std::vector<std::string> args = argsWithConfig(argc, argv);
+    std::vector<char *> argp;
+    for (auto &&arg: args) argp.push_back(arg.data());
+    argp.push_back(nullptr);
+    argc = int(args.size());
+    argv = argp.data();
 
-int main() {
-    int port = 8080, ec;
+    int ec;
+    Tuning tuning = tuningFromArgs(argc, argv);
+    int port = tuning.port;
     Context::ignorePipeSignal();
-    Context::blockIntSignal();
+    sigset_t signals = shutdownSignals();
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
-    Context ctx(8, 65536, 65536);
-    std::shared_ptr<Listener> listener = ctx.newTcpServer(port, 4096, ec);
-    if (!listener) {
-        panic(strerror(ec));
+    Context ctx(tuning.threads, tuning.events, tuning.eventQueue);
+    std::shared_ptr<Listener> listener;
+#ifdef SHS_ENABLE_URING
+    const char *handoffPath = handoffPathFromArgs(argc, argv);
+    std::shared_ptr<ListenerTakeover> takeover;
+    if (handoffPath && (takeover = ListenerTakeover::connect(handoffPath, ec))) {
+        Logger::global->log(LOG_INFO, "handoff: took " + std::to_string(takeover->fds().size()) +
+                                      " listening sockets from the running server");
+    }
+    std::shared_ptr<UringContext> uring = uringFromArgs(argc, argv, tuning,
+                                                        takeover ? takeover->fds() : std::vector<int>{});
+    if (!uring)
+#endif
+    {
+        listener = ctx.newTcpServer(port, tuning.backlog, ec);
+        if (!listener) {
+            panic(strerror(ec));
+        }
     }
     std::shared_ptr<HttpServer> httpServer = HttpServer::create(std::move(listener));
-    httpServer->enableHandler([]() { return EchoHandler(); });
+    httpServer->setOptions(tuning.server);
+#ifdef SHS_ENABLE_TLS
+    if (std::shared_ptr<TlsContext> tls = tlsFromArgs(argc, argv)) {
+        httpServer->setTransport(tls->factory());
+    }
+#endif
+    NewClientHandler newClientHandler = [format = echoFormatFromArgs(argc, argv),
+                                         budget = spoolBudgetFromArgs(argc, argv)]() {
+        return EchoHandler(format, budget);
+    };
+#ifdef SHS_ENABLE_ZSTD
+    newClientHandler = zstdFromArgs(argc, argv)->wrap(std::move(newClientHandler));
+#endif
+    // --static PREFIX=DIR, outside compression so ranges stay byte ranges of the file
+    long maxAge = 0;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--static-max-age")) maxAge = atol(argv[i + 1]);
+    }
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--static") != 0) continue;
+        const char *eq = strchr(argv[i + 1], '=');
+        if (!eq || eq == argv[i + 1]) {
+            panic(std::string("bad static mapping: ") + argv[i + 1]);
+        }
+        newClientHandler = staticFiles(std::move(newClientHandler), std::string(argv[i + 1], eq - argv[i + 1]), eq + 1,
+                                       maxAge);
+    }
+    // --proxy PREFIX=HOST:PORT[,HOST:PORT...]
+    UpstreamGroupOptions upstreamOptions = upstreamOptionsFromArgs(argc, argv);
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--proxy") != 0) continue;
+        const char *eq = strchr(argv[i + 1], '=');
+        if (!eq) {
+            panic(std::string("bad proxy mapping: ") + argv[i + 1]);
+        }
+        std::vector<std::pair<std::string, int>> upstreams;
+        for (const char *p = eq + 1; *p;) {
+            const char *end = strchr(p, ','), *colon;
+            if (!end) end = p + strlen(p);
+            for (colon = end; colon > p && *colon != ':'; --colon) {}
+            if (colon == p) {
+                panic(std::string("bad proxy mapping: ") + argv[i + 1]);
+            }
+            upstreams.emplace_back(std::string(p, colon - p), atoi(colon + 1));
+            p = *end ? end + 1 : end;
+        }
+        newClientHandler = proxyPass(std::move(newClientHandler), std::string(argv[i + 1], eq - argv[i + 1]),
+                                     UpstreamGroup::create(ctx, std::move(upstreams), upstreamOptions));
+    }
+    // --cache MIB
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "--cache")) {
+            httpServer->setCache(ResponseCache::create(size_t(atol(argv[i + 1])) << 20));
+        }
+    }
+    std::shared_ptr<AccessLog> accessLog = accessLogFromArgs(argc, argv);
+    if (accessLog) {
+        httpServer->setAccessLog(accessLog);
+    }
+    // --metrics, outermost so the exposition is never compressed
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--metrics")) {
+            newClientHandler = metricsEndpoint(std::move(newClientHandler));
+        }
+    }
+    httpServer->enableHandler(std::move(newClientHandler));
+#ifdef SHS_ENABLE_URING
+    std::shared_ptr<ListenerHandoff> handoff;
+    if (uring) {
+        uring->start([httpServer](std::shared_ptr<Transport> conn) {
+            httpServer->serve(std::move(conn));
+        });
+        if (takeover) {
+            takeover->accepting();
+            takeover.reset();
+        }
+        if (handoffPath) {
+            // a successor holding the sockets ends this process the same way SIGTERM does
+            handoff = ListenerHandoff::offer(handoffPath, uring->listeners(), []() {
+                kill(getpid(), SIGTERM);
+            }, ec);
+            if (!handoff) {
+                panic(std::string("cannot offer listening sockets at ") + handoffPath + ": " + strerror(ec));
+            }
+        }
+    }
+#endif
 
+    Logger::global->log(LOG_INFO, describe(tuning));
     Logger::global->log(LOG_INFO, std::string("HTTP server serving on port ") + std::to_string(port));
-    Context::waitUntilInterrupt();
-    Logger::global->log(LOG_INFO, "caught SIGINT, exiting...");
-    httpServer->stop();
+    int sig;
+    sigwait(&signals, &sig);
+    Logger::global->log(LOG_INFO, std::string("caught ") + strsignal(sig) + ", draining connections...");
+#ifdef SHS_ENABLE_URING
+    handoff.reset();
+    if (uring) uring->stopAccepting();
+#endif
+    if (size_t open = httpServer->drain(std::chrono::milliseconds(tuning.drainTimeoutMs))) {
+        Logger::global->log(LOG_WARN, std::to_string(open) + " connections still open after the drain timeout");
+    }
+#ifdef SHS_ENABLE_URING
+    if (uring) uring->stop();
+#endif
+    if (accessLog) accessLog->close();
 
     return 0;
 }
@@ -0,0 +1,205 @@
+#include "metrics.hpp"
+#include "llhttp.h"
+#include <mutex>
+#include <memory>
+#include <cmath>
+#include <cstdio>
+
+namespace SHS1 {
+
+namespace {
+
+std::mutex shardsLock;
+std::vector<std::unique_ptr<MetricsShard>> shards;
+
+constexpr const char *STAGE_NAMES[LATENCY_STAGES][2] = {
+        {"shs_accept_to_first_byte_seconds", "Connection accepted until the first response byte is written."},
+        {"shs_header_parse_seconds",         "First request byte until the header block is parsed."},
+        {"shs_handler_seconds",              "Time spent in the request handler."},
+        {"shs_write_drain_seconds",          "Response queued until its last byte is written."},
+        {"shs_request_duration_seconds",     "First request byte until the last response byte is written."},
+        {"shs_loop_lag_seconds",             "A connection woken from another thread until its event loop runs it."},
+};
+
+constexpr const char *TIMEOUT_NAMES[TIMEOUT_KINDS] = {"idle", "header", "body", "write"};
+
+constexpr double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+void header(std::string &out, const char *name, const char *type, const char *help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void sample(std::string &out, const char *name, const std::string &labels, double v) {
+    char buf[32] = "NaN";
+    if (!std::isnan(v)) snprintf(buf, sizeof(buf), "%.9g", v);
+    out.append(name).append(labels).append(" ").append(buf).append("\n");
+}
+
+class MetricsHandler final {
+public:
+    MetricsHandler(std::string path, RequestHandler inner) :
+            path_(std::move(path)), inner_(std::move(inner)), active_(false) {}
+
+    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+        if (header) {
+            active_ = header->target == path_ && (header->method == "GET" || header->method == "HEAD");
+        }
+        if (!active_) {
+            inner_(header, body, resp);
+            return;
+        }
+        if (!header && !body) {
+            resp = std::make_unique<Response>();
+            resp->version = "1.1";
+            resp->status = 200;
+            resp->message = "OK";
+            resp->header.emplace(normalizeFieldName("Content-Type"), "text/plain; version=0.0.4");
+            resp->header.emplace(normalizeFieldName("Cache-Control"), "no-store");
+            resp->body = std::make_unique<StringResponse>(renderMetrics());
+        }
+    }
+
+private:
+    std::string path_;
+    RequestHandler inner_;
+    bool active_;
+};
+
+}
+
+LatencyHistogram::LatencyHistogram() : counts_{}, sum_(0) {}
+
+void LatencyHistogram::record(uint64_t ns) {
+    bump(counts_[bucketOf(ns)], uint64_t(1));
+    bump(sum_, ns);
+}
+
+void LatencyHistogram::addTo(std::vector<uint64_t> &counts, uint64_t &sum) const {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        counts[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+    sum += sum_.load(std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t ns) {
+    ns = std::min(ns, (uint64_t(2) << MAX_EXP) - 1);
+    if (ns < (uint64_t(1) << SUB_BITS)) return ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (size_t(e - SUB_BITS + 1) << SUB_BITS) + (ns >> (e - SUB_BITS)) - (size_t(1) << SUB_BITS);
+}
+
+uint64_t LatencyHistogram::bucketEnd(size_t i) {
+    size_t b = i >> SUB_BITS, sub = i & ((size_t(1) << SUB_BITS) - 1);
+    if (b == 0) return sub + 1;
+    return ((uint64_t(1) << SUB_BITS) + sub + 1) << (b - 1);
+}
+
+void MetricsShard::httpError(int err) {
+    bump(httpErrors[std::min(err, HTTP_ERRNO_SLOTS - 1)], uint64_t(1));
+}
+
+MetricsShard &MetricsShard::local() {
+    thread_local MetricsShard *shard = [] {
+        std::lock_guard guard(shardsLock);
+        shards.push_back(std::make_unique<MetricsShard>());
+        return shards.back().get();
+    }();
+    return *shard;
+}
+
+std::string renderMetrics() {
+    uint64_t requests = 0, bytesIn = 0, bytesOut = 0;
+    int64_t connections = 0;
+    uint64_t cacheHits = 0, cacheMisses = 0;
+    int64_t cacheBytes = 0, cacheEntries = 0;
+    uint64_t errors[HTTP_ERRNO_SLOTS] = {};
+    uint64_t timeouts[TIMEOUT_KINDS] = {};
+    std::vector<std::vector<uint64_t>> counts(LATENCY_STAGES, std::vector<uint64_t>(LatencyHistogram::BUCKETS));
+    uint64_t sums[LATENCY_STAGES] = {};
+    {
+        // only registration contends for this lock, the shards are read while their loops keep writing
+        std::lock_guard guard(shardsLock);
+        for (auto &&s: shards) {
+            requests += s->requests.load(std::memory_order_relaxed);
+            bytesIn += s->bytesIn.load(std::memory_order_relaxed);
+            bytesOut += s->bytesOut.load(std::memory_order_relaxed);
+            connections += s->connections.load(std::memory_order_relaxed);
+            cacheHits += s->cacheHits.load(std::memory_order_relaxed);
+            cacheMisses += s->cacheMisses.load(std::memory_order_relaxed);
+            cacheBytes += s->cacheBytes.load(std::memory_order_relaxed);
+            cacheEntries += s->cacheEntries.load(std::memory_order_relaxed);
+            for (int i = 0; i < HTTP_ERRNO_SLOTS; ++i) {
+                errors[i] += s->httpErrors[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < TIMEOUT_KINDS; ++i) {
+                timeouts[i] += s->timeouts[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < LATENCY_STAGES; ++i) {
+                s->latency[i].addTo(counts[i], sums[i]);
+            }
+        }
+    }
+
+    std::string out;
+    header(out, "shs_requests_total", "counter", "Responses completely written.");
+    sample(out, "shs_requests_total", "", double(requests));
+    header(out, "shs_received_bytes_total", "counter", "Bytes read at the HTTP layer.");
+    sample(out, "shs_received_bytes_total", "", double(bytesIn));
+    header(out, "shs_sent_bytes_total", "counter", "Bytes written at the HTTP layer.");
+    sample(out, "shs_sent_bytes_total", "", double(bytesOut));
+    header(out, "shs_connections", "gauge", "Open HTTP connections.");
+    sample(out, "shs_connections", "", double(connections));
+    header(out, "shs_cache_hits_total", "counter", "Requests answered from the response cache.");
+    sample(out, "shs_cache_hits_total", "", double(cacheHits));
+    header(out, "shs_cache_misses_total", "counter", "Cacheable requests passed to the handler.");
+    sample(out, "shs_cache_misses_total", "", double(cacheMisses));
+    header(out, "shs_cache_bytes", "gauge", "Memory held by the response cache.");
+    sample(out, "shs_cache_bytes", "", double(cacheBytes));
+    header(out, "shs_cache_entries", "gauge", "Responses in the response cache.");
+    sample(out, "shs_cache_entries", "", double(cacheEntries));
+    header(out, "shs_http_errors_total", "counter", "HTTP/1.x parse errors by llhttp errno.");
+    for (int i = 0; i < HTTP_ERRNO_SLOTS; ++i) {
+        if (errors[i]) {
+            sample(out, "shs_http_errors_total",
+                   std::string("{errno=\"") + llhttp_errno_name(llhttp_errno_t(i)) + "\"}", double(errors[i]));
+        }
+    }
+    header(out, "shs_timeouts_total", "counter", "HTTP/1.x connections closed at a deadline.");
+    for (int i = 0; i < TIMEOUT_KINDS; ++i) {
+        sample(out, "shs_timeouts_total", std::string("{kind=\"") + TIMEOUT_NAMES[i] + "\"}", double(timeouts[i]));
+    }
+
+    for (int i = 0; i < LATENCY_STAGES; ++i) {
+        const char *name = STAGE_NAMES[i][0];
+        header(out, name, "summary", STAGE_NAMES[i][1]);
+        uint64_t total = 0;
+        for (uint64_t c: counts[i]) total += c;
+        for (double q: QUANTILES) {
+            // highest value equivalent to the bucket holding the q-th sample
+            auto rank = uint64_t(std::ceil(q * double(total)));
+            uint64_t seen = 0;
+            double v = NAN;
+            for (size_t b = 0; b < LatencyHistogram::BUCKETS && total; ++b) {
+                if ((seen += counts[i][b]) >= rank) {
+                    v = double(LatencyHistogram::bucketEnd(b) - 1) / 1e9;
+                    break;
+                }
+            }
+            char label[32];
+            snprintf(label, sizeof(label), "{quantile=\"%g\"}", q);
+            sample(out, name, label, v);
+        }
+        sample(out, (std::string(name) + "_sum").c_str(), "", double(sums[i]) / 1e9);
+        sample(out, (std::string(name) + "_count").c_str(), "", double(total));
+    }
+    return out;
+}
+
+NewClientHandler metricsEndpoint(NewClientHandler h, const std::string &path) {
+    return [path, h = std::move(h)]() {
+        return RequestHandler(MetricsHandler(path, h()));
+    };
+}
+
+}
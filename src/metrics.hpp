@@ -0,0 +1,101 @@
+#ifndef SIMPLE_HTTP_SERVER_METRICS_HPP
+#define SIMPLE_HTTP_SERVER_METRICS_HPP
+
+#include "http_server.hpp"
+#include<atomic>
+#include<chrono>
+#include<string>
+#include<vector>
+#include<cstdint>
+
+namespace SHS1 {
+
+using MetricsClock = std::chrono::steady_clock;
+
+inline uint64_t elapsedNs(MetricsClock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(MetricsClock::now() - since).count();
+}
+
+enum class LatencyStage {
+    ACCEPT_TO_FIRST_BYTE,   // connection accepted until the first response byte is written
+    HEADER_PARSE,           // first request byte until the header block is parsed
+    HANDLER,                // time spent in the request handler, summed over its calls
+    WRITE_DRAIN,            // response queued until its last byte is written
+    TOTAL,                  // first request byte until the last response byte is written
+    LOOP_LAG                // a connection woken from another thread until its loop runs it
+};
+
+constexpr int LATENCY_STAGES = 6;
+
+// deadlines an HTTP/1.x connection is closed at, see HttpServerOptions
+enum class TimeoutKind {
+    IDLE,    // keep-alive connection waiting for its next request
+    HEADER,  // request header block not complete
+    BODY,    // request body stalled
+    WRITE    // response stalled on a client not reading
+};
+
+constexpr int TIMEOUT_KINDS = 4;
+constexpr int HTTP_ERRNO_SLOTS = 64;
+
+// every counter has a single writer, the thread owning it, so a relaxed load and store is enough
+// and the hot path never issues a locked instruction; readers may see a slightly stale value
+template<typename T>
+inline void bump(std::atomic<T> &c, T n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// HDR-style log-linear histogram of nanoseconds: every power of two is split into
+// 2^SUB_BITS linear buckets, so any recorded value is off by less than 1/2^SUB_BITS
+class LatencyHistogram final : private DisableCopy {
+public:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int MAX_EXP = 40;  // values from 2^41 ns (about 36 minutes) are clamped
+    static constexpr size_t BUCKETS = size_t(MAX_EXP - SUB_BITS + 2) << SUB_BITS;
+
+    LatencyHistogram();
+
+    // owner thread only
+    void record(uint64_t ns);
+
+    // any thread
+    void addTo(std::vector<uint64_t> &counts, uint64_t &sum) const;
+
+    static size_t bucketOf(uint64_t ns);
+
+    // smallest value that no longer falls into bucket i
+    static uint64_t bucketEnd(size_t i);
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS];
+    std::atomic<uint64_t> sum_;
+};
+
+// counters of one thread (event loop), created on first use and kept for the life of the process
+struct MetricsShard final : private DisableCopy {
+    LatencyHistogram latency[LATENCY_STAGES];
+    std::atomic<uint64_t> requests{0}, bytesIn{0}, bytesOut{0};
+    std::atomic<int64_t> connections{0};  // per shard it may go negative, the sum is exact
+    std::atomic<uint64_t> cacheHits{0}, cacheMisses{0};
+    std::atomic<int64_t> cacheBytes{0}, cacheEntries{0};  // like connections
+    std::atomic<uint64_t> httpErrors[HTTP_ERRNO_SLOTS]{};
+    std::atomic<uint64_t> timeouts[TIMEOUT_KINDS]{};
+
+    void record(LatencyStage stage, uint64_t ns) {
+        latency[int(stage)].record(ns);
+    }
+
+    void httpError(int err);
+
+    static MetricsShard &local();
+};
+
+// every shard merged, in Prometheus text exposition format (version 0.0.4)
+std::string renderMetrics();
+
+// answers GET path with renderMetrics(), every other request goes to the handlers created by h
+NewClientHandler metricsEndpoint(NewClientHandler h, const std::string &path = "/metrics");
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_METRICS_HPP
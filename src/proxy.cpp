@@ -0,0 +1,883 @@
+#include "proxy.hpp"
+#include "transport.hpp"
+#include "tcp_socket.hpp"
+#include "llhttp.h"
+#include "logger.hpp"
+#ifdef SHS_ENABLE_URING
+#include "uring_backend.hpp"
+#endif
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr size_t UPSTREAM_READ_SIZE = 64 * 1024;
+constexpr size_t UPSTREAM_HIGH_WATER = 256 * 1024;  // buffered response bytes that pause reading upstream
+// unsent request body bytes that pause the downstream body, and the level it resumes at
+constexpr size_t REQUEST_HIGH_WATER = 256 * 1024;
+constexpr size_t REQUEST_LOW_WATER = 64 * 1024;
+constexpr size_t MAX_IDLE = 64;                      // idle connections kept per upstream and thread
+constexpr int64_t MERGE_INTERVAL_NS = 5000000;       // how stale another thread's counters may get
+constexpr int64_t EWMA_HALF_LIFE_NS = 1000000000;    // an upstream not answering lately looks faster
+constexpr int RING_POINTS = 160;                     // consistent hash points per upstream
+
+std::atomic<uint64_t> nextGroupId{0};
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(MetricsClock::now().time_since_epoch()).count();
+}
+
+// FNV-1a with a final mix, so neighbouring keys land far apart on the ring
+uint64_t hashOf(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c: s) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+}
+
+thread_local std::vector<char> upstreamBuffer(UPSTREAM_READ_SIZE);
+
+// fields that only describe one connection, plus the framing we set ourselves and Expect,
+// which the server answers before the body is forwarded
+bool hopByHop(const std::string &name, const std::string *connection) {
+    static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+                                        "Transfer-Encoding", "Upgrade", "Content-Length", "Expect"};
+    for (const char *n: names) {
+        if (!strcasecmp(name.c_str(), n)) return true;
+    }
+    return connection && hasToken(*connection, name.c_str());
+}
+
+const std::string *find(const std::unordered_map<std::string, std::string> &m, const char *name) {
+    auto it = m.find(normalizeFieldName(name));
+    return it == m.end() ? nullptr : &it->second;
+}
+
+enum class Progress {
+    DATA, WAIT, END, FAILED
+};
+
+// one keep-alive connection to an upstream server, carrying one exchange at a time; its events run
+// on whatever loop SNL1 assigned, so the exchange state is shared with the downstream side under lock_
+class UpstreamConnection final : private DisableCopy,
+                                 public std::enable_shared_from_this<UpstreamConnection> {
+public:
+    explicit UpstreamConnection(std::shared_ptr<Transport> conn) :
+            conn_(std::move(conn)), parser_{}, settings_{}, dead_(false), body_(nullptr),
+            busy_(false), headOnly_(false), headDone_(false), complete_(false), failed_(false),
+            keepalive_(false), valueLast_(false), received_(false), status_(0), exchanges_(0), raw_(0), outPos_(0) {
+        settings_.on_status = onStatus;
+        settings_.on_header_field = onHeaderField;
+        settings_.on_header_value = onHeaderValue;
+        settings_.on_headers_complete = onHeadersComplete;
+        settings_.on_body = onBody;
+        settings_.on_message_complete = onMessageComplete;
+        llhttp_init(&parser_, HTTP_RESPONSE, &settings_);
+        parser_.data = this;
+    }
+
+    static std::shared_ptr<UpstreamConnection> connect(Context &ctx, const std::string &host, int port, int &ec) {
+        std::shared_ptr<Transport> t;
+#ifdef SHS_ENABLE_URING
+        // on an io_uring loop thread the upstream joins that loop, so bodies can be spliced
+        t = uringConnect(host, port, ec);
+        if (!t && ec) return nullptr;
+#endif
+        if (!t) {
+            std::shared_ptr<Connection> c = ctx.newTcpClient(host, port, ec);
+            if (!c) return nullptr;
+            t = plainTransport(std::move(c));
+        }
+        auto up = std::make_shared<UpstreamConnection>(std::move(t));
+        up->conn_->enableHandler([up](EventType e) {
+            up->handler_(e);
+        }, true, false);
+        return up;
+    }
+
+    // downstream side: start an exchange; wake() is called under lock_ throughout, so it is
+    // ordered against the loop updating write interest from the state it saw
+    void begin(std::string request, bool headOnly) {
+        std::lock_guard guard(lock_);
+        busy_ = true;
+        headOnly_ = headOnly;
+        headDone_ = complete_ = received_ = false;
+        ++exchanges_;
+        raw_ = 0;
+        llhttp_init(&parser_, HTTP_RESPONSE, &settings_);  // a raw body left it mid-message
+        parser_.data = this;
+        failed_ = dead_;  // e.g. a refused connect handled before the exchange began
+        status_ = 0;
+        reason_.clear();
+        header_.clear();
+        in_.clear();
+        out_ = std::move(request);
+        outPos_ = 0;
+        conn_->wake();
+    }
+
+    // more request bytes, framed as one chunk when chunk is set; copied once, straight into out_.
+    // A slow upstream pauses flow, the downstream body, until most of out_ is written
+    void send(const char *data, size_t len, bool chunk, const std::shared_ptr<BodyFlow> &flow) {
+        std::lock_guard guard(lock_);
+        if (failed_) return;
+        if (chunk) {
+            char size[24];
+            out_.append(size, snprintf(size, sizeof(size), "%zx\r\n", len));
+        }
+        out_.append(data, len);
+        if (chunk) out_.append("\r\n");
+        if (flow && out_.size() - outPos_ >= REQUEST_HIGH_WATER) {
+            flow_ = flow;
+            flow->pause();
+        }
+        conn_->wake();
+    }
+
+    // progress of the exchange is reported to body from now on
+    void attach(AsyncResponseBody *body) {
+        std::lock_guard guard(lock_);
+        body_ = body;
+    }
+
+    // status and header fields once the upstream sent them, len as ResponseBody::len()
+    Progress head(Response &resp, ssize_t &len) {
+        std::lock_guard guard(lock_);
+        if (!headDone_) return failed_ ? Progress::FAILED : Progress::WAIT;
+        resp.status = status_;
+        resp.message = reason_;
+        resp.header.clear();
+        const std::string *connection = find(header_, "Connection");
+        for (auto &&[k, v]: header_) {
+            if (!hopByHop(k, connection)) resp.header.emplace(k, v);
+        }
+        const std::string *cl = find(header_, "Content-Length");
+        if (status_ == 204 || status_ == 304) {
+            len = 0;
+        } else if (cl) {
+            len = ssize_t(strtoull(cl->c_str(), nullptr, 10));
+        } else {
+            len = headOnly_ ? 0 : ResponseBody::CHUNKED;
+        }
+        return Progress::DATA;
+    }
+
+    // body bytes received so far, swapped into out
+    Progress take(std::string &out) {
+        std::lock_guard guard(lock_);
+        if (in_.empty()) return complete_ ? Progress::END : failed_ ? Progress::FAILED : Progress::WAIT;
+        bool resume = in_.size() >= UPSTREAM_HIGH_WATER;
+        out.swap(in_);
+        in_.clear();
+        if (resume) conn_->wake();
+        return Progress::DATA;
+    }
+
+    // downstream side: the rest of a Content-Length body moves from the upstream socket to dst
+    // without a copy when both allow it (Transport::hSplice); what was read already goes first
+    size_t spliceTo(Transport &dst) {
+        std::lock_guard guard(lock_);
+        if (!raw_ || !in_.empty() || failed_ || dead_) return 0;
+        size_t n = dst.hSplice(*conn_, raw_);
+        if (n) {
+            raw_ = 0;
+            complete_ = true;
+            keepalive_ = llhttp_should_keep_alive(&parser_);
+        }
+        return n;
+    }
+
+    // downstream is done with the exchange; true when the connection may serve another one
+    bool release(bool keep) {
+        std::lock_guard guard(lock_);
+        body_ = nullptr;
+        busy_ = false;
+        bool reusable = keep && complete_ && keepalive_ && !failed_ && !dead_ && outPos_ == out_.size();
+        resumeBody_();
+        if (!reusable) {
+            dead_ = true;
+            conn_->wake();  // its loop closes it
+        }
+        return reusable;
+    }
+
+    bool dead() const {
+        return dead_;
+    }
+
+    // the exchange failed before the upstream sent a byte of it, on a connection that served one
+    // before: most likely the upstream closed it while idle, so the request never reached it
+    bool stale() {
+        std::lock_guard guard(lock_);
+        return failed_ && !received_ && exchanges_ > 1;
+    }
+
+private:
+    std::shared_ptr<Transport> conn_;
+    llhttp_t parser_;
+    llhttp_settings_t settings_;
+    std::mutex lock_;
+    std::atomic<bool> dead_;
+    AsyncResponseBody *body_;
+    bool busy_, headOnly_, headDone_, complete_, failed_, keepalive_, valueLast_;
+    bool received_;  // the upstream sent bytes of the current exchange
+    int status_;
+    uint64_t exchanges_;
+    uint64_t raw_;  // bytes left of a Content-Length body read past the parser
+    std::string reason_, field_, value_;
+    std::unordered_map<std::string, std::string> header_;
+    std::string in_, out_;
+    size_t outPos_;  // written part of out_
+    std::shared_ptr<BodyFlow> flow_;  // the downstream body paused on out_
+
+    void handler_(EventType e) {
+        std::lock_guard guard(lock_);
+        int ec;
+        size_t n;
+        if (!dead_ && (e & EVENT_OUT) && outPos_ < out_.size()) {
+            n = conn_->hWrite(out_.data() + outPos_, out_.size() - outPos_, ec);
+            if (n > 0) {
+                outPos_ += n;
+                if (outPos_ == out_.size()) {
+                    out_.clear();
+                    outPos_ = 0;
+                }
+                if (out_.size() - outPos_ <= REQUEST_LOW_WATER) resumeBody_();
+            } else if (ec) {
+                fail_(strerror(ec));
+            }
+        }
+        if (!dead_ && (e & EVENT_IN) && in_.size() < UPSTREAM_HIGH_WATER) {
+            do {
+                if (raw_) {
+                    // straight into the buffer the downstream side takes over, no parser pass
+                    size_t old = in_.size(), want = std::min<uint64_t>(raw_, UPSTREAM_READ_SIZE);
+                    in_.resize(old + want);
+                    n = conn_->hRead(in_.data() + old, want, ec);
+                    in_.resize(old + n);
+                    if (n > 0) {
+                        rawBody_(old, n);
+                    } else if (ec) {
+                        fail_(strerror(ec));
+                    }
+                    continue;
+                }
+                n = conn_->hRead(upstreamBuffer.data(), upstreamBuffer.size(), ec);
+                if (n > 0) {
+                    if (!busy_ || complete_) {
+                        fail_("unexpected data");
+                        break;
+                    }
+                    received_ = true;
+                    llhttp_errno_t err = llhttp_execute(&parser_, upstreamBuffer.data(), n);
+                    if (err == HPE_PAUSED && raw_) {
+                        // the header ended inside this read, the rest belongs to the raw body
+                        size_t used = llhttp_get_error_pos(&parser_) - upstreamBuffer.data(), rest = n - used;
+                        if (rest > raw_) {
+                            fail_("unexpected data");
+                            break;
+                        }
+                        in_.append(upstreamBuffer.data() + used, rest);
+                        if (rest) rawBody_(in_.size() - rest, rest);
+                    } else if (err != HPE_OK) {
+                        fail_(std::string("http err: ") + llhttp_errno_name(err));
+                        break;
+                    }
+                } else if (ec) {
+                    fail_(strerror(ec));
+                }
+            } while (n > 0 && in_.size() < UPSTREAM_HIGH_WATER);
+            if (!dead_ && conn_->hIsReadClosed()) {
+                // completes a body delimited by the connection, anything else is lost
+                if (busy_ && headDone_ && !complete_ && !raw_) llhttp_finish(&parser_);
+                fail_("upstream closed the connection");
+            }
+        }
+        if (dead_) {
+            conn_->hShutdown(true, true);
+            return;
+        }
+        conn_->hSetWrite(outPos_ < out_.size());
+        conn_->hSetRead(in_.size() < UPSTREAM_HIGH_WATER);
+    }
+
+    // n body bytes were appended to in_ at offset old
+    void rawBody_(size_t old, size_t n) {
+        raw_ -= n;
+        if (!raw_) {
+            complete_ = true;
+            keepalive_ = llhttp_should_keep_alive(&parser_);
+        }
+        // the consumer only waits after finding in_ empty
+        if ((!old || complete_) && body_) body_->notify();
+    }
+
+    void resumeBody_() {
+        if (flow_) {
+            flow_->resume();
+            flow_.reset();
+        }
+    }
+
+    // the connection is done; an exchange still in progress fails
+    void fail_(const std::string &why) {
+        resumeBody_();  // send() drops the rest
+        if (busy_ && !complete_ && !failed_) {
+            failed_ = true;
+            Logger::global->log(LOG_WARN, "upstream: " + why);
+            if (body_) body_->notify();
+        }
+        dead_ = true;
+    }
+
+    void commitField_() {
+        if (!field_.empty()) {
+            auto [it, succ] = header_.emplace(normalizeFieldName(field_), value_);
+            if (!succ) it->second.append(", ").append(value_);
+        }
+        field_.clear();
+        value_.clear();
+    }
+
+    static int onStatus(llhttp_t *parser, const char *at, size_t length) {
+        auto o = (UpstreamConnection *) parser->data;
+        o->reason_.append(at, length);
+        return 0;
+    }
+
+    // llhttp may deliver a field or value in pieces across reads
+    static int onHeaderField(llhttp_t *parser, const char *at, size_t length) {
+        auto o = (UpstreamConnection *) parser->data;
+        if (o->valueLast_) o->commitField_();
+        o->valueLast_ = false;
+        o->field_.append(at, length);
+        return 0;
+    }
+
+    static int onHeaderValue(llhttp_t *parser, const char *at, size_t length) {
+        auto o = (UpstreamConnection *) parser->data;
+        o->valueLast_ = true;
+        o->value_.append(at, length);
+        return 0;
+    }
+
+    static int onHeadersComplete(llhttp_t *parser) {
+        auto o = (UpstreamConnection *) parser->data;
+        o->commitField_();
+        o->valueLast_ = false;
+        o->status_ = parser->status_code;
+        if (o->status_ / 100 == 1) {  // interim response, the real one follows
+            o->reason_.clear();
+            o->header_.clear();
+            return 0;
+        }
+        o->headDone_ = true;
+        if (o->body_) o->body_->notify();
+        if (o->headOnly_) return 1;
+        // a body of known length is read past the parser, see handler_
+        if (parser->content_length > 0 && o->status_ != 204 && o->status_ != 304 &&
+            find(o->header_, "Content-Length") && !find(o->header_, "Transfer-Encoding")) {
+            o->raw_ = parser->content_length;
+            return HPE_PAUSED;
+        }
+        return 0;
+    }
+
+    static int onBody(llhttp_t *parser, const char *at, size_t length) {
+        auto o = (UpstreamConnection *) parser->data;
+        // the consumer only waits after finding in_ empty
+        bool wake = o->in_.empty();
+        o->in_.append(at, length);
+        if (wake && o->body_) o->body_->notify();
+        return 0;
+    }
+
+    static int onMessageComplete(llhttp_t *parser) {
+        auto o = (UpstreamConnection *) parser->data;
+        if (!o->headDone_) return 0;
+        o->complete_ = true;
+        o->keepalive_ = llhttp_should_keep_alive(parser);
+        if (o->body_) o->body_->notify();
+        return 0;
+    }
+};
+
+// idle upstream connections of this thread, by host:port
+std::vector<std::shared_ptr<UpstreamConnection>> &idlePool(const std::string &key) {
+    thread_local std::unordered_map<std::string, std::vector<std::shared_ptr<UpstreamConnection>>> pools;
+    return pools[key];
+}
+
+// an upstream connection taken for one exchange, given back when the exchange ends
+struct UpstreamLease {
+    std::shared_ptr<UpstreamConnection> up;
+    std::shared_ptr<UpstreamGroup> group;
+    size_t index = 0;
+    MetricsClock::time_point started;
+    bool reported = false;
+    std::string request;  // kept for retry() when the request may be sent again
+    bool headOnly = false;
+
+    // the exchange got its answer, or ok is false because it never will
+    void responded(bool ok) {
+        if (reported) return;
+        reported = true;
+        group->responded(index, ok, elapsedNs(started));
+    }
+
+    // a stale pooled connection (UpstreamConnection::stale) gets the request once more, on a new
+    // connection, and the failure is not held against the upstream
+    bool retry() {
+        if (request.empty() || !up || !up->stale()) return false;
+        int ec;
+        auto fresh = UpstreamConnection::connect(group->context(), group->host(index), group->port(index), ec);
+        if (!fresh) {
+            Logger::global->log(LOG_WARN, "upstream " + group->key(index) + ": " + strerror(ec));
+            return false;
+        }
+        up->release(false);
+        up = std::move(fresh);
+        up->begin(std::move(request), headOnly);
+        request.clear();
+        return true;
+    }
+
+    ~UpstreamLease() {
+        if (!group) return;
+        group->finished(index);
+        if (!up) return;
+        auto &idle = idlePool(group->key(index));
+        if (up->release(idle.size() < MAX_IDLE)) idle.push_back(std::move(up));
+    }
+};
+
+// response relayed from an upstream, or 502 when it could not be reached
+class ProxyBody final : public AsyncResponseBody {
+public:
+    explicit ProxyBody(std::shared_ptr<UpstreamLease> lease) :
+            lease_(std::move(lease)), up_(lease_->up.get()), len_(0), error_(false), aborted_(false), sent_(false) {
+        if (up_) up_->attach(this);
+    }
+
+
+    bool headReady(Response &resp) override {
+        Progress p = up_ ? up_->head(resp, len_) : Progress::FAILED;
+        if (p == Progress::FAILED && lease_->retry()) {
+            up_ = lease_->up.get();
+            up_->attach(this);
+            p = up_->head(resp, len_);  // a failure before attach() notified nobody
+        }
+        if (p == Progress::WAIT) return false;
+        lease_->responded(p == Progress::DATA && (resp.status < 502 || resp.status > 504));
+        if (p == Progress::FAILED) {
+            error_ = true;
+            resp.status = 502;
+            resp.message = "Bad Gateway";
+            resp.header.clear();
+            resp.header.emplace(normalizeFieldName("Content-Type"), "text/plain");
+            chunk_ = "bad gateway\n";
+            len_ = ssize_t(chunk_.size());
+        }
+        return true;
+    }
+
+    std::pair<const char *, size_t> get() override {
+        if (error_) {
+            if (sent_) return {nullptr, 0};
+            sent_ = true;
+            return {chunk_.data(), chunk_.size()};
+        }
+        switch (up_->take(chunk_)) {
+            case Progress::DATA:
+                return {chunk_.data(), chunk_.size()};
+            case Progress::WAIT:
+                return {"", 0};
+            case Progress::FAILED:
+                aborted_ = true;
+                return {nullptr, 0};
+            case Progress::END:
+                break;
+        }
+        return {nullptr, 0};
+    }
+
+    ssize_t len() override {
+        return len_;
+    }
+
+    size_t spliceTo(Transport &conn) override {
+        return error_ ? 0 : up_->spliceTo(conn);
+    }
+
+    bool aborted() override {
+        return aborted_;
+    }
+
+private:
+    std::shared_ptr<UpstreamLease> lease_;
+    UpstreamConnection *up_;
+    std::string chunk_;  // handed out by get(), valid until the next call
+    ssize_t len_;
+    bool error_, aborted_, sent_;
+};
+
+class ProxyHandler final {
+public:
+    ProxyHandler(std::string prefix, std::shared_ptr<UpstreamGroup> group, RequestHandler inner) :
+            prefix_(std::move(prefix)), group_(std::move(group)), inner_(std::move(inner)),
+            active_(false), chunked_(false) {}
+
+    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+        if (header) {
+            active_ = header->target.compare(0, prefix_.size(), prefix_) == 0;
+            if (active_) {
+                flow_ = header->flow;
+                start_(*header);
+            }
+        }
+        if (!active_) {
+            inner_(header, body, resp);
+            return;
+        }
+        if (body) {
+            UpstreamConnection *up = lease_->up.get();
+            if (up && body->length) up->send(body->data, body->length, chunked_, flow_);
+            return;
+        }
+        if (header) return;
+        if (lease_->up && chunked_) lease_->up->send("0\r\n\r\n", 5, false, nullptr);
+        resp = std::make_unique<Response>();
+        resp->version = "1.1";
+        resp->body = std::make_unique<ProxyBody>(std::move(lease_));
+        flow_.reset();
+    }
+
+private:
+    std::string prefix_;
+    std::shared_ptr<UpstreamGroup> group_;
+    RequestHandler inner_;
+    bool active_, chunked_;  // chunked_: the request body is re-framed in chunks
+    std::shared_ptr<UpstreamLease> lease_;  // shared by the copies std::function makes
+    std::shared_ptr<BodyFlow> flow_;         // of the current request
+
+    void start_(const HttpHeader &h) {
+        lease_ = std::make_shared<UpstreamLease>();
+        size_t i = group_->pick(h);
+        group_->started(i);
+        lease_->group = group_;
+        lease_->index = i;
+        lease_->started = MetricsClock::now();
+        const std::string &key = group_->key(i);
+        auto &idle = idlePool(key);
+        std::shared_ptr<UpstreamConnection> up;
+        bool reused = false;
+        while (!idle.empty() && !up) {
+            up = std::move(idle.back());
+            idle.pop_back();
+            if (up->dead()) up.reset();
+            reused = bool(up);
+        }
+        if (!up) {
+            int ec;
+            up = UpstreamConnection::connect(group_->context(), group_->host(i), group_->port(i), ec);
+            if (!up) {
+                Logger::global->log(LOG_WARN, "upstream " + key + ": " + strerror(ec));
+                lease_->responded(false);
+                return;
+            }
+        }
+        lease_->up = up;
+
+        std::string req;
+        req.append(h.method).append(" ").append(h.target).append(" HTTP/1.1\r\n");
+        const std::string *connection = find(h.header, "Connection");
+        for (auto &&[k, v]: h.header) {
+            if (!hopByHop(k, connection)) req.append(k).append(": ").append(v).append("\r\n");
+        }
+        if (!find(h.header, "Host")) req.append("Host: ").append(key).append("\r\n");
+        // HTTP/2 requests may carry a body without announcing its length
+        const std::string *cl = find(h.header, "Content-Length");
+        chunked_ = !cl && (find(h.header, "Transfer-Encoding") || (h.method != "GET" && h.method != "HEAD"));
+        if (cl) {
+            req.append("Content-Length: ").append(*cl).append("\r\n");
+        } else if (chunked_) {
+            req.append("Transfer-Encoding: chunked\r\n");
+        }
+        req.append("\r\n");
+        // idempotent (RFC 9110 section 9.2.2) and without a body, which is not kept
+        static const char *const idempotent[] = {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"};
+        if (reused && !chunked_ && (!cl || *cl == "0") &&
+            std::any_of(std::begin(idempotent), std::end(idempotent), [&h](const char *m) {
+                return h.method == m;
+            })) {
+            lease_->request = req;
+            lease_->headOnly = h.method == "HEAD";
+        }
+        up->begin(std::move(req), h.method == "HEAD");
+    }
+};
+
+}
+
+UpstreamGroup::UpstreamGroup(Context &ctx, std::vector<std::pair<std::string, int>> upstreams,
+                             UpstreamGroupOptions options) :
+        ctx_(ctx), options_(std::move(options)), id_(nextGroupId++),
+        members_(new Member[upstreams.size()]), size_(upstreams.size()), stopping_(false) {
+    for (size_t i = 0; i < size_; ++i) {
+        Member &m = members_[i];
+        m.host = std::move(upstreams[i].first);
+        m.port = upstreams[i].second;
+        m.key = m.host + ":" + std::to_string(m.port);
+        if (options_.policy != BalancePolicy::HEADER_HASH) continue;
+        for (int j = 0; j < RING_POINTS; ++j) {
+            ring_.emplace_back(hashOf(m.key + "#" + std::to_string(j)), i);
+        }
+    }
+    std::sort(ring_.begin(), ring_.end());
+}
+
+std::shared_ptr<UpstreamGroup> UpstreamGroup::create(Context &ctx, std::vector<std::pair<std::string, int>> upstreams,
+                                                     UpstreamGroupOptions options) {
+    if (upstreams.empty()) return nullptr;
+    std::shared_ptr<UpstreamGroup> group(new UpstreamGroup(ctx, std::move(upstreams), std::move(options)));
+    if (!group->options_.healthPath.empty()) {
+        group->prober_ = std::thread([g = group.get()]() {
+            g->probe_();
+        });
+    }
+    return group;
+}
+
+UpstreamGroup::~UpstreamGroup() {
+    {
+        std::lock_guard guard(probeLock_);
+        stopping_ = true;
+    }
+    probeWait_.notify_all();
+    if (prober_.joinable()) prober_.join();
+}
+
+size_t UpstreamGroup::size() const {
+    return size_;
+}
+
+Context &UpstreamGroup::context() const {
+    return ctx_;
+}
+
+const std::string &UpstreamGroup::host(size_t i) const {
+    return members_[i].host;
+}
+
+int UpstreamGroup::port(size_t i) const {
+    return members_[i].port;
+}
+
+const std::string &UpstreamGroup::key(size_t i) const {
+    return members_[i].key;
+}
+
+UpstreamGroup::Shard &UpstreamGroup::shard_() {
+    thread_local std::unordered_map<uint64_t, Shard *> mine;
+    Shard *&s = mine[id_];
+    if (!s) {
+        auto owned = std::make_unique<Shard>();
+        owned->outstanding.reset(new std::atomic<int64_t>[size_]);
+        owned->ewmaNs.reset(new std::atomic<uint64_t>[size_]);
+        owned->ewmaAt.reset(new std::atomic<int64_t>[size_]);
+        for (size_t i = 0; i < size_; ++i) {
+            owned->outstanding[i].store(0, std::memory_order_relaxed);
+            owned->ewmaNs[i].store(0, std::memory_order_relaxed);
+            owned->ewmaAt[i].store(0, std::memory_order_relaxed);
+        }
+        owned->othersOutstanding.resize(size_);
+        owned->mergedEwmaNs.resize(size_);
+        owned->rng = std::random_device{}() ^ (id_ << 32);
+        std::lock_guard guard(shardsLock_);
+        shards_.push_back(std::move(owned));
+        s = shards_.back().get();
+    }
+    return *s;
+}
+
+void UpstreamGroup::merge_(Shard &s) {
+    auto now = MetricsClock::now();
+    if (s.mergedAt.time_since_epoch().count() &&
+        now - s.mergedAt < std::chrono::nanoseconds(MERGE_INTERVAL_NS)) {
+        return;
+    }
+    s.mergedAt = now;
+    int64_t t = nowNs();
+    std::fill(s.othersOutstanding.begin(), s.othersOutstanding.end(), 0);
+    std::vector<uint64_t> sum(size_), n(size_);
+    // only registration contends for this lock, the shards are read while their threads keep writing
+    std::lock_guard guard(shardsLock_);
+    for (auto &&o: shards_) {
+        for (size_t i = 0; i < size_; ++i) {
+            if (o.get() != &s) s.othersOutstanding[i] += o->outstanding[i].load(std::memory_order_relaxed);
+            uint64_t e = o->ewmaNs[i].load(std::memory_order_relaxed);
+            if (!e) continue;
+            int64_t halves = (t - o->ewmaAt[i].load(std::memory_order_relaxed)) / EWMA_HALF_LIFE_NS;
+            sum[i] += halves >= 64 ? 0 : e >> halves;
+            ++n[i];
+        }
+    }
+    for (size_t i = 0; i < size_; ++i) {
+        s.mergedEwmaNs[i] = n[i] ? sum[i] / n[i] : 0;
+    }
+}
+
+bool UpstreamGroup::eligible_(size_t i, int64_t now) const {
+    const Member &m = members_[i];
+    return !m.down.load(std::memory_order_relaxed) && m.ejectedUntil.load(std::memory_order_relaxed) <= now;
+}
+
+const std::vector<size_t> &UpstreamGroup::candidates_(int64_t now) const {
+    thread_local std::vector<size_t> c;
+    c.clear();
+    for (size_t i = 0; i < size_; ++i) {
+        if (eligible_(i, now)) c.push_back(i);
+    }
+    if (c.empty()) {
+        for (size_t i = 0; i < size_; ++i) c.push_back(i);
+    }
+    return c;
+}
+
+size_t UpstreamGroup::hashPick_(const std::string &value, int64_t now) const {
+    auto first = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(hashOf(value), size_t(0)));
+    // the next eligible point clockwise, so only keys of an ejected upstream move
+    for (size_t k = 0; k < ring_.size(); ++k) {
+        auto it = ring_.begin() + (first - ring_.begin() + k) % ring_.size();
+        if (eligible_(it->second, now)) return it->second;
+    }
+    return ring_[(first - ring_.begin()) % ring_.size()].second;
+}
+
+size_t UpstreamGroup::pick(const HttpHeader &h) {
+    if (size_ == 1) return 0;
+    Shard &s = shard_();
+    int64_t now = nowNs();
+    if (options_.policy == BalancePolicy::HEADER_HASH) {
+        auto it = h.header.find(normalizeFieldName(options_.hashHeader));
+        if (it != h.header.end()) return hashPick_(it->second, now);
+    }
+    const std::vector<size_t> &c = candidates_(now);
+    size_t start = s.next++;
+    if (options_.policy == BalancePolicy::ROUND_ROBIN || options_.policy == BalancePolicy::HEADER_HASH ||
+        c.size() == 1) {
+        return c[start % c.size()];
+    }
+    merge_(s);
+    auto inFlight = [&s](size_t i) {
+        return s.othersOutstanding[i] + s.outstanding[i].load(std::memory_order_relaxed);
+    };
+    if (options_.policy == BalancePolicy::LEAST_OUTSTANDING) {
+        // ties go round robin
+        size_t best = c[start % c.size()];
+        for (size_t k = 1; k < c.size(); ++k) {
+            size_t i = c[(start + k) % c.size()];
+            if (inFlight(i) < inFlight(best)) best = i;
+        }
+        return best;
+    }
+    s.rng ^= s.rng << 13;
+    s.rng ^= s.rng >> 7;
+    s.rng ^= s.rng << 17;
+    size_t j = s.rng % c.size(), k = (j + 1 + s.rng / c.size() % (c.size() - 1)) % c.size();
+    size_t a = c[j], b = c[k];
+    // an upstream without samples costs nothing, so new and recovered ones get tried
+    auto cost = [&](size_t i) {
+        return double(s.mergedEwmaNs[i]) * double(std::max<int64_t>(inFlight(i), 0) + 1);
+    };
+    return cost(b) < cost(a) ? b : a;
+}
+
+void UpstreamGroup::started(size_t i) {
+    bump(shard_().outstanding[i], int64_t(1));
+}
+
+void UpstreamGroup::finished(size_t i) {
+    bump(shard_().outstanding[i], int64_t(-1));
+}
+
+void UpstreamGroup::responded(size_t i, bool ok, uint64_t latencyNs) {
+    Member &m = members_[i];
+    if (ok) {
+        Shard &s = shard_();
+        uint64_t e = s.ewmaNs[i].load(std::memory_order_relaxed);
+        s.ewmaNs[i].store(e ? e - e / 4 + latencyNs / 4 : std::max<uint64_t>(latencyNs, 1),
+                          std::memory_order_relaxed);
+        s.ewmaAt[i].store(nowNs(), std::memory_order_relaxed);
+        if (m.fails.load(std::memory_order_relaxed)) m.fails.store(0, std::memory_order_relaxed);
+        return;
+    }
+    if (options_.maxFails <= 0 || ++m.fails < options_.maxFails) return;
+    m.fails.store(0);
+    m.ejectedUntil.store(nowNs() + options_.ejectMs * 1000000);
+    Logger::global->log(LOG_WARN, "upstream " + m.key + " ejected for " + std::to_string(options_.ejectMs) + " ms");
+}
+
+void UpstreamGroup::probe_() {
+    std::vector<std::shared_ptr<UpstreamConnection>> probes(size_);
+    auto settle = [this, &probes](size_t i, bool ok) {
+        if (probes[i]) probes[i]->release(false);
+        probes[i].reset();
+        if (members_[i].down.exchange(!ok) != !ok) {
+            Logger::global->log(LOG_WARN, "upstream " + members_[i].key + (ok ? " passed" : " failed") +
+                                          " its health check");
+        }
+    };
+    std::unique_lock lock(probeLock_);
+    while (!stopping_) {
+        lock.unlock();
+        for (size_t i = 0; i < size_; ++i) {
+            // a probe still unanswered after a whole interval has failed
+            if (probes[i]) {
+                Response resp;
+                ssize_t len;
+                settle(i, probes[i]->head(resp, len) == Progress::DATA && resp.status >= 200 && resp.status < 400);
+            }
+            int ec;
+            probes[i] = UpstreamConnection::connect(ctx_, members_[i].host, members_[i].port, ec);
+            if (!probes[i]) {
+                settle(i, false);
+                continue;
+            }
+            probes[i]->begin("GET " + options_.healthPath + " HTTP/1.1\r\nHost: " + members_[i].key +
+                             "\r\nConnection: close\r\n\r\n", false);
+        }
+        lock.lock();
+        probeWait_.wait_for(lock, std::chrono::milliseconds(options_.healthIntervalMs), [this]() {
+            return stopping_;
+        });
+    }
+    for (auto &&p: probes) {
+        if (p) p->release(false);
+    }
+}
+
+NewClientHandler proxyPass(NewClientHandler h, const std::string &prefix, std::shared_ptr<UpstreamGroup> group) {
+    return [prefix, group = std::move(group), h = std::move(h)]() {
+        return RequestHandler(ProxyHandler(prefix, group, h()));
+    };
+}
+
+NewClientHandler proxyPass(NewClientHandler h, const std::string &prefix, Context &ctx,
+                           const std::string &host, int port) {
+    return proxyPass(std::move(h), prefix, UpstreamGroup::create(ctx, {{host, port}}));
+}
+
+}
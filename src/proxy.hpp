@@ -0,0 +1,130 @@
+#ifndef SIMPLE_HTTP_SERVER_PROXY_HPP
+#define SIMPLE_HTTP_SERVER_PROXY_HPP
+
+#include "http_server.hpp"
+#include "metrics.hpp"
+#include<atomic>
+#include<condition_variable>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<utility>
+#include<vector>
+#include<cstdint>
+
+namespace SHS1 {
+
+enum class BalancePolicy {
+    ROUND_ROBIN,
+    LEAST_OUTSTANDING,  // fewest requests in flight
+    P2C_EWMA,           // the cheaper of two random upstreams, cost = latency EWMA * (in flight + 1)
+    HEADER_HASH         // consistent hashing on the value of a request field
+};
+
+struct UpstreamGroupOptions {
+    BalancePolicy policy = BalancePolicy::ROUND_ROBIN;
+    std::string hashHeader;      // HEADER_HASH: the field hashed, requests without it go round robin
+    int maxFails = 3;            // consecutive failures ejecting an upstream, 0 disables passive ejection
+    long ejectMs = 10000;        // how long a passive ejection lasts before the upstream is tried again
+    std::string healthPath;      // GET target probed on every upstream, empty disables active checks
+    long healthIntervalMs = 2000;
+};
+
+// upstream servers sharing the traffic of one proxyPass.
+// Every thread choosing an upstream keeps its own counters, requests in flight and a latency EWMA per
+// upstream, written without locks; they are merged with the other threads' counters at most every
+// few milliseconds when that thread picks. An upstream is ejected after maxFails consecutive
+// failures (connect errors, no response, 502-504) or, with healthPath, while its probe fails.
+// When every upstream is ejected, all are eligible again.
+class UpstreamGroup final : private DisableCopy {
+public:
+    static std::shared_ptr<UpstreamGroup> create(Context &ctx, std::vector<std::pair<std::string, int>> upstreams,
+                                                 UpstreamGroupOptions options = {});
+
+    ~UpstreamGroup();
+
+    size_t size() const;
+
+    Context &context() const;
+
+    const std::string &host(size_t i) const;
+
+    int port(size_t i) const;
+
+    // host:port
+    const std::string &key(size_t i) const;
+
+    // upstream for a request; the caller reports the exchange with started() and finished()
+    size_t pick(const HttpHeader &h);
+
+    void started(size_t i);
+
+    // ok: a response header arrived and was not a gateway error; latencyNs until it arrived
+    void responded(size_t i, bool ok, uint64_t latencyNs);
+
+    void finished(size_t i);
+
+private:
+    struct Member {
+        std::string host, key;
+        int port = 0;
+        std::atomic<int> fails{0};             // consecutive, shared by every thread
+        std::atomic<int64_t> ejectedUntil{0};  // steady clock nanoseconds
+        std::atomic<bool> down{false};         // failing its active check
+    };
+
+    // counters of one thread; written by that thread only, read by others when merging
+    struct Shard {
+        std::unique_ptr<std::atomic<int64_t>[]> outstanding;
+        std::unique_ptr<std::atomic<uint64_t>[]> ewmaNs;
+        std::unique_ptr<std::atomic<int64_t>[]> ewmaAt;  // when ewmaNs was last updated
+        // merged view, private to the owning thread
+        std::vector<int64_t> othersOutstanding;
+        std::vector<uint64_t> mergedEwmaNs;
+        MetricsClock::time_point mergedAt;
+        uint64_t next = 0, rng;
+    };
+
+    Context &ctx_;
+    UpstreamGroupOptions options_;
+    uint64_t id_;
+    std::unique_ptr<Member[]> members_;
+    size_t size_;
+    std::vector<std::pair<uint64_t, size_t>> ring_;  // HEADER_HASH points, sorted
+    std::mutex shardsLock_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex probeLock_;
+    std::condition_variable probeWait_;
+    bool stopping_;
+    std::thread prober_;
+
+    UpstreamGroup(Context &ctx, std::vector<std::pair<std::string, int>> upstreams, UpstreamGroupOptions options);
+
+    Shard &shard_();
+
+    void merge_(Shard &s);
+
+    bool eligible_(size_t i, int64_t now) const;
+
+    // eligible upstreams, or all of them when none is
+    const std::vector<size_t> &candidates_(int64_t now) const;
+
+    size_t hashPick_(const std::string &value, int64_t now) const;
+
+    void probe_();
+};
+
+// forwards requests whose target starts with prefix, unchanged, to one of the HTTP/1.1 servers of
+// group; every other request goes to the handlers created by h.
+// Upstream connections are kept alive in pools local to the thread that answers the downstream
+// request, request bodies are sent while they arrive and response bodies while the client reads.
+NewClientHandler proxyPass(NewClientHandler h, const std::string &prefix, std::shared_ptr<UpstreamGroup> group);
+
+// a single upstream server
+NewClientHandler proxyPass(NewClientHandler h, const std::string &prefix, Context &ctx,
+                           const std::string &host, int port);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_PROXY_HPP
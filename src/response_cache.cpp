@@ -0,0 +1,191 @@
+#include "response_cache.hpp"
+#include <algorithm>
+#include <functional>
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+
+namespace SHS1 {
+
+namespace {
+
+const std::string &field(const std::unordered_map<std::string, std::string> &m, const std::string &name) {
+    static const std::string none;
+    auto it = m.find(name);
+    return it == m.end() ? none : it->second;
+}
+
+// comma separated elements, trimmed
+std::vector<std::string> elements(const std::string &list) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        size_t b = list.find_first_not_of(" \t", pos);
+        size_t e = list.find_last_not_of(" \t", end - 1);
+        if (b < end) out.push_back(list.substr(b, e - b + 1));
+        pos = end + 1;
+    }
+    return out;
+}
+
+// freshness lifetime in seconds from response Cache-Control, 0 when it must not be stored
+long freshness(const std::string &cacheControl) {
+    long maxAge = 0, sMaxAge = -1;
+    for (auto &&d: elements(cacheControl)) {
+        if (!strcasecmp(d.c_str(), "no-store") || !strcasecmp(d.c_str(), "no-cache") ||
+            !strcasecmp(d.c_str(), "private")) {
+            return 0;
+        }
+        if (!strncasecmp(d.c_str(), "max-age=", 8)) maxAge = strtol(d.c_str() + 8, nullptr, 10);
+        if (!strncasecmp(d.c_str(), "s-maxage=", 9)) sMaxAge = strtol(d.c_str() + 9, nullptr, 10);
+    }
+    return std::max(sMaxAge >= 0 ? sMaxAge : maxAge, 0L);
+}
+
+// lowercased Host and the target, joined by a space neither of them can contain
+std::string cacheKey(const std::string &target, const std::unordered_map<std::string, std::string> &header) {
+    std::string key = field(header, normalizeFieldName("Host"));
+    std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+    key.push_back(' ');
+    key.append(target);
+    return key;
+}
+
+bool matches(const std::vector<std::pair<std::string, std::string>> &vary,
+             const std::unordered_map<std::string, std::string> &header) {
+    for (auto &&[name, value]: vary) {
+        if (field(header, name) != value) return false;
+    }
+    return true;
+}
+
+}
+
+ResponseCache::ResponseCache(size_t capacity, size_t maxEntry) :
+        stripeCapacity_(capacity / STRIPES), maxEntry_(std::min(maxEntry, capacity / STRIPES)) {}
+
+std::shared_ptr<ResponseCache> ResponseCache::create(size_t capacity, size_t maxEntry) {
+    return std::shared_ptr<ResponseCache>(new ResponseCache(capacity, maxEntry));
+}
+
+ResponseCache::Stripe &ResponseCache::stripe_(const std::string &key) {
+    return stripes_[std::hash<std::string>{}(key) % STRIPES];
+}
+
+void ResponseCache::erase_(Stripe &s, std::list<Entry>::iterator it) {
+    auto [b, e] = s.index.equal_range(it->key);
+    for (; b != e; ++b) {
+        if (b->second == it) {
+            s.index.erase(b);
+            break;
+        }
+    }
+    MetricsShard &metrics = MetricsShard::local();
+    bump(metrics.cacheBytes, -int64_t(it->cost));
+    bump(metrics.cacheEntries, int64_t(-1));
+    s.used -= it->cost;
+    s.lru.erase(it);
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::lookup(const std::string &method, const std::string &target,
+                                                            const std::unordered_map<std::string, std::string> &header,
+                                                            bool &store) {
+    store = false;
+    if (method != "GET" && method != "HEAD") return nullptr;
+    // conditional, partial and authorized requests always reach the handler
+    for (const char *name: {"Authorization", "Range", "If-None-Match", "If-Modified-Since", "If-Range",
+                            "If-Match", "If-Unmodified-Since"}) {
+        if (header.count(normalizeFieldName(name))) return nullptr;
+    }
+    const std::string &cacheControl = field(header, normalizeFieldName("Cache-Control"));
+    if (hasToken(cacheControl, "no-store")) return nullptr;
+    store = method == "GET";
+    MetricsShard &metrics = MetricsShard::local();
+    if (hasToken(cacheControl, "no-cache")) {
+        bump(metrics.cacheMisses, uint64_t(1));
+        return nullptr;
+    }
+
+    std::string key = cacheKey(target, header);
+    Stripe &s = stripe_(key);
+    auto now = MetricsClock::now();
+    std::lock_guard guard(s.lock);
+    auto [b, e] = s.index.equal_range(key);
+    while (b != e) {
+        auto it = (b++)->second;
+        if (it->expires <= now) {
+            erase_(s, it);
+        } else if (matches(it->vary, header)) {
+            s.lru.splice(s.lru.begin(), s.lru, it);
+            bump(metrics.cacheHits, uint64_t(1));
+            return it->response;
+        }
+    }
+    bump(metrics.cacheMisses, uint64_t(1));
+    return nullptr;
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::store(const std::string &target,
+                                                           const std::unordered_map<std::string, std::string> &header,
+                                                           Response &resp) {
+    // draining an asynchronous body here would block the loop until it is produced
+    if (resp.status != 200 || !resp.body || dynamic_cast<AsyncResponseBody *>(resp.body.get())) return nullptr;
+    auto cc = resp.header.find(normalizeFieldName("Cache-Control"));
+    long ttl = cc == resp.header.end() ? 0 : freshness(cc->second);
+    if (ttl <= 0 || resp.header.count(normalizeFieldName("Set-Cookie"))) return nullptr;
+    ssize_t len = resp.body->len();
+    if (len <= 0 || size_t(len) > maxEntry_) return nullptr;
+
+    Entry entry;
+    auto vary = resp.header.find(normalizeFieldName("Vary"));
+    if (vary != resp.header.end()) {
+        for (auto &&name: elements(vary->second)) {
+            if (name == "*") return nullptr;
+            std::string n = normalizeFieldName(name);
+            entry.vary.emplace_back(n, field(header, n));
+        }
+    }
+
+    auto cached = std::make_shared<CachedResponse>();
+    cached->status = resp.status;
+    appendResponseHead(cached->bytes, resp, "keep-alive", size_t(len));
+    cached->headerLen = cached->bytes.size();
+    cached->connectionPos = cached->bytes.find("\r\nConnection: ") + 14;
+    cached->bytes.reserve(cached->headerLen + len);
+    for (auto [p, n] = resp.body->get(); p; std::tie(p, n) = resp.body->get()) {
+        cached->bytes.append(p, n);
+    }
+    if (cached->bytes.size() != cached->headerLen + len) {  // the body lied about its length
+        // one that broke off stays in place, at its end, so the connection is reset
+        if (!resp.body->aborted()) {
+            resp.body = std::make_unique<StringResponse>(cached->bytes.substr(cached->headerLen));
+        }
+        return nullptr;
+    }
+    resp.body.reset();
+
+    entry.key = cacheKey(target, header);
+    entry.response = cached;
+    entry.expires = MetricsClock::now() + std::chrono::seconds(ttl);
+    entry.cost = cached->bytes.size() + entry.key.size() + sizeof(Entry) + 64;
+    Stripe &s = stripe_(entry.key);
+    MetricsShard &metrics = MetricsShard::local();
+    std::lock_guard guard(s.lock);
+    auto [b, e] = s.index.equal_range(entry.key);
+    while (b != e) {
+        auto it = (b++)->second;
+        if (it->vary == entry.vary) erase_(s, it);
+    }
+    while (!s.lru.empty() && s.used + entry.cost > stripeCapacity_) {
+        erase_(s, std::prev(s.lru.end()));
+    }
+    s.used += entry.cost;
+    bump(metrics.cacheBytes, int64_t(entry.cost));
+    bump(metrics.cacheEntries, int64_t(1));
+    s.lru.push_front(std::move(entry));
+    s.index.emplace(s.lru.front().key, s.lru.begin());
+    return cached;
+}
+
+}
@@ -0,0 +1,76 @@
+#ifndef SIMPLE_HTTP_SERVER_RESPONSE_CACHE_HPP
+#define SIMPLE_HTTP_SERVER_RESPONSE_CACHE_HPP
+
+#include "http_server.hpp"
+#include "metrics.hpp"
+#include<list>
+#include<mutex>
+#include<memory>
+#include<string>
+#include<vector>
+#include<unordered_map>
+#include<cstddef>
+
+namespace SHS1 {
+
+// a response as written on an HTTP/1.1 keep-alive connection
+struct CachedResponse {
+    std::string bytes;     // status line, header block and body
+    size_t headerLen;      // all a HEAD request gets
+    size_t connectionPos;  // offset of the "keep-alive" token, replaced for a closing connection
+    int status;
+};
+
+// microcache in front of the request handler for HTTP/1.x GET and HEAD: 200 responses to GET
+// carrying Cache-Control max-age or s-maxage are kept fully serialized, keyed by Host, target and
+// the request fields named in Vary, and later requests are answered with the stored bytes without
+// calling the handler. Lock-striped, every stripe is an LRU list holding its share of capacity.
+class ResponseCache final : private DisableCopy {
+public:
+    // entry answering a GET or HEAD request, nullptr on a miss; store is set when the response
+    // to this request may be offered to store(), false for requests bypassing the cache
+    std::shared_ptr<const CachedResponse> lookup(const std::string &method, const std::string &target,
+                                                 const std::unordered_map<std::string, std::string> &header,
+                                                 bool &store);
+
+    // keeps resp if its status, Cache-Control, Vary and size allow it and its body is not
+    // asynchronous; the body is then consumed and the returned entry has to be sent instead,
+    // nullptr leaves resp untouched
+    std::shared_ptr<const CachedResponse> store(const std::string &target,
+                                                const std::unordered_map<std::string, std::string> &header,
+                                                Response &resp);
+
+    static std::shared_ptr<ResponseCache> create(size_t capacity = 64 * 1024 * 1024,
+                                                 size_t maxEntry = 1024 * 1024);
+
+private:
+    struct Entry {
+        std::string key;  // lowercased Host, space, target
+        std::vector<std::pair<std::string, std::string>> vary;  // request field and value it was stored for
+        std::shared_ptr<const CachedResponse> response;
+        MetricsClock::time_point expires;
+        size_t cost;
+    };
+
+    struct Stripe {
+        std::mutex lock;
+        std::list<Entry> lru;  // most recently used first
+        std::unordered_multimap<std::string, std::list<Entry>::iterator> index;
+        size_t used = 0;
+    };
+
+    static constexpr size_t STRIPES = 16;
+
+    size_t stripeCapacity_, maxEntry_;
+    Stripe stripes_[STRIPES];
+
+    ResponseCache(size_t capacity, size_t maxEntry);
+
+    Stripe &stripe_(const std::string &key);
+
+    static void erase_(Stripe &s, std::list<Entry>::iterator it);
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_RESPONSE_CACHE_HPP
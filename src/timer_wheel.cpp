@@ -0,0 +1,96 @@
+#include "timer_wheel.hpp"
+#include <algorithm>
+
+namespace SHS1 {
+
+namespace {
+
+void unlink(TimerWheel::Timer &t) {
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = t.next = nullptr;
+}
+
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick) :
+        tick_(std::max(tick, std::chrono::milliseconds(1))), start_(Clock::now()), now_(0) {
+    for (auto &&level: slots_) {
+        for (Timer &head: level) {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    for (auto &&level: slots_) {
+        for (Timer &head: level) {
+            while (head.next != &head) unlink(*head.next);
+        }
+    }
+}
+
+void TimerWheel::arm(Timer &t, std::chrono::milliseconds delay) {
+    if (t.armed()) unlink(t);
+    // rounded up from the current time, not from now_, which may lag: a timer must not fire early
+    auto tickNs = uint64_t(std::chrono::nanoseconds(tick_).count());
+    auto at = uint64_t(std::chrono::nanoseconds(Clock::now() - start_).count()) +
+              uint64_t(std::chrono::nanoseconds(std::max(delay, std::chrono::milliseconds(1))).count());
+    uint64_t expires = std::max((at + tickNs - 1) / tickNs, now_ + 1);
+    t.expires = std::min(expires, now_ + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1);
+    place_(t);
+}
+
+void TimerWheel::cancel(Timer &t) {
+    if (t.armed()) unlink(t);
+}
+
+void TimerWheel::place_(Timer &t) {
+    uint64_t delta = t.expires > now_ ? t.expires - now_ : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= uint64_t(1) << (SLOT_BITS * (level + 1))) ++level;
+    Timer &head = slots_[level][(std::max(t.expires, now_) >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+}
+
+void TimerWheel::cascade_(int level, uint64_t i) {
+    Timer &head = slots_[level][i];
+    Timer moved;  // detach the list first, a timer may land in this very slot again
+    if (head.next == &head) return;
+    moved.next = head.next;
+    moved.prev = head.prev;
+    moved.next->prev = moved.prev->next = &moved;
+    head.prev = head.next = &head;
+    while (moved.next != &moved) {
+        Timer &t = *moved.next;
+        unlink(t);
+        place_(t);
+    }
+}
+
+void TimerWheel::advance(Clock::time_point now, const std::function<void(Timer &)> &expired) {
+    if (now < start_) return;
+    auto target = uint64_t((now - start_) / tick_);
+    while (now_ < target) {
+        ++now_;
+        for (int level = 1; level < LEVELS; ++level) {
+            if (now_ & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) break;
+            cascade_(level, (now_ >> (SLOT_BITS * level)) & (SLOTS - 1));
+        }
+        Timer &head = slots_[0][now_ & (SLOTS - 1)];
+        while (head.next != &head) {
+            Timer &t = *head.next;
+            unlink(t);
+            expired(t);
+        }
+    }
+}
+
+std::chrono::milliseconds TimerWheel::tick() const {
+    return tick_;
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef SIMPLE_HTTP_SERVER_TIMER_WHEEL_HPP
+#define SIMPLE_HTTP_SERVER_TIMER_WHEEL_HPP
+
+#include "io_context.hpp"
+#include<chrono>
+#include<functional>
+#include<cstdint>
+
+namespace SHS1 {
+
+// hierarchical timing wheel: LEVELS wheels of SLOTS lists, each slot of level l spanning SLOTS^l
+// ticks. Arming and cancelling unlink or link one node; a timer far out sits in a coarse level
+// and moves down as its time comes closer. Timers fire at most one tick late.
+// Not synchronized, the owner serializes every call
+class TimerWheel final : private SNL1::DisableCopy {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // a node embedded in the object it times; must be cancelled before it is destroyed
+    struct Timer {
+        Timer *prev = nullptr, *next = nullptr;
+        uint64_t expires = 0;  // tick
+
+        bool armed() const {
+            return prev != nullptr;
+        }
+    };
+
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int LEVELS = 4;
+    static constexpr uint64_t SLOTS = uint64_t(1) << SLOT_BITS;
+
+    explicit TimerWheel(std::chrono::milliseconds tick);
+
+    ~TimerWheel();
+
+    // (re)arms t to fire after at least delay; delays beyond the last level are shortened to it
+    void arm(Timer &t, std::chrono::milliseconds delay);
+
+    void cancel(Timer &t);
+
+    // moves the wheel to now, calling expired for every timer due, which is disarmed by then
+    void advance(Clock::time_point now, const std::function<void(Timer &)> &expired);
+
+    std::chrono::milliseconds tick() const;
+
+private:
+    std::chrono::milliseconds tick_;
+    Clock::time_point start_;
+    uint64_t now_;                // ticks since start_ the wheel has run to
+    Timer slots_[LEVELS][SLOTS];  // heads of circular lists
+
+    void place_(Timer &t);
+
+    // moves the timers of slot i of level to the levels their remaining time belongs to
+    void cascade_(int level, uint64_t i);
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_TIMER_WHEEL_HPP
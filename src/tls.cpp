@@ -0,0 +1,407 @@
+#include "tls.hpp"
+#include "logger.hpp"
+#include<openssl/ssl.h>
+#include<openssl/err.h>
+#include<openssl/rand.h>
+#include<openssl/evp.h>
+#include<openssl/core_names.h>
+#include<cstring>
+#include<climits>
+#include<cerrno>
+#include<atomic>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+}
+
+constexpr size_t TLS_READ_CHUNK = 16384;
+constexpr size_t TLS_WRITE_CHUNK = 16384;
+constexpr size_t TLS_OUT_HIGH_WATER = 65536;
+constexpr size_t TLS_SESSION_CACHE_SIZE = 20480;
+constexpr int TLS_TICKETS_PER_HANDSHAKE = 2;
+constexpr auto TICKET_KEY_LIFETIME = std::chrono::hours(1);
+constexpr size_t TICKET_KEY_KEEP = 2;
+
+struct TicketKey {
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+};
+
+static std::string sslError(const char *what) {
+    std::string s(what);
+    unsigned long e;
+    char buf[256];
+    while ((e = ERR_get_error()) != 0) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        s.append(": ").append(buf);
+    }
+    return s;
+}
+
+struct TlsCallbacks {
+    static int alpnSelect(SSL *, const unsigned char **out, unsigned char *outLen,
+                          const unsigned char *in, unsigned int inLen, void *) {
+        static const unsigned char protos[] = "\x02h2\x08http/1.1";
+        unsigned char *o;
+        if (SSL_select_next_proto(&o, outLen, protos, sizeof(protos) - 1, in, inLen) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = o;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    static int ticketKey(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+        auto self = (TlsContext *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+        // a copy: another thread may rotate keys_ and free a key once the lock is released
+        TicketKey key;
+        const TicketKey *k = &key;
+        bool renew = false;
+        if (enc) {
+            if (!self->encryptionKey_(key) || RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0) return -1;
+            memcpy(name, k->name, sizeof(k->name));
+        } else {
+            std::lock_guard guard(self->keyLock_);
+            const TicketKey *found = self->findKey_(name);
+            if (!found) return 0;
+            renew = found != self->keys_.front().get();
+            key = *found;
+        }
+        OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *) k->hmacKey, sizeof(k->hmacKey)),
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *) "SHA256", 0),
+                OSSL_PARAM_construct_end()
+        };
+        if (!EVP_MAC_CTX_set_params(hctx, params)) return -1;
+        if (enc) {
+            if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k->aesKey, iv)) return -1;
+            return 1;
+        }
+        if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k->aesKey, iv)) return -1;
+        // decrypted with an older key: accept but ask the client to take a fresh ticket
+        return renew ? 2 : 1;
+    }
+};
+
+namespace {
+
+// TLS records go through memory BIOs so the socket stays owned by SNL1,
+// the user handler only sees plaintext events once the handshake is done
+class TlsTransport final : public Transport,
+                           public std::enable_shared_from_this<TlsTransport> {
+public:
+    TlsTransport(std::shared_ptr<TlsContext> ctx, SSL *ssl, std::shared_ptr<Transport> conn) :
+            ctx_(std::move(ctx)), ssl_(ssl), conn_(std::move(conn)), outPos_(0),
+            userRead_(false), userWrite_(false), handshakeDone_(false),
+            readClosed_(false), writeClosed_(false), shutRd_(false), shutWr_(false),
+            wakePending_(false) {
+        rbio_ = BIO_new(BIO_s_mem());
+        wbio_ = BIO_new(BIO_s_mem());
+        BIO_set_mem_eof_return(rbio_, -1);
+        SSL_set_bio(ssl_, rbio_, wbio_);
+        SSL_set_accept_state(ssl_);
+    }
+
+    ~TlsTransport() override {
+        SSL_free(ssl_);
+    }
+
+    void enableHandler(std::function<void(EventType)> h, bool rd, bool wr) override {
+        handler_ = std::move(h);
+        userRead_ = rd;
+        userWrite_ = wr;
+        conn_->enableHandler([ptr = shared_from_this()](EventType e) {
+            ptr->event_(e);
+        }, true, false);
+    }
+
+    size_t hRead(char *buf, size_t len, int &ec) override {
+        ec = 0;
+        if (readClosed_ || !handshakeDone_) return 0;
+        for (;;) {
+            int n = SSL_read(ssl_, buf, (int) std::min(len, (size_t) INT_MAX));
+            if (n > 0) {
+                drain_();
+                return n;
+            }
+            switch (SSL_get_error(ssl_, n)) {
+                case SSL_ERROR_WANT_READ:
+                    if (fill_()) continue;
+                    if (conn_->hIsReadClosed()) readClosed_ = true;
+                    break;
+                case SSL_ERROR_ZERO_RETURN:
+                    readClosed_ = true;
+                    break;
+                default:
+                    readClosed_ = true;
+                    ec = EPROTO;
+                    Logger::global->log(LOG_WARN, sslError("tls read"));
+            }
+            drain_();
+            return 0;
+        }
+    }
+
+    size_t hWrite(const char *buf, size_t len, int &ec) override {
+        ec = 0;
+        if (writeClosed_ || conn_->hIsWriteClosed()) {
+            ec = EPIPE;
+            return 0;
+        }
+        if (!handshakeDone_ || len == 0) return 0;
+        flush_();
+        if (out_.size() - outPos_ >= TLS_OUT_HIGH_WATER) return 0;
+        int n = SSL_write(ssl_, buf, (int) std::min(len, TLS_WRITE_CHUNK));
+        if (n <= 0) {
+            ec = EPROTO;
+            Logger::global->log(LOG_WARN, sslError("tls write"));
+            return 0;
+        }
+        drain_();
+        flush_();
+        return n;
+    }
+
+    void hShutdown(bool rd, bool wr) override {
+        if (rd) readClosed_ = true;
+        if (wr && !writeClosed_) {
+            writeClosed_ = true;
+            if (handshakeDone_) {
+                SSL_shutdown(ssl_);
+                drain_();
+            }
+        }
+        shutRd_ = shutRd_ || rd;
+        shutWr_ = shutWr_ || wr;
+        flush_();
+        // close_notify and queued records still need the socket, shut it once they are out
+        conn_->hShutdown(shutRd_, shutWr_ && outEmpty_());
+        update_();
+    }
+
+    void hSetRead(bool b) override {
+        userRead_ = b;
+        update_();
+    }
+
+    void hSetWrite(bool b) override {
+        userWrite_ = b;
+        update_();
+    }
+
+    bool hIsReadClosed() override {
+        return readClosed_;
+    }
+
+    bool hIsWriteClosed() override {
+        return writeClosed_ || conn_->hIsWriteClosed();
+    }
+
+    void wake() override {
+        std::lock_guard guard(wakeLock_);
+        wakePending_ = true;
+        conn_->wake();
+    }
+
+private:
+    std::shared_ptr<TlsContext> ctx_;
+    SSL *ssl_;
+    BIO *rbio_, *wbio_;
+    std::shared_ptr<Transport> conn_;
+    std::function<void(EventType)> handler_;
+    std::string out_;
+    size_t outPos_;
+    bool userRead_, userWrite_, handshakeDone_;
+    bool readClosed_, writeClosed_, shutRd_, shutWr_;
+    std::mutex wakeLock_;  // orders wake() against write interest updates from the loop
+    std::atomic<bool> wakePending_;
+
+    bool outEmpty_() const {
+        return outPos_ == out_.size();
+    }
+
+    bool buffered_() {
+        return SSL_pending(ssl_) > 0 || BIO_ctrl_pending(rbio_) > 0;
+    }
+
+    // one socket read into the ciphertext BIO, false if nothing arrived
+    bool fill_() {
+        char buf[TLS_READ_CHUNK];
+        int ec;
+        size_t n = conn_->hRead(buf, sizeof(buf), ec);
+        if (n > 0) {
+            BIO_write(rbio_, buf, (int) n);
+            return true;
+        }
+        if (ec) {
+            Logger::global->log(LOG_WARN, strerror(ec));
+        }
+        return false;
+    }
+
+    // move ciphertext produced by OpenSSL into the outgoing queue
+    void drain_() {
+        size_t p;
+        while ((p = BIO_ctrl_pending(wbio_)) > 0) {
+            size_t old = out_.size();
+            out_.resize(old + p);
+            int n = BIO_read(wbio_, out_.data() + old, (int) p);
+            out_.resize(old + (n > 0 ? n : 0));
+            if (n <= 0) break;
+        }
+    }
+
+    void flush_() {
+        while (!outEmpty_()) {
+            int ec;
+            size_t n = conn_->hWrite(out_.data() + outPos_, out_.size() - outPos_, ec);
+            if (n == 0) {
+                if (ec) {
+                    Logger::global->log(LOG_WARN, strerror(ec));
+                    outPos_ = out_.size();
+                }
+                break;
+            }
+            outPos_ += n;
+        }
+        if (outEmpty_()) {
+            out_.clear();
+            outPos_ = 0;
+        } else if (outPos_ > out_.size() / 2) {
+            out_.erase(0, outPos_);
+            outPos_ = 0;
+        }
+    }
+
+    void update_() {
+        if (conn_->hIsReadClosed() && conn_->hIsWriteClosed()) return;
+        conn_->hSetRead(!handshakeDone_ || (userRead_ && !readClosed_));
+        // plaintext already decrypted but no new bytes will wake us: use writability as a kick
+        bool kick = handshakeDone_ && userRead_ && !readClosed_ && buffered_();
+        std::lock_guard guard(wakeLock_);
+        conn_->hSetWrite(!outEmpty_() || (handshakeDone_ && userWrite_) || kick || wakePending_);
+    }
+
+    void event_(EventType e) {
+        if (e & EVENT_OUT) {
+            flush_();
+        }
+        if (!handshakeDone_) {
+            if (e & EVENT_IN) {
+                while (fill_());
+            }
+            int r = SSL_do_handshake(ssl_);
+            drain_();
+            flush_();
+            if (r == 1) {
+                handshakeDone_ = true;
+            } else {
+                int err = SSL_get_error(ssl_, r);
+                if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) || conn_->hIsReadClosed()) {
+                    Logger::global->log(LOG_WARN, sslError("tls handshake"));
+                    readClosed_ = writeClosed_ = shutRd_ = shutWr_ = true;
+                    conn_->hShutdown(true, false);
+                }
+            }
+        }
+        if (handshakeDone_ && handler_) {
+            EventType ue = 0;
+            if (userRead_ && ((e & EVENT_IN) || buffered_() || conn_->hIsReadClosed())) ue |= EVENT_IN;
+            bool room = out_.size() - outPos_ < TLS_OUT_HIGH_WATER;
+            if (room && (wakePending_.exchange(false) || userWrite_)) ue |= EVENT_OUT;
+            if (ue) handler_(ue);
+        }
+        if (shutWr_ && outEmpty_() && !conn_->hIsWriteClosed()) {
+            conn_->hShutdown(shutRd_, true);
+        }
+        if (conn_->hIsReadClosed() && conn_->hIsWriteClosed()) {
+            // the user handler usually owns this transport, break the cycle once the socket is gone
+            handler_ = nullptr;
+            return;
+        }
+        update_();
+    }
+};
+
+}
+
+TlsContext::TlsContext() : ctx_(nullptr) {}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(ctx_);
+}
+
+bool TlsContext::encryptionKey_(TicketKey &key) {
+    std::lock_guard guard(keyLock_);
+    auto now = std::chrono::steady_clock::now();
+    if (keys_.empty() || now - keyRotated_ >= TICKET_KEY_LIFETIME) {
+        auto k = std::make_unique<TicketKey>();
+        if (RAND_bytes(k->name, sizeof(k->name)) <= 0 || RAND_bytes(k->aesKey, sizeof(k->aesKey)) <= 0 ||
+            RAND_bytes(k->hmacKey, sizeof(k->hmacKey)) <= 0) {
+            if (keys_.empty()) return false;
+            key = *keys_.front();
+            return true;
+        }
+        keys_.insert(keys_.begin(), std::move(k));
+        if (keys_.size() > TICKET_KEY_KEEP) keys_.pop_back();
+        keyRotated_ = now;
+    }
+    key = *keys_.front();
+    return true;
+}
+
+const TicketKey *TlsContext::findKey_(const unsigned char *name) {
+    for (auto &&k: keys_) {
+        if (memcmp(k->name, name, sizeof(k->name)) == 0) return k.get();
+    }
+    return nullptr;
+}
+
+TransportFactory TlsContext::factory() {
+    return [ptr = shared_from_this()](std::shared_ptr<Transport> conn) -> std::shared_ptr<Transport> {
+        SSL *ssl = SSL_new(ptr->ctx_);
+        if (!ssl) {
+            Logger::global->log(LOG_WARN, sslError("SSL_new"));
+            return nullptr;
+        }
+        return std::make_shared<TlsTransport>(ptr, ssl, std::move(conn));
+    };
+}
+
+std::shared_ptr<TlsContext> TlsContext::create(const std::string &certFile, const std::string &keyFile,
+                                               std::string &err) {
+    std::shared_ptr<TlsContext> t(new TlsContext());
+    SSL_CTX *ctx = t->ctx_ = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        err = sslError("SSL_CTX_new");
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1) {
+        err = sslError(certFile.c_str());
+        return nullptr;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        err = sslError(keyFile.c_str());
+        return nullptr;
+    }
+    SSL_CTX_set_alpn_select_cb(ctx, TlsCallbacks::alpnSelect, nullptr);
+
+    static const unsigned char sidCtx[] = "shs";
+    SSL_CTX_set_session_id_context(ctx, sidCtx, sizeof(sidCtx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_num_tickets(ctx, TLS_TICKETS_PER_HANDSHAKE);
+    SSL_CTX_set_app_data(ctx, t.get());
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TlsCallbacks::ticketKey);
+    return t;
+}
+
+}
@@ -0,0 +1,50 @@
+#ifndef SIMPLE_HTTP_SERVER_TLS_HPP
+#define SIMPLE_HTTP_SERVER_TLS_HPP
+
+#include "transport.hpp"
+#include<string>
+#include<memory>
+#include<mutex>
+#include<vector>
+#include<chrono>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace SHS1 {
+
+struct TicketKey;
+
+// server-side TLS termination on top of accepted connections
+// resumption: stateful session cache plus stateless tickets, ticket keys rotate periodically
+// and the previous key keeps decrypting so clients holding older tickets still resume
+class TlsContext final : private SNL1::DisableCopy,
+                         public std::enable_shared_from_this<TlsContext> {
+public:
+    ~TlsContext();
+
+    // use as HttpServer::setTransport argument
+    TransportFactory factory();
+
+    static std::shared_ptr<TlsContext> create(const std::string &certFile, const std::string &keyFile,
+                                              std::string &err);
+
+private:
+    SSL_CTX *ctx_;
+    std::mutex keyLock_;
+    std::vector<std::unique_ptr<TicketKey>> keys_;  // newest first
+    std::chrono::steady_clock::time_point keyRotated_;
+
+    TlsContext();
+
+    // copies the current key, rotating first when it expired; false if there is none
+    bool encryptionKey_(TicketKey &key);
+
+    // keyLock_ held
+    const TicketKey *findKey_(const unsigned char *name);
+
+    friend struct TlsCallbacks;
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_TLS_HPP
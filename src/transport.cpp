@@ -0,0 +1,66 @@
+#include "transport.hpp"
+#include "tcp_socket.hpp"
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+class PlainTransport final : public Transport {
+public:
+    explicit PlainTransport(std::shared_ptr<Connection> conn) : conn_(std::move(conn)) {}
+
+    void enableHandler(std::function<void(EventType)> h, bool rd, bool wr) override {
+        conn_->enableHandler(std::move(h), rd, wr);
+    }
+
+    size_t hRead(char *buf, size_t len, int &ec) override {
+        return conn_->hRead(buf, len, ec);
+    }
+
+    size_t hWrite(const char *buf, size_t len, int &ec) override {
+        return conn_->hWrite(buf, len, ec);
+    }
+
+    void hShutdown(bool rd, bool wr) override {
+        conn_->hShutdown(rd, wr);
+    }
+
+    void hSetRead(bool b) override {
+        conn_->hSetRead(b);
+    }
+
+    void hSetWrite(bool b) override {
+        conn_->hSetWrite(b);
+    }
+
+    bool hIsReadClosed() override {
+        return conn_->hIsReadClosed();
+    }
+
+    bool hIsWriteClosed() override {
+        return conn_->hIsWriteClosed();
+    }
+
+    void wake() override {
+        // SNL1 only updates the poller interest here, which is safe from any thread
+        conn_->hSetWrite(true);
+    }
+
+private:
+    std::shared_ptr<Connection> conn_;
+};
+
+}
+
+size_t Transport::hSplice(Transport &, size_t) {
+    return 0;
+}
+
+Transport::~Transport() = default;
+
+std::shared_ptr<Transport> plainTransport(std::shared_ptr<Connection> conn) {
+    return std::make_shared<PlainTransport>(std::move(conn));
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef SIMPLE_HTTP_SERVER_TRANSPORT_HPP
+#define SIMPLE_HTTP_SERVER_TRANSPORT_HPP
+
+#include "io_context.hpp"
+#include<functional>
+#include<memory>
+#include<mutex>
+
+namespace SNL1 {
+class Connection;
+}
+
+namespace SHS1 {
+
+// byte stream the HTTP layer talks to, same contract as SNL1::Connection
+// so protocol code does not care whether bytes go straight to a socket or through TLS
+class Transport {
+public:
+    virtual void enableHandler(std::function<void(SNL1::EventType)> h, bool rd, bool wr) = 0;
+
+    virtual size_t hRead(char *buf, size_t len, int &ec) = 0;
+
+    virtual size_t hWrite(const char *buf, size_t len, int &ec) = 0;
+
+    virtual void hShutdown(bool rd, bool wr) = 0;
+
+    virtual void hSetRead(bool b) = 0;
+
+    virtual void hSetWrite(bool b) = 0;
+
+    virtual bool hIsReadClosed() = 0;
+
+    virtual bool hIsWriteClosed() = 0;
+
+    // the only call allowed from other threads: makes the loop deliver EVENT_OUT soon
+    // even if write interest is off, so a producer elsewhere can hand over queued data
+    virtual void wake() = 0;
+
+    // zero-copy forwarding: the next len bytes src receives go to this transport's socket without
+    // passing through user space, behind everything written before, and hRead on src no longer
+    // returns them; returns len when taken over, 0 when the two can't (the default, e.g. another
+    // backend, another loop or TLS in between)
+    virtual size_t hSplice(Transport &src, size_t len);
+
+    virtual ~Transport();
+};
+
+// wake() for producers on other threads, serialized with the loop's own write interest update:
+// the loop holds lock while it decides on and sets write interest, so a wake-up arriving after
+// the loop last looked for work cannot be overwritten by the loop clearing interest
+struct WakeGate {
+    std::mutex lock;
+    std::weak_ptr<Transport> conn;
+
+    explicit WakeGate(std::weak_ptr<Transport> conn) : conn(std::move(conn)) {}
+
+    void wake() {
+        std::lock_guard guard(lock);
+        if (auto c = conn.lock()) c->wake();
+    }
+};
+
+// layers a transport over another one (e.g. TLS over a plain socket), nullptr refuses the connection
+using TransportFactory = std::function<std::shared_ptr<Transport>(std::shared_ptr<Transport>)>;
+
+std::shared_ptr<Transport> plainTransport(std::shared_ptr<SNL1::Connection> conn);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_TRANSPORT_HPP
@@ -0,0 +1,862 @@
+#include "uring_backend.hpp"
+#include "logger.hpp"
+#include <liburing.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cstring>
+#include <cerrno>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+}
+
+constexpr unsigned URING_ENTRIES = 4096;
+constexpr unsigned URING_CQ_ENTRIES = 16384;
+constexpr unsigned URING_BUF_COUNT = 1024;  // provided receive buffers per loop, power of 2
+constexpr size_t URING_BUF_SIZE = 16384;
+constexpr int URING_BUF_GROUP = 0;
+constexpr size_t URING_MAX_HELD = 16;  // buffers a connection may hold before its recv is paused
+constexpr size_t URING_OUT_HIGH_WATER = 1024 * 1024;
+constexpr size_t URING_OUT_CHUNK = 65536;  // small writes are coalesced up to this size
+constexpr size_t URING_MAX_CHAIN = 16;  // sends linked in one chain
+constexpr size_t URING_PIPE_SIZE = 256 * 1024;  // asked for the pipes splices go through
+constexpr size_t URING_MAX_PIPES = 64;  // idle pipes kept per loop
+
+enum UringOp : uint64_t {
+    OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_WAKE, OP_CANCEL, OP_CONNECT, OP_SPLICE, OP_POLL
+};
+
+constexpr int OP_BITS = 4;
+
+inline uint64_t opTag(uint64_t id, UringOp op) {
+    return id << OP_BITS | op;
+}
+
+class UringConnection;
+
+struct UringPipe {
+    int r = -1, w = -1;
+    size_t size = 0;
+};
+
+struct UringLoop {
+    io_uring ring{};
+    bool ringReady = false;
+    io_uring_buf_ring *bufRing = nullptr;
+    std::unique_ptr<char[]> bufs;
+    unsigned freeBufs = 0;
+    int listenFd = -1, wakeFd = -1;
+    uint64_t wakeValue = 0;
+    std::thread thread;
+    std::atomic<bool> stopping{false}, accepting{true};
+    bool acceptCancelled = false;
+    std::mutex wakeLock;
+    std::vector<uint64_t> wakeIds;
+    bool wakeSignalled = false;
+    std::unordered_map<uint64_t, std::shared_ptr<UringConnection>> conns;
+    std::vector<std::shared_ptr<UringConnection>> dirty, starved;
+    std::vector<UringPipe> pipes;  // idle and empty
+    uint64_t nextId = 1;
+    std::function<void(std::shared_ptr<Transport>)> onAccept;
+
+    ~UringLoop();
+
+    io_uring_sqe *sqe();
+
+    char *buffer(uint16_t bid) {
+        return bufs.get() + bid * URING_BUF_SIZE;
+    }
+
+    void recycle(uint16_t bid);
+
+    void armAccept();
+
+    void armWake();
+
+    void wake(uint64_t id);
+
+    void markDirty(UringConnection *c);
+
+    void accept(int fd);
+
+    std::shared_ptr<UringConnection> connect(const sockaddr *addr, socklen_t len, int &ec);
+
+    bool takePipe(UringPipe &p);
+
+    // a pipe still holding data is closed instead of kept
+    void givePipe(UringPipe &p, bool empty);
+
+    void complete(io_uring_cqe *cqe);
+
+    void run();
+};
+
+thread_local UringLoop *currentLoop = nullptr;
+
+// same contract as SNL1::Connection: level-triggered EVENT_IN/EVENT_OUT while interest is on,
+// hRead copies out of provided buffers, hWrite queues data for the next send chain.
+// hSplice queues the next bytes of another connection of this loop: its recv stops, what it
+// received already is copied, the rest moves socket to pipe to socket, each step after a poll
+class UringConnection final : public Transport,
+                              public std::enable_shared_from_this<UringConnection> {
+public:
+    UringConnection(UringLoop *loop, uint64_t id, int fd) :
+            loop_(loop), id_(id), fd_(fd), outQueued_(0), chainLen_(0), chainDone_(0), piped_(0), error_(0),
+            enabled_(false), rd_(false), wr_(false), woken_(false), dirty_(false),
+            recvArmed_(false), recvCancelling_(false), starved_(false), eof_(false),
+            readClosed_(false), writeShut_(false), writeClosed_(false), writeDone_(false),
+            connecting_(false), spliceIn_(false), lent_(false), borrower_(nullptr), peer_{}, peerLen_(0) {}
+
+    ~UringConnection() override {
+        for (auto &&s: in_) loop_->recycle(s.bid);
+        if (pipe_.r >= 0) loop_->givePipe(pipe_, !piped_);
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    void enableHandler(std::function<void(EventType)> h, bool rd, bool wr) override {
+        handler_ = std::move(h);
+        rd_ = rd;
+        wr_ = wr;
+        enabled_ = true;
+        loop_->markDirty(this);
+    }
+
+    size_t hRead(char *buf, size_t len, int &ec) override {
+        ec = 0;
+        if (readClosed_ || lent_) return 0;
+        size_t n = 0;
+        while (n < len && !in_.empty()) {
+            Segment &s = in_.front();
+            size_t m = std::min(len - n, (size_t) (s.len - s.off));
+            std::memcpy(buf + n, loop_->buffer(s.bid) + s.off, m);
+            n += m;
+            if ((s.off += m) == s.len) {
+                loop_->recycle(s.bid);
+                in_.pop_front();
+            }
+        }
+        if (n == 0 && eof_) {
+            readClosed_ = true;
+            ec = error_;
+        }
+        if (!recvArmed_) loop_->markDirty(this);
+        return n;
+    }
+
+    size_t hWrite(const char *buf, size_t len, int &ec) override {
+        ec = 0;
+        if (writeShut_ || writeClosed_) {
+            ec = error_ ? error_ : EPIPE;
+            return 0;
+        }
+        if (outQueued_ >= URING_OUT_HIGH_WATER || len == 0) return 0;
+        len = std::min(len, URING_OUT_HIGH_WATER - outQueued_);
+        // chunks already in a submitted chain must not move
+        if (out_.size() > chainLen_ && !out_.back().src && out_.back().data.size() + len <= URING_OUT_CHUNK) {
+            out_.back().data.append(buf, len);
+        } else {
+            out_.push_back({std::string(buf, len), 0});
+        }
+        outQueued_ += len;
+        loop_->markDirty(this);
+        return len;
+    }
+
+    void hShutdown(bool rd, bool wr) override {
+        if (rd && !readClosed_) {
+            readClosed_ = true;
+            if (!lent_) {  // otherwise the splice still needs them
+                for (auto &&s: in_) loop_->recycle(s.bid);
+                in_.clear();
+            }
+        }
+        if (wr) writeShut_ = true;
+        loop_->markDirty(this);
+    }
+
+    void hSetRead(bool b) override {
+        rd_ = b;
+        if (b) loop_->markDirty(this);
+    }
+
+    void hSetWrite(bool b) override {
+        wr_ = b;
+        if (b) loop_->markDirty(this);
+    }
+
+    bool hIsReadClosed() override {
+        return readClosed_;
+    }
+
+    bool hIsWriteClosed() override {
+        return writeShut_ || writeClosed_;
+    }
+
+    void wake() override {
+        loop_->wake(id_);
+    }
+
+    size_t hSplice(Transport &src, size_t len) override {
+        auto s = dynamic_cast<UringConnection *>(&src);
+        // only sockets of this ring, one transfer from a source at a time
+        if (!s || s == this || s->loop_ != loop_ || s->lent_ || s->connecting_ || s->eof_ || s->readClosed_ ||
+            s->fd_ < 0 || !len || writeShut_ || writeClosed_ || connecting_) {
+            return 0;
+        }
+        if (pipe_.r < 0 && !loop_->takePipe(pipe_)) return 0;
+        s->lent_ = true;
+        s->borrower_ = this;
+        out_.push_back({std::string(), 0, s->shared_from_this(), len});
+        outQueued_ += len;
+        loop_->markDirty(s);
+        loop_->markDirty(this);
+        return len;
+    }
+
+private:
+    struct Segment {
+        uint16_t bid;
+        uint32_t off, len;
+    };
+
+    // data, or with src the next len bytes received by src, of which off are taken from it
+    struct Chunk {
+        std::string data;
+        size_t off;
+        std::shared_ptr<UringConnection> src = nullptr;
+        size_t len = 0;
+    };
+
+    UringLoop *loop_;
+    uint64_t id_;
+    int fd_;
+    std::function<void(EventType)> handler_;
+    std::deque<Segment> in_;
+    std::deque<Chunk> out_;  // the first chainLen_ chunks are in flight
+    size_t outQueued_, chainLen_, chainDone_;
+    UringPipe pipe_;  // held while out_ has a splice
+    size_t piped_;    // bytes in pipe_
+    int error_;
+    bool enabled_, rd_, wr_, woken_, dirty_;
+    bool recvArmed_, recvCancelling_, starved_, eof_;
+    bool readClosed_, writeShut_, writeClosed_, writeDone_;
+    bool connecting_, spliceIn_;
+    bool lent_;  // the source of a splice, borrower_ reads its socket
+    UringConnection *borrower_;
+    sockaddr_storage peer_;  // connect target, read by the kernel on submission
+    socklen_t peerLen_;
+
+    friend struct UringLoop;
+
+    bool readable_() const {
+        return rd_ && !lent_ && !readClosed_ && (!in_.empty() || eof_);
+    }
+
+    bool writable_() const {
+        return writeClosed_ || (!writeShut_ && outQueued_ < URING_OUT_HIGH_WATER);
+    }
+
+    void onRecv(int res, uint32_t flags) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            recvArmed_ = false;
+            recvCancelling_ = false;
+        }
+        if (res > 0) {
+            auto bid = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (readClosed_ && !lent_) {
+                loop_->recycle(bid);
+            } else {
+                in_.push_back({bid, 0, uint32_t(res)});
+            }
+        } else if (res == 0) {
+            eof_ = true;
+        } else if (res == -ENOBUFS) {  // the loop re-arms once buffers come back
+            starved_ = true;
+            loop_->starved.push_back(shared_from_this());
+        } else if (res != -ECANCELED) {
+            eof_ = true;
+            error_ = -res;
+        }
+        loop_->markDirty(this);
+        if (lent_ && !recvArmed_) loop_->markDirty(borrower_);  // it waits for the recv to stop
+    }
+
+    void onConnect(int res) {
+        connecting_ = false;
+        if (res < 0) {
+            error_ = -res;
+            eof_ = true;
+            writeClosed_ = true;
+            dropOut_();
+        }
+        loop_->markDirty(this);
+    }
+
+    void onSplice(int res) {
+        chainLen_ = chainDone_ = 0;
+        Chunk &c = out_.front();
+        if (res == -EAGAIN || res == -EINTR) {
+            // the poll fired without data or room left, the next step polls again
+        } else if (res > 0 && spliceIn_) {
+            piped_ = res;
+            c.off += res;
+        } else if (res > 0) {
+            piped_ -= res;
+            outQueued_ -= res;
+            if (!piped_ && c.off == c.len) {
+                release_(c, true);
+                out_.pop_front();
+                keepPipe_();
+            }
+        } else {
+            // the source ended early (0) or a socket failed: the rest of the stream is lost
+            if (spliceIn_ && res < 0) c.src->error_ = -res;
+            error_ = !spliceIn_ && res < 0 ? -res : EPIPE;
+            writeClosed_ = true;
+            dropOut_();
+        }
+        loop_->markDirty(this);
+    }
+
+    // src is done as a splice source; unless all its bytes were taken its stream is broken
+    void release_(Chunk &c, bool complete) {
+        UringConnection &src = *c.src;
+        src.lent_ = false;
+        src.borrower_ = nullptr;
+        if (!complete) {
+            src.eof_ = true;
+            if (!src.error_) src.error_ = ECONNABORTED;
+        }
+        if (src.readClosed_) {
+            for (auto &&s: src.in_) loop_->recycle(s.bid);
+            src.in_.clear();
+        }
+        loop_->markDirty(&src);
+    }
+
+    // the pipe goes back to the loop once no splice is queued
+    void keepPipe_() {
+        for (auto &&c: out_) {
+            if (c.src) return;
+        }
+        loop_->givePipe(pipe_, true);
+    }
+
+    // nothing more gets written, splice sources are handed back broken
+    void dropOut_() {
+        for (auto &&c: out_) {
+            if (c.src) release_(c, false);
+        }
+        out_.clear();
+        outQueued_ = 0;
+        if (pipe_.r >= 0) loop_->givePipe(pipe_, !piped_);
+        piped_ = 0;
+    }
+
+    // bytes the source received before its recv stopped go out first, as a plain chunk
+    void takeReceived_() {
+        Chunk &c = out_.front();
+        UringConnection &src = *c.src;
+        if (piped_ || src.recvArmed_ || src.in_.empty()) return;
+        std::string data;
+        while (c.off + data.size() < c.len && !src.in_.empty()) {
+            Segment &s = src.in_.front();
+            size_t m = std::min(c.len - c.off - data.size(), size_t(s.len - s.off));
+            data.append(loop_->buffer(s.bid) + s.off, m);
+            if ((s.off += m) == s.len) {
+                loop_->recycle(s.bid);
+                src.in_.pop_front();
+            }
+        }
+        c.off += data.size();
+        if (c.off == c.len) {  // all of it had arrived already
+            release_(c, true);
+            c = {std::move(data), 0};
+            keepPipe_();
+        } else {
+            out_.push_front({std::move(data), 0});
+        }
+    }
+
+    // one step of the splice at the front of out_: source socket to pipe, or pipe to our socket
+    void splice_() {
+        Chunk &c = out_.front();
+        UringConnection &src = *c.src;
+        int from, to;
+        size_t n;
+        if (piped_) {
+            from = pipe_.r;
+            to = fd_;
+            n = piped_;
+            spliceIn_ = false;
+        } else if (src.recvArmed_) {
+            return;  // the source is cancelling its recv, onRecv brings us back
+        } else if (src.eof_) {
+            if (!src.error_) src.error_ = ECONNRESET;
+            error_ = EPIPE;
+            writeClosed_ = true;
+            dropOut_();
+            return;
+        } else {
+            from = src.fd_;
+            to = pipe_.w;
+            n = std::min(c.len - c.off, pipe_.size);
+            spliceIn_ = true;
+        }
+        if (io_uring_sq_space_left(&loop_->ring) < 2) io_uring_submit(&loop_->ring);
+        io_uring_sqe *sqe = loop_->sqe();
+        io_uring_prep_poll_add(sqe, spliceIn_ ? from : to, spliceIn_ ? POLLIN : POLLOUT);
+        io_uring_sqe_set_data64(sqe, opTag(id_, OP_POLL));
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = loop_->sqe();
+        io_uring_prep_splice(sqe, from, -1, to, -1, unsigned(n), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        io_uring_sqe_set_data64(sqe, opTag(id_, OP_SPLICE));
+        chainLen_ = 1;
+        chainDone_ = 0;
+    }
+
+    void onSend(int res) {
+        Chunk &c = out_[chainDone_];
+        if (res > 0) {
+            c.off += res;
+            outQueued_ -= res;
+        } else if (res < 0 && res != -ECANCELED) {
+            error_ = -res;
+            writeClosed_ = true;
+        }
+        // a short send cancels the rest of the chain, the remainder goes out with the next one
+        if (++chainDone_ == chainLen_) {
+            while (!out_.empty() && !out_.front().src && out_.front().off == out_.front().data.size()) {
+                out_.pop_front();
+            }
+            chainLen_ = chainDone_ = 0;
+            if (writeClosed_) dropOut_();
+        }
+        loop_->markDirty(this);
+    }
+
+    void dispatch_() {
+        if (!handler_) return;
+        EventType e = 0;
+        if (readable_()) e |= EVENT_IN;
+        if ((wr_ || woken_) && writable_()) {
+            e |= EVENT_OUT;
+            woken_ = false;
+        }
+        if (e) handler_(e);
+    }
+
+    // queue sqes for whatever the handler left behind, false once the connection is finished
+    bool prepare_() {
+        if (fd_ < 0) return false;
+        if (!enabled_ || connecting_) return true;
+        if (chainLen_ == 0 && !out_.empty() && !writeClosed_ && out_.front().src) {
+            takeReceived_();
+            if (out_.front().src) splice_();
+        }
+        if (chainLen_ == 0 && !out_.empty() && !writeClosed_ && !out_.front().src) {
+            // a chain ends before the next splice
+            size_t k = 0;
+            while (k < out_.size() && k < URING_MAX_CHAIN && !out_[k].src) ++k;
+            if (io_uring_sq_space_left(&loop_->ring) < k) io_uring_submit(&loop_->ring);
+            for (size_t i = 0; i < k; ++i) {
+                Chunk &c = out_[i];
+                io_uring_sqe *sqe = loop_->sqe();
+                io_uring_prep_send(sqe, fd_, c.data.data() + c.off, c.data.size() - c.off,
+                                   MSG_WAITALL | MSG_NOSIGNAL);
+                io_uring_sqe_set_data64(sqe, opTag(id_, OP_SEND));
+                if (i + 1 < k) sqe->flags |= IOSQE_IO_LINK;
+            }
+            chainLen_ = k;
+            chainDone_ = 0;
+        }
+        if (writeShut_ && !writeDone_ && chainLen_ == 0 && out_.empty()) {
+            if (!writeClosed_) ::shutdown(fd_, SHUT_WR);
+            writeDone_ = true;
+        }
+        if (!readClosed_ && !eof_ && !lent_ && !recvArmed_ && !starved_ && in_.size() < URING_MAX_HELD / 2) {
+            io_uring_sqe *sqe = loop_->sqe();
+            io_uring_prep_recv_multishot(sqe, fd_, nullptr, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+            io_uring_sqe_set_data64(sqe, opTag(id_, OP_RECV));
+            recvArmed_ = true;
+        }
+        if (recvArmed_ && !recvCancelling_ && (readClosed_ || lent_ || in_.size() >= URING_MAX_HELD)) {
+            io_uring_sqe *sqe = loop_->sqe();
+            io_uring_prep_cancel64(sqe, opTag(id_, OP_RECV), 0);
+            io_uring_sqe_set_data64(sqe, opTag(id_, OP_CANCEL));
+            recvCancelling_ = true;
+        }
+        if (readClosed_ && writeDone_ && !recvArmed_ && chainLen_ == 0 && !lent_) {
+            ::close(fd_);
+            fd_ = -1;
+            handler_ = nullptr;
+            return false;
+        }
+        return true;
+    }
+};
+
+UringLoop::~UringLoop() {
+    conns.clear();
+    dirty.clear();
+    starved.clear();
+    for (auto &&p: pipes) {
+        ::close(p.r);
+        ::close(p.w);
+    }
+    if (bufRing) io_uring_free_buf_ring(&ring, bufRing, URING_BUF_COUNT, URING_BUF_GROUP);
+    if (ringReady) io_uring_queue_exit(&ring);
+    if (listenFd >= 0) ::close(listenFd);
+    if (wakeFd >= 0) ::close(wakeFd);
+}
+
+io_uring_sqe *UringLoop::sqe() {
+    io_uring_sqe *s;
+    while (!(s = io_uring_get_sqe(&ring))) {
+        io_uring_submit(&ring);
+    }
+    return s;
+}
+
+void UringLoop::recycle(uint16_t bid) {
+    io_uring_buf_ring_add(bufRing, buffer(bid), URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+    io_uring_buf_ring_advance(bufRing, 1);
+    ++freeBufs;
+}
+
+void UringLoop::armAccept() {
+    io_uring_sqe *s = sqe();
+    io_uring_prep_multishot_accept(s, listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(s, opTag(0, OP_ACCEPT));
+}
+
+void UringLoop::armWake() {
+    io_uring_sqe *s = sqe();
+    io_uring_prep_read(s, wakeFd, &wakeValue, sizeof(wakeValue), 0);
+    io_uring_sqe_set_data64(s, opTag(0, OP_WAKE));
+}
+
+void UringLoop::wake(uint64_t id) {
+    bool signal;
+    {
+        std::lock_guard guard(wakeLock);
+        wakeIds.push_back(id);
+        signal = !wakeSignalled;
+        wakeSignalled = true;
+    }
+    if (signal) {
+        uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof(one)) < 0) {
+            Logger::global->log(LOG_WARN, strerror(errno));
+        }
+    }
+}
+
+void UringLoop::markDirty(UringConnection *c) {
+    if (c->dirty_) return;
+    c->dirty_ = true;
+    dirty.push_back(c->shared_from_this());
+}
+
+void UringLoop::accept(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint64_t id = nextId++;
+    auto c = std::make_shared<UringConnection>(this, id, fd);
+    conns.emplace(id, c);
+    onAccept(c);
+    if (!c->enabled_) {  // refused (e.g. by a transport factory)
+        conns.erase(id);
+    }
+}
+
+std::shared_ptr<UringConnection> UringLoop::connect(const sockaddr *addr, socklen_t len, int &ec) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ec = errno;
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    uint64_t id = nextId++;
+    auto c = std::make_shared<UringConnection>(this, id, fd);
+    c->connecting_ = true;
+    std::memcpy(&c->peer_, addr, len);
+    c->peerLen_ = len;
+    io_uring_sqe *s = sqe();
+    io_uring_prep_connect(s, fd, (sockaddr *) &c->peer_, c->peerLen_);
+    io_uring_sqe_set_data64(s, opTag(id, OP_CONNECT));
+    conns.emplace(id, c);
+    ec = 0;
+    return c;
+}
+
+bool UringLoop::takePipe(UringPipe &p) {
+    if (!pipes.empty()) {
+        p = pipes.back();
+        pipes.pop_back();
+        return true;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return false;
+    // fs.pipe-max-size may cap it, a splice step moves what the pipe holds
+    fcntl(fds[1], F_SETPIPE_SZ, int(URING_PIPE_SIZE));
+    int size = fcntl(fds[1], F_GETPIPE_SZ);
+    p = {fds[0], fds[1], size_t(size > 0 ? size : 65536)};
+    return true;
+}
+
+void UringLoop::givePipe(UringPipe &p, bool empty) {
+    if (p.r < 0) return;
+    if (empty && pipes.size() < URING_MAX_PIPES) {
+        pipes.push_back(p);
+    } else {
+        ::close(p.r);
+        ::close(p.w);
+    }
+    p = {};
+}
+
+void UringLoop::complete(io_uring_cqe *cqe) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    auto op = UringOp(data & ((1u << OP_BITS) - 1));
+    uint64_t id = data >> OP_BITS;
+    if (cqe->flags & IORING_CQE_F_BUFFER) --freeBufs;
+    switch (op) {
+        case OP_ACCEPT:
+            if (cqe->res >= 0) {
+                accept(cqe->res);
+            } else if (cqe->res != -ECANCELED) {
+                Logger::global->log(LOG_WARN, strerror(-cqe->res));
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE) && !stopping && accepting) armAccept();
+            break;
+        case OP_WAKE: {
+            std::vector<uint64_t> ids;
+            {
+                std::lock_guard guard(wakeLock);
+                ids.swap(wakeIds);
+                wakeSignalled = false;
+            }
+            if (!accepting && !acceptCancelled) {
+                acceptCancelled = true;
+                io_uring_sqe *s = sqe();
+                io_uring_prep_cancel64(s, opTag(0, OP_ACCEPT), 0);
+                io_uring_sqe_set_data64(s, opTag(0, OP_CANCEL));
+            }
+            for (uint64_t i: ids) {
+                auto it = conns.find(i);
+                if (it != conns.end()) {
+                    it->second->woken_ = true;
+                    markDirty(it->second.get());
+                }
+            }
+            if (!stopping) armWake();
+            break;
+        }
+        case OP_RECV:
+        case OP_SEND:
+        case OP_CONNECT:
+        case OP_SPLICE: {
+            auto it = conns.find(id);
+            if (it == conns.end()) {
+                if (cqe->flags & IORING_CQE_F_BUFFER) recycle(uint16_t(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+                break;
+            }
+            if (op == OP_RECV) {
+                it->second->onRecv(cqe->res, cqe->flags);
+            } else if (op == OP_SEND) {
+                it->second->onSend(cqe->res);
+            } else if (op == OP_CONNECT) {
+                it->second->onConnect(cqe->res);
+            } else {
+                it->second->onSplice(cqe->res);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void UringLoop::run() {
+    currentLoop = this;
+    armAccept();
+    armWake();
+    std::vector<std::shared_ptr<UringConnection>> work;
+    while (!stopping) {
+        if (!starved.empty() && freeBufs >= URING_BUF_COUNT / 4) {
+            for (auto &&c: starved) {
+                c->starved_ = false;
+                markDirty(c.get());
+            }
+            starved.clear();
+        }
+        // dirty_ stays set while a connection is processed so its own calls do not requeue it
+        work.swap(dirty);
+        for (auto &&c: work) {
+            c->dispatch_();
+            bool alive = c->prepare_();
+            c->dirty_ = false;
+            if (!alive) {
+                conns.erase(c->id_);
+            } else if (c->readable_() || (c->wr_ && c->writable_())) {
+                markDirty(c.get());
+            }
+        }
+        work.clear();
+        int r = io_uring_submit_and_wait(&ring, dirty.empty() ? 1 : 0);
+        if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY) {
+            Logger::global->log(LOG_WARN, std::string("io_uring_enter: ") + strerror(-r));
+        }
+        io_uring_cqe *cqe;
+        unsigned head, n = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            complete(cqe);
+            ++n;
+        }
+        io_uring_cq_advance(&ring, n);
+    }
+    conns.clear();
+}
+
+std::shared_ptr<Transport> uringConnect(const std::string &host, int port, int &ec) {
+    ec = 0;
+    if (!currentLoop) return nullptr;
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    int r = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (r) {
+        ec = r == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return nullptr;
+    }
+    std::shared_ptr<Transport> c = currentLoop->connect(res->ai_addr, res->ai_addrlen, ec);
+    freeaddrinfo(res);
+    return c;
+}
+
+UringContext::UringContext() = default;
+
+UringContext::~UringContext() {
+    stop();
+}
+
+void UringContext::start(std::function<void(std::shared_ptr<Transport>)> onAccept) {
+    for (auto &&loop: loops_) {
+        loop->onAccept = onAccept;
+        loop->thread = std::thread([l = loop.get()]() {
+            l->run();
+        });
+    }
+}
+
+void UringContext::stopAccepting() {
+    for (auto &&loop: loops_) {
+        loop->accepting = false;
+        if (loop->thread.joinable()) loop->wake(0);
+    }
+}
+
+std::vector<int> UringContext::listeners() const {
+    std::vector<int> fds;
+    for (auto &&loop: loops_) {
+        fds.push_back(loop->listenFd);
+    }
+    return fds;
+}
+
+void UringContext::stop() {
+    for (auto &&loop: loops_) {
+        loop->stopping = true;
+        if (loop->thread.joinable()) loop->wake(0);
+    }
+    for (auto &&loop: loops_) {
+        if (loop->thread.joinable()) loop->thread.join();
+    }
+}
+
+std::shared_ptr<UringContext> UringContext::create(int threads, int port, int backlog, int &ec,
+                                                   const std::vector<int> &inherited) {
+    std::shared_ptr<UringContext> ctx(new UringContext());
+    // every inherited socket needs a loop, or connections queued on it are never accepted
+    threads = std::max(threads, int(inherited.size()));
+    for (int i = 0; i < threads; ++i) {
+        auto loop = std::make_unique<UringLoop>();
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+        p.cq_entries = URING_CQ_ENTRIES;
+        int r = io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &p);
+        if (r == -EINVAL) {  // COOP_TASKRUN needs 5.19
+            p = {};
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = URING_CQ_ENTRIES;
+            r = io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &p);
+        }
+        if (r < 0) {
+            ec = -r;
+            return nullptr;
+        }
+        loop->ringReady = true;
+
+        loop->bufs.reset(new char[URING_BUF_COUNT * URING_BUF_SIZE]);
+        loop->bufRing = io_uring_setup_buf_ring(&loop->ring, URING_BUF_COUNT, URING_BUF_GROUP, 0, &r);
+        if (!loop->bufRing) {
+            ec = -r;
+            return nullptr;
+        }
+        for (unsigned b = 0; b < URING_BUF_COUNT; ++b) {
+            io_uring_buf_ring_add(loop->bufRing, loop->buffer(b), URING_BUF_SIZE, b,
+                                  io_uring_buf_ring_mask(URING_BUF_COUNT), int(b));
+        }
+        io_uring_buf_ring_advance(loop->bufRing, URING_BUF_COUNT);
+        loop->freeBufs = URING_BUF_COUNT;
+
+        // every loop listens on its own socket, the kernel spreads connections across them
+        if (size_t(i) < inherited.size()) {
+            loop->listenFd = inherited[i];
+        } else {
+            int fd = loop->listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int one = 1;
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+                bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, backlog) < 0) {
+                ec = errno;
+                return nullptr;
+            }
+        }
+        if ((loop->wakeFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            ec = errno;
+            return nullptr;
+        }
+        ctx->loops_.push_back(std::move(loop));
+    }
+    ec = 0;
+    return ctx;
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef SIMPLE_HTTP_SERVER_URING_BACKEND_HPP
+#define SIMPLE_HTTP_SERVER_URING_BACKEND_HPP
+
+#include "transport.hpp"
+#include<functional>
+#include<memory>
+#include<string>
+#include<vector>
+
+namespace SHS1 {
+
+struct UringLoop;
+
+// io_uring I/O backend, an alternative to the SNL1 epoll loops:
+// one ring per thread, each with its own SO_REUSEPORT listener served by a multishot accept,
+// multishot recv into a ring of provided buffers and linked send chains,
+// connections are handed out as Transport so the HTTP layer does not change.
+// Connections of one loop splice to each other (Transport::hSplice) through a pipe pool per loop
+class UringContext final : private SNL1::DisableCopy {
+public:
+    ~UringContext();
+
+    // onAccept runs on the loop thread owning the new connection
+    void start(std::function<void(std::shared_ptr<Transport>)> onAccept);
+
+    void stop();
+
+    // cancels the accepts, connections already accepted keep being served until stop()
+    void stopAccepting();
+
+    // listening sockets, one per loop, e.g. to hand over to a successor process
+    std::vector<int> listeners() const;
+
+    // ec is set (errno value) if the kernel lacks a required io_uring feature or the port is unusable;
+    // inherited listening sockets are served first, one per loop, with more loops if there are more
+    static std::shared_ptr<UringContext> create(int threads, int port, int backlog, int &ec,
+                                                const std::vector<int> &inherited = {});
+
+private:
+    std::vector<std::unique_ptr<UringLoop>> loops_;
+
+    UringContext();
+};
+
+// outgoing TCP connection on the io_uring loop of the calling thread, so it can splice to and
+// from the connections that loop accepted; nullptr with ec 0 on any other thread.
+// host is resolved on the calling thread, a name makes the loop wait for DNS
+std::shared_ptr<Transport> uringConnect(const std::string &host, int port, int &ec);
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_URING_BACKEND_HPP
@@ -0,0 +1,615 @@
+#include "websocket.hpp"
+#include "digest.hpp"
+#include "logger.hpp"
+#include <cstring>
+#include <strings.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef SHS_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+constexpr char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+constexpr size_t WS_READ_BUFFER_SIZE = 256 * 1024;
+constexpr size_t WS_DEFLATE_MIN_SIZE = 64;
+constexpr int WS_DEFLATE_LEVEL = 3;
+
+thread_local std::vector<char> wsRecvBuffer(WS_READ_BUFFER_SIZE);
+
+// XOR the client mask into payload bytes in place, offset is the mask position of p[0]
+void wsUnmask(char *p, size_t n, const uint8_t mask[4], size_t offset) {
+    uint8_t m[4];
+    for (int i = 0; i < 4; ++i) m[i] = mask[(offset + i) & 3];
+    uint32_t m32;
+    std::memcpy(&m32, m, 4);
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i mv = _mm256_set1_epi32((int) m32);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+        _mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(v, mv));
+    }
+#elif defined(__SSE2__)
+    __m128i mv = _mm_set1_epi32((int) m32);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(v, mv));
+    }
+#endif
+    uint64_t m64 = uint64_t(m32) << 32 | m32;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, p + i, 8);
+        v ^= m64;
+        std::memcpy(p + i, &v, 8);
+    }
+    for (; i < n; ++i) {
+        p[i] = char(p[i] ^ m[i & 3]);
+    }
+}
+
+bool validUtf8(const char *s, size_t n) {
+    auto p = reinterpret_cast<const uint8_t *>(s);
+    size_t i = 0;
+    while (i < n) {
+        if (i + 8 <= n) {
+            uint64_t w;
+            std::memcpy(&w, p + i, 8);
+            if (!(w & 0x8080808080808080ULL)) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = p[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t len;
+        uint32_t cp;
+        if ((c & 0xe0) == 0xc0) {
+            len = 2, cp = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            len = 3, cp = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            len = 4, cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if (i + len > n) return false;
+        for (size_t k = 1; k < len; ++k) {
+            if ((p[i + k] & 0xc0) != 0x80) return false;
+            cp = cp << 6 | (p[i + k] & 0x3f);
+        }
+        if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+            cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+bool validCloseCode(uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+void wsFrameHeader(std::string &s, WsOpcode op, bool compressed, size_t len) {
+    s.push_back(char(0x80 | (compressed ? 0x40 : 0) | uint8_t(op)));
+    if (len < 126) {
+        s.push_back(char(len));
+    } else if (len <= 0xffff) {
+        s.push_back(char(126));
+        s.push_back(char(len >> 8));
+        s.push_back(char(len));
+    } else {
+        s.push_back(char(127));
+        for (int i = 7; i >= 0; --i) s.push_back(char(uint64_t(len) >> (8 * i)));
+    }
+}
+
+#ifdef SHS_ENABLE_ZLIB
+
+bool isDataOp(WsOpcode op) {
+    return op == WsOpcode::TEXT || op == WsOpcode::BINARY;
+}
+
+constexpr char DEFLATE_TAIL[4] = {0, 0, char(0xff), char(0xff)};
+
+// outgoing messages never reference earlier ones (server_no_context_takeover),
+// so a compressed frame can be shared by every connection
+struct WsDeflater {
+    z_stream zs{};
+
+    WsDeflater() {
+        deflateInit2(&zs, WS_DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    }
+
+    ~WsDeflater() {
+        deflateEnd(&zs);
+    }
+};
+
+bool wsDeflate(const char *p, size_t n, std::string &out) {
+    thread_local WsDeflater d;
+    deflateReset(&d.zs);
+    out.resize(deflateBound(&d.zs, n) + 16);
+    d.zs.next_in = (Bytef *) p;
+    d.zs.avail_in = (uInt) n;
+    d.zs.next_out = (Bytef *) out.data();
+    d.zs.avail_out = (uInt) out.size();
+    if (deflate(&d.zs, Z_SYNC_FLUSH) != Z_OK || d.zs.avail_in != 0) return false;
+    size_t m = out.size() - d.zs.avail_out;
+    if (m < 4) return false;
+    out.resize(m - 4);  // RFC 7692 section 7.2.1: drop the empty stored block
+    return true;
+}
+
+// permessage-deflate offer we can accept (RFC 7692 section 7.1)
+bool deflateOffered(const std::string &extensions) {
+    size_t pos = 0;
+    while (pos < extensions.size()) {
+        size_t end = std::min(extensions.find(',', pos), extensions.size());
+        std::string offer = extensions.substr(pos, end - pos);
+        pos = end + 1;
+        bool ok = true, first = true;
+        size_t p = 0;
+        while (ok && p <= offer.size()) {
+            size_t e = std::min(offer.find(';', p), offer.size());
+            size_t b = offer.find_first_not_of(" \t", p);
+            size_t l = offer.find_last_not_of(" \t", e - 1);
+            std::string param = b < e && l != std::string::npos ? offer.substr(b, l - b + 1) : "";
+            p = e + 1;
+            size_t eq = param.find('=');
+            std::string name = param.substr(0, eq), value;
+            if (eq != std::string::npos) {
+                value = param.substr(eq + 1);
+                value.erase(0, value.find_first_not_of(" \t\""));
+                value.erase(value.find_last_not_of(" \t\"") + 1);
+                name.erase(name.find_last_not_of(" \t") + 1);
+            }
+            if (first) {
+                ok = strcasecmp(name.c_str(), "permessage-deflate") == 0;
+                first = false;
+            } else if (name == "server_max_window_bits") {
+                ok = value == "15";
+            } else if (name != "server_no_context_takeover" && name != "client_no_context_takeover" &&
+                       name != "client_max_window_bits") {
+                ok = false;
+            }
+        }
+        if (ok) return true;
+    }
+    return false;
+}
+
+thread_local std::string wsInflateBuffer;
+
+#endif
+
+}
+
+#ifdef SHS_ENABLE_ZLIB
+
+// incoming messages may build on earlier ones (client context takeover), one stream per connection
+struct WsInflater {
+    z_stream zs{};
+
+    WsInflater() {
+        inflateInit2(&zs, -MAX_WBITS);
+    }
+
+    ~WsInflater() {
+        inflateEnd(&zs);
+    }
+
+    // close code on failure: 1007 for corrupt data, 1009 when exceeding limit
+    uint16_t run(const char *p, size_t n, size_t limit, std::string &out) {
+        size_t used = 0;
+        for (int part = 0; part < 2; ++part) {
+            zs.next_in = (Bytef *) (part ? DEFLATE_TAIL : p);
+            zs.avail_in = (uInt) (part ? sizeof(DEFLATE_TAIL) : n);
+            for (;;) {
+                if (out.size() - used < 16384) out.resize(used + 65536);
+                zs.next_out = (Bytef *) out.data() + used;
+                zs.avail_out = (uInt) (out.size() - used);
+                int r = inflate(&zs, Z_SYNC_FLUSH);
+                used = out.size() - zs.avail_out;
+                if (used > limit) return 1009;
+                if (r == Z_STREAM_END) {
+                    inflateReset(&zs);
+                    if (zs.avail_in == 0) break;
+                } else if (r == Z_BUF_ERROR || (r == Z_OK && zs.avail_in == 0 && zs.avail_out != 0)) {
+                    break;
+                } else if (r != Z_OK) {
+                    return 1007;
+                }
+            }
+        }
+        out.resize(used);
+        return 0;
+    }
+};
+
+#else
+
+struct WsInflater {
+};
+
+#endif
+
+WsFramePtr makeWsFrame(WsOpcode op, const char *data, size_t len, bool deflate) {
+    auto f = std::make_shared<WsFrame>();
+    f->plain.reserve(len + 10);
+    wsFrameHeader(f->plain, op, false, len);
+    f->plain.append(data, len);
+#ifdef SHS_ENABLE_ZLIB
+    std::string z;
+    if (deflate && isDataOp(op) && len >= WS_DEFLATE_MIN_SIZE && wsDeflate(data, len, z) && z.size() < len) {
+        f->deflated.reserve(z.size() + 10);
+        wsFrameHeader(f->deflated, op, true, z.size());
+        f->deflated.append(z);
+    }
+#endif
+    return f;
+}
+
+bool acceptWebSocket(HttpHeader *header, std::unique_ptr<Response> &resp,
+                     WebSocketHandler handler, const WebSocketOptions &options) {
+    auto find = [header](const char *name) -> const std::string * {
+        auto it = header->header.find(normalizeFieldName(name));
+        return it == header->header.end() ? nullptr : &it->second;
+    };
+    const std::string *upgrade = find("Upgrade"), *connection = find("Connection");
+    const std::string *key = find("Sec-WebSocket-Key"), *version = find("Sec-WebSocket-Version");
+    if (header->method != "GET" || header->version != "1.1" || !upgrade || !hasToken(*upgrade, "websocket") ||
+        !connection || !hasToken(*connection, "upgrade") || !key || key->size() != 24 ||
+        !version || *version != "13") {
+        return false;
+    }
+    bool deflate = false;
+#ifdef SHS_ENABLE_ZLIB
+    const std::string *extensions = find("Sec-WebSocket-Extensions");
+    deflate = options.deflate && extensions && deflateOffered(*extensions);
+#endif
+    std::string k = *key + WS_GUID;
+    Sha1Digest d = sha1(k.data(), k.size());
+
+    resp = std::make_unique<Response>();
+    resp->version = "1.1";
+    resp->status = 101;
+    resp->message = "Switching Protocols";
+    resp->header.emplace(normalizeFieldName("Upgrade"), "websocket");
+    resp->header.emplace(normalizeFieldName("Sec-WebSocket-Accept"), base64Encode(d.data(), d.size()));
+    if (deflate) {
+        resp->header.emplace(normalizeFieldName("Sec-WebSocket-Extensions"),
+                             "permessage-deflate; server_no_context_takeover");
+    }
+    header->result = HeaderAction::UPGRADE;
+    header->upgrade = std::make_shared<WebSocket>(std::move(handler), options, deflate);
+    return true;
+}
+
+WebSocket::WebSocket(WebSocketHandler handler, const WebSocketOptions &options, bool deflate) :
+        handler_(std::move(handler)), options_(options), deflate_(deflate),
+        head_{}, headLen_(0), remain_(0), frameLen_(0), mask_{}, maskPos_(0),
+        frameOp_(WsOpcode::CONTINUATION), msgOp_(WsOpcode::CONTINUATION),
+        frameFin_(false), inPayload_(false), msgCompressed_(false), msgActive_(false),
+        closeReceived_(false), notified_(false), failed_(false), transferred_(0),
+        outPos_(0), queued_(0), closeSent_(false), overflow_(false) {
+    if (deflate_) inflater_ = std::make_unique<WsInflater>();
+}
+
+WebSocket::~WebSocket() = default;
+
+bool WebSocket::deflate() const {
+    return deflate_;
+}
+
+void WebSocket::start(std::shared_ptr<Transport> conn, const char *data, size_t len) {
+    conn_ = std::move(conn);
+    if (handler_.onOpen) handler_.onOpen(shared_from_this());
+    if (len) {
+        std::string early(data, len);
+        feed_(early.data(), early.size());
+    }
+    conn_->hSetRead(true);
+    flush_();
+}
+
+void WebSocket::handler(EventType e) {
+    if (e & EVENT_IN) {
+        int ec;
+        size_t n;
+        do {
+            n = conn_->hRead(wsRecvBuffer.data(), wsRecvBuffer.size(), ec);
+            if (ec) {
+                Logger::global->log(LOG_WARN, strerror(ec));
+            }
+            transferred_ += n;
+        } while (n > 0 && feed_(wsRecvBuffer.data(), n) && !closeReceived_);
+    }
+    flush_();
+}
+
+uint64_t WebSocket::transferred() {
+    return transferred_;
+}
+
+bool WebSocket::writePending() {
+    std::lock_guard guard(outLock_);
+    return !out_.empty();
+}
+
+void WebSocket::expire() {
+    close(1001, "timeout");
+}
+
+void WebSocket::send(WsOpcode op, const char *data, size_t len) {
+    send(makeWsFrame(op, data, len, deflate_));
+}
+
+void WebSocket::send(const WsFramePtr &frame) {
+    std::lock_guard guard(outLock_);
+    if (closeSent_ || overflow_) return;
+    enqueue_(frame, deflate_ && !frame->deflated.empty() ? &frame->deflated : &frame->plain);
+}
+
+void WebSocket::close(uint16_t code, const std::string &reason) {
+    std::string payload;
+    payload.push_back(char(code >> 8));
+    payload.push_back(char(code));
+    payload.append(reason, 0, 123);
+    WsFramePtr frame = makeWsFrame(WsOpcode::CLOSE, payload.data(), payload.size(), false);
+    std::lock_guard guard(outLock_);
+    if (closeSent_ || overflow_) return;
+    enqueue_(frame, &frame->plain);
+    closeSent_ = true;
+}
+
+void WebSocket::enqueue_(const WsFramePtr &frame, const std::string *bytes) {
+    if ((queued_ += bytes->size()) > options_.maxQueued) {
+        overflow_ = true;
+        out_.clear();
+        conn_->wake();
+        return;
+    }
+    out_.emplace_back(frame, bytes);
+    if (out_.size() == 1) conn_->wake();
+}
+
+void WebSocket::flush_() {
+    bool shut, abort;
+    {
+        std::lock_guard guard(outLock_);
+        abort = overflow_;
+        while (!abort && !out_.empty()) {
+            const std::string *b = out_.front().second;
+            int ec;
+            size_t n = conn_->hWrite(b->data() + outPos_, b->size() - outPos_, ec);
+            if (n == 0) {
+                if (ec) {
+                    Logger::global->log(LOG_WARN, strerror(ec));
+                    abort = true;
+                }
+                break;
+            }
+            transferred_ += n;
+            if ((outPos_ += n) == b->size()) {
+                queued_ -= b->size();
+                outPos_ = 0;
+                out_.pop_front();
+            }
+        }
+        if (abort) {  // nothing more goes out on this connection
+            closeSent_ = true;
+            out_.clear();
+        }
+        shut = out_.empty() && closeSent_;
+        conn_->hSetWrite(!out_.empty());
+    }
+    if (abort) {
+        if (overflow_) {
+            Logger::global->log(LOG_WARN, "websocket peer is not reading, dropping connection");
+        }
+        notify_(overflow_ ? 1008 : 1006);
+        conn_->hShutdown(true, true);
+        return;
+    }
+    bool peerGone = conn_->hIsReadClosed();
+    if (peerGone) {
+        notify_(1006);
+    }
+    if (shut || peerGone) {
+        // after our close frame, keep reading for the peer's until it arrives or the peer hangs up
+        conn_->hShutdown(closeReceived_ || failed_ || peerGone, true);
+        if (peerGone) {
+            std::lock_guard guard(outLock_);
+            closeSent_ = true;
+            out_.clear();
+        }
+        return;
+    }
+    conn_->hSetRead(!closeReceived_ && !failed_);
+}
+
+void WebSocket::notify_(uint16_t code) {
+    if (notified_) return;
+    notified_ = true;
+    if (handler_.onClose) handler_.onClose(shared_from_this(), code);
+}
+
+bool WebSocket::fail_(uint16_t code) {
+    failed_ = true;
+    close(code);
+    notify_(code);
+    return false;
+}
+
+// parse frames straight out of the receive buffer, unmasking payload in place
+bool WebSocket::feed_(char *data, size_t len) {
+    while (len > 0 && !closeReceived_ && !failed_) {
+        if (!inPayload_) {
+            auto headerSize = [this]() -> size_t {
+                if (headLen_ < 2) return 2;
+                uint8_t l = head_[1] & 0x7f;
+                return 2 + (l == 126 ? 2 : l == 127 ? 8 : 0) + ((head_[1] & 0x80) ? 4 : 0);
+            };
+            size_t need;
+            while (headLen_ < (need = headerSize()) && len > 0) {
+                head_[headLen_++] = uint8_t(*data++);
+                --len;
+            }
+            if (headLen_ < need) break;
+            headLen_ = 0;
+            if (!frameBegin_()) return false;
+            inPayload_ = true;
+        }
+        size_t n = (size_t) std::min<uint64_t>(remain_, len);
+        wsUnmask(data, n, mask_, maskPos_);
+        maskPos_ = (maskPos_ + n) & 3;
+        if ((remain_ -= n) == 0) inPayload_ = false;
+        if (!payload_(data, n)) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool WebSocket::frameBegin_() {
+    uint8_t b0 = head_[0], b1 = head_[1];
+    bool rsv1 = b0 & 0x40;
+    frameFin_ = b0 & 0x80;
+    frameOp_ = WsOpcode(b0 & 0x0f);
+    if ((b0 & 0x30) || !(b1 & 0x80)) return fail_(1002);  // unknown RSV bits, unmasked client frame
+    uint64_t len = b1 & 0x7f;
+    size_t pos = 2;
+    if (len == 126) {
+        len = uint64_t(head_[2]) << 8 | head_[3];
+        pos = 4;
+    } else if (len == 127) {
+        len = 0;
+        for (int i = 0; i < 8; ++i) len = len << 8 | head_[2 + i];
+        pos = 10;
+    }
+    std::memcpy(mask_, head_ + pos, 4);
+    maskPos_ = 0;
+    remain_ = frameLen_ = len;
+    switch (frameOp_) {
+        case WsOpcode::CLOSE:
+        case WsOpcode::PING:
+        case WsOpcode::PONG:
+            if (!frameFin_ || rsv1 || len > 125) return fail_(1002);
+            control_.clear();
+            return true;
+        case WsOpcode::TEXT:
+        case WsOpcode::BINARY:
+            if (msgActive_ || (rsv1 && !deflate_)) return fail_(1002);
+            msgActive_ = true;
+            msgOp_ = frameOp_;
+            msgCompressed_ = rsv1;
+            message_.clear();
+            break;
+        case WsOpcode::CONTINUATION:
+            if (!msgActive_ || rsv1) return fail_(1002);
+            break;
+        default:
+            return fail_(1002);
+    }
+    if (len > options_.maxMessage || message_.size() + len > options_.maxMessage) return fail_(1009);
+    return true;
+}
+
+bool WebSocket::payload_(const char *p, size_t n) {
+    bool last = remain_ == 0;
+    if (uint8_t(frameOp_) & 0x8) {
+        control_.append(p, n);
+        return !last || controlFrame_();
+    }
+    if (last && frameFin_ && n == frameLen_ && message_.empty()) {
+        // the whole message arrived in one read: no copy
+        return messageDone_(p, n);
+    }
+    message_.append(p, n);
+    if (!last || !frameFin_) return true;
+    bool ok = messageDone_(message_.data(), message_.size());
+    message_.clear();
+    return ok;
+}
+
+bool WebSocket::messageDone_(const char *p, size_t n) {
+    msgActive_ = false;
+#ifdef SHS_ENABLE_ZLIB
+    if (msgCompressed_) {
+        if (uint16_t code = inflater_->run(p, n, options_.maxMessage, wsInflateBuffer)) return fail_(code);
+        p = wsInflateBuffer.data();
+        n = wsInflateBuffer.size();
+    }
+#endif
+    if (msgOp_ == WsOpcode::TEXT && !validUtf8(p, n)) return fail_(1007);
+    if (handler_.onMessage) handler_.onMessage(shared_from_this(), msgOp_, p, n);
+    return true;
+}
+
+bool WebSocket::controlFrame_() {
+    switch (frameOp_) {
+        case WsOpcode::PING:
+            send(WsOpcode::PONG, control_.data(), control_.size());
+            break;
+        case WsOpcode::CLOSE: {
+            uint16_t code = 1005;  // no status present
+            if (control_.size() == 1) return fail_(1002);
+            if (control_.size() >= 2) {
+                code = uint16_t(uint8_t(control_[0]) << 8 | uint8_t(control_[1]));
+                if (!validCloseCode(code)) return fail_(1002);
+                if (!validUtf8(control_.data() + 2, control_.size() - 2)) return fail_(1007);
+            }
+            closeReceived_ = true;
+            notify_(code);
+            close(code == 1005 ? 1000 : code);  // echo, no-op if we closed first
+            break;
+        }
+        default:
+            break;
+    }
+    return true;
+}
+
+void WebSocketGroup::add(const std::shared_ptr<WebSocket> &ws) {
+    std::lock_guard guard(lock_);
+    members_.emplace_back(ws);
+}
+
+size_t WebSocketGroup::broadcast(WsOpcode op, const char *data, size_t len) {
+    std::vector<std::shared_ptr<WebSocket>> alive;
+    bool deflate = false;
+    {
+        std::lock_guard guard(lock_);
+        alive.reserve(members_.size());
+        for (size_t i = 0; i < members_.size();) {
+            if (std::shared_ptr<WebSocket> ws = members_[i].lock()) {
+                deflate = deflate || ws->deflate();
+                alive.push_back(std::move(ws));
+                ++i;
+            } else {
+                members_[i] = std::move(members_.back());
+                members_.pop_back();
+            }
+        }
+    }
+    WsFramePtr frame = makeWsFrame(op, data, len, deflate);
+    for (auto &&ws: alive) {
+        ws->send(frame);
+    }
+    return alive.size();
+}
+
+}
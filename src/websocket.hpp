@@ -0,0 +1,145 @@
+#ifndef SIMPLE_HTTP_SERVER_WEBSOCKET_HPP
+#define SIMPLE_HTTP_SERVER_WEBSOCKET_HPP
+
+#include "http_server.hpp"
+#include<deque>
+#include<mutex>
+#include<vector>
+#include<string>
+#include<memory>
+#include<cstdint>
+
+namespace SHS1 {
+
+enum class WsOpcode : uint8_t {
+    CONTINUATION = 0x0,
+    TEXT = 0x1,
+    BINARY = 0x2,
+    CLOSE = 0x8,
+    PING = 0x9,
+    PONG = 0xa
+};
+
+// serialized server frame: server frames are never masked, so one copy serves every connection
+struct WsFrame {
+    std::string plain;
+    std::string deflated;  // permessage-deflate variant, empty if not prepared or not smaller
+};
+
+using WsFramePtr = std::shared_ptr<const WsFrame>;
+
+// deflate also prepares the compressed variant (ignored when built without zlib)
+WsFramePtr makeWsFrame(WsOpcode op, const char *data, size_t len, bool deflate);
+
+class WebSocket;
+
+struct WebSocketHandler {
+    std::function<void(const std::shared_ptr<WebSocket> &)> onOpen;
+    // complete TEXT or BINARY message, reassembled and inflated,
+    // data may point into the receive buffer and is only valid during the call
+    std::function<void(const std::shared_ptr<WebSocket> &, WsOpcode, const char *, size_t)> onMessage;
+    // once per connection, 1006 if the connection ended without a close frame
+    std::function<void(const std::shared_ptr<WebSocket> &, uint16_t)> onClose;
+};
+
+struct WebSocketOptions {
+    size_t maxMessage = 16 * 1024 * 1024;  // larger messages are refused with 1009
+    size_t maxQueued = 8 * 1024 * 1024;    // a peer not reading this much output is dropped
+    bool deflate = true;                   // negotiate permessage-deflate if offered (needs zlib)
+};
+
+// validate a WebSocket handshake (RFC 6455 section 4.2) from the header callback,
+// on success sets HeaderAction::UPGRADE and the 101 response, otherwise leaves both untouched
+bool acceptWebSocket(HttpHeader *header, std::unique_ptr<Response> &resp,
+                     WebSocketHandler handler, const WebSocketOptions &options = {});
+
+struct WsInflater;
+
+class WebSocket final : public UpgradedConnection, private DisableCopy,
+                        public std::enable_shared_from_this<WebSocket> {
+public:
+    WebSocket(WebSocketHandler handler, const WebSocketOptions &options, bool deflate);
+
+    ~WebSocket() override;
+
+    void start(std::shared_ptr<Transport> conn, const char *data, size_t len) override;
+
+    void handler(EventType e) override;
+
+    uint64_t transferred() override;
+
+    bool writePending() override;
+
+    // closes with 1001 (going away)
+    void expire() override;
+
+    // send and close may be called from any thread
+    void send(WsOpcode op, const char *data, size_t len);
+
+    void send(const WsFramePtr &frame);
+
+    void close(uint16_t code, const std::string &reason = {});
+
+    bool deflate() const;
+
+private:
+    WebSocketHandler handler_;
+    WebSocketOptions options_;
+    bool deflate_;
+    std::shared_ptr<Transport> conn_;
+
+    // receive side, loop thread only
+    uint8_t head_[14];
+    size_t headLen_;
+    uint64_t remain_, frameLen_;
+    uint8_t mask_[4];
+    size_t maskPos_;
+    WsOpcode frameOp_, msgOp_;
+    bool frameFin_, inPayload_, msgCompressed_, msgActive_;
+    bool closeReceived_, notified_, failed_;
+    uint64_t transferred_;  // read and written, both on the loop thread
+    std::string message_, control_;
+    std::unique_ptr<WsInflater> inflater_;
+
+    // send side, guarded by outLock_
+    std::mutex outLock_;
+    std::deque<std::pair<WsFramePtr, const std::string *>> out_;
+    size_t outPos_, queued_;
+    bool closeSent_, overflow_;
+
+    bool feed_(char *data, size_t len);
+
+    bool frameBegin_();
+
+    bool payload_(const char *p, size_t n);
+
+    bool controlFrame_();
+
+    bool messageDone_(const char *p, size_t n);
+
+    bool fail_(uint16_t code);
+
+    void enqueue_(const WsFramePtr &frame, const std::string *bytes);
+
+    void flush_();
+
+    void notify_(uint16_t code);
+};
+
+// connections sharing broadcasts, members expire together with their connection
+class WebSocketGroup final : private DisableCopy {
+public:
+    void add(const std::shared_ptr<WebSocket> &ws);
+
+    // serialized once (plus once compressed if any member uses deflate), queued on every member,
+    // returns the number of members reached
+    size_t broadcast(WsOpcode op, const char *data, size_t len);
+
+private:
+    std::mutex lock_;
+    std::vector<std::weak_ptr<WebSocket>> members_;
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_WEBSOCKET_HPP
@@ -0,0 +1,255 @@
+#include "zstd_encoding.hpp"
+#include "digest.hpp"
+#include "logger.hpp"
+#include "zstd.h"
+#include <fstream>
+#include <iterator>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace SHS1 {
+
+namespace {
+using namespace SNL1;
+
+// dcz stream header: magic followed by SHA-256 of the dictionary (RFC 9842)
+constexpr unsigned char DCZ_MAGIC[] = {0x5e, 0x2a, 0x4d, 0x18, 0x20, 0x00, 0x00, 0x00};
+
+struct CCtxDeleter {
+    void operator()(ZSTD_CCtx *c) const { ZSTD_freeCCtx(c); }
+};
+
+// contexts of finished bodies, reused by the next ones on the thread
+thread_local std::vector<std::unique_ptr<ZSTD_CCtx, CCtxDeleter>> idleCCtx;
+
+// true if coding is listed in an Accept-Encoding value with non-zero quality
+bool acceptsCoding(const std::string &ae, const char *coding) {
+    size_t n = strlen(coding), pos = 0;
+    while (pos < ae.size()) {
+        size_t end = ae.find(',', pos);
+        if (end == std::string::npos)end = ae.size();
+        size_t b = ae.find_first_not_of(" \t", pos);
+        if (b < end && ae.compare(b, n, coding) == 0) {
+            size_t a = ae.find_first_not_of(" \t", b + n);
+            if (a >= end) return true;
+            if (ae[a] == ';') {
+                size_t q = ae.find("q=", a);
+                return q >= end || strtod(ae.c_str() + q + 2, nullptr) > 0;
+            }
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+}
+
+struct ZstdDictionary {
+    std::string name;
+    Sha256Digest digest;
+    std::string available;  // Available-Dictionary value announcing this dictionary
+    ZSTD_CDict *cdict;
+
+    ~ZstdDictionary() {
+        ZSTD_freeCDict(cdict);
+    }
+};
+
+namespace {
+
+// compresses the body it wraps while the connection writes it, one output buffer at a time,
+// so a large body is never held in memory whole
+class ZstdBody final : public ResponseBody {
+public:
+    ZstdBody(std::unique_ptr<ResponseBody> inner, uint64_t len, int level, const ZstdDictionary *dict) :
+            inner_(std::move(inner)), in_{nullptr, 0, 0}, prefixSent_(false), end_(false), done_(false),
+            aborted_(false) {
+        if (!idleCCtx.empty()) {
+            cctx_ = std::move(idleCCtx.back());
+            idleCCtx.pop_back();
+        } else {
+            cctx_.reset(ZSTD_createCCtx());
+        }
+        ZSTD_CCtx *c = cctx_.get();
+        ZSTD_CCtx_reset(c, ZSTD_reset_session_and_parameters);
+        ZSTD_CCtx_setParameter(c, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_refCDict(c, dict ? dict->cdict : nullptr);
+        ZSTD_CCtx_setPledgedSrcSize(c, len);
+        out_.resize(ZSTD_CStreamOutSize());
+        if (dict) {
+            prefix_.append(reinterpret_cast<const char *>(DCZ_MAGIC), sizeof(DCZ_MAGIC));
+            prefix_.append(reinterpret_cast<const char *>(dict->digest.data()), dict->digest.size());
+        }
+    }
+
+    ~ZstdBody() override {
+        if (cctx_) idleCCtx.push_back(std::move(cctx_));
+    }
+
+    std::pair<const char *, size_t> get() override {
+        if (!prefixSent_) {
+            prefixSent_ = true;
+            if (!prefix_.empty()) return {prefix_.data(), prefix_.size()};
+        }
+        while (!done_) {
+            if (in_.pos == in_.size && !end_) {
+                auto [p, s] = inner_->get();
+                end_ = !p;
+                in_ = {p, p ? s : 0, 0};
+            }
+            ZSTD_outBuffer o{out_.data(), out_.size(), 0};
+            size_t r = ZSTD_compressStream2(cctx_.get(), &o, &in_, end_ ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(r)) {
+                // e.g. the inner body ended short of its length: the frame cannot be finished
+                Logger::global->log(LOG_WARN, std::string("zstd err: ") + ZSTD_getErrorName(r));
+                aborted_ = true;
+                break;
+            }
+            done_ = end_ && r == 0;
+            if (o.pos) return {out_.data(), o.pos};
+        }
+        return {nullptr, 0};
+    }
+
+    ssize_t len() override {
+        return CHUNKED;
+    }
+
+    bool aborted() override {
+        return aborted_ || inner_->aborted();
+    }
+
+private:
+    std::unique_ptr<ResponseBody> inner_;
+    std::unique_ptr<ZSTD_CCtx, CCtxDeleter> cctx_;
+    ZSTD_inBuffer in_;
+    std::string out_, prefix_;  // prefix_: the dcz header, sent first
+    bool prefixSent_, end_, done_, aborted_;
+};
+
+// the body of a HEAD answer: the GET answer is compressed and chunked, so its head is the same
+struct HeadBody final : public ResponseBody {
+    std::pair<const char *, size_t> get() override {
+        return {nullptr, 0};
+    }
+
+    ssize_t len() override {
+        return CHUNKED;
+    }
+};
+
+}
+
+class ZstdHandler final {
+public:
+    ZstdHandler(std::shared_ptr<const ZstdEncoder> encoder, RequestHandler inner) :
+            encoder_(std::move(encoder)), inner_(std::move(inner)),
+            zstd_(false), dcz_(false), head_(false) {}
+
+    void operator()(HttpHeader *header, HttpData *body, std::unique_ptr<Response> &resp) {
+        if (header) {
+            auto ae = header->header.find(normalizeFieldName("Accept-Encoding"));
+            zstd_ = ae != header->header.end() && acceptsCoding(ae->second, "zstd");
+            dcz_ = ae != header->header.end() && acceptsCoding(ae->second, "dcz");
+            auto ad = header->header.find(normalizeFieldName("Available-Dictionary"));
+            available_ = ad != header->header.end() ? ad->second : "";
+            target_ = header->target;
+            head_ = header->method == "HEAD";
+        }
+        inner_(header, body, resp);
+        if (!header && !body && resp && resp->body) {
+            encode_(*resp);
+        }
+    }
+
+private:
+    std::shared_ptr<const ZstdEncoder> encoder_;
+    RequestHandler inner_;
+    bool zstd_, dcz_, head_;
+    std::string available_, target_;
+
+    const ZstdDictionary *route_() const {
+        for (auto &&[prefix, dict]: encoder_->routes_) {
+            if (target_.compare(0, prefix.size(), prefix) == 0) return dict;
+        }
+        return nullptr;
+    }
+
+    void encode_(Response &resp) {
+        if (!zstd_ && !dcz_)return;
+        if (resp.status < 200 || resp.status >= 300)return;
+        if (resp.header.count(normalizeFieldName("Content-Encoding")))return;
+        // polled by the connection, it cannot be drained here
+        if (dynamic_cast<AsyncResponseBody *>(resp.body.get()))return;
+        ssize_t len = resp.body->len();
+        if (len < (ssize_t) encoder_->minSize_)return;
+
+        const ZstdDictionary *dict = route_();
+        if (dict && !(dcz_ && available_ == dict->available)) dict = nullptr;
+        if (!dict && !zstd_)return;
+
+        resp.header.emplace(normalizeFieldName("Content-Encoding"), dict ? "dcz" : "zstd");
+        const char *vary = dict ? "Accept-Encoding, Available-Dictionary" : "Accept-Encoding";
+        auto [it, succ] = resp.header.emplace(normalizeFieldName("Vary"), vary);
+        if (!succ) {
+            it->second.append(", ").append(vary);
+        }
+        if (head_) {  // same fields, nothing to compress
+            resp.body = std::make_unique<HeadBody>();
+            return;
+        }
+        resp.body = std::make_unique<ZstdBody>(std::move(resp.body), uint64_t(len), encoder_->level_, dict);
+    }
+};
+
+
+ZstdEncoder::ZstdEncoder(int level, size_t minSize) : level_(level), minSize_(minSize) {}
+
+ZstdEncoder::~ZstdEncoder() = default;
+
+bool ZstdEncoder::loadDictionary(const std::string &name, const std::string &path, int &ec) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        ec = errno ? errno : ENOENT;
+        return false;
+    }
+    std::string data{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+    auto d = std::make_unique<ZstdDictionary>();
+    d->name = name;
+    d->digest = sha256(data.data(), data.size());
+    d->available = ":" + base64Encode(d->digest.data(), d->digest.size()) + ":";
+    d->cdict = ZSTD_createCDict(data.data(), data.size(), level_);
+    if (!d->cdict) {
+        ec = EINVAL;
+        return false;
+    }
+    dicts_.push_back(std::move(d));
+    ec = 0;
+    return true;
+}
+
+bool ZstdEncoder::addRoute(const std::string &prefix, const std::string &name) {
+    for (auto &&d: dicts_) {
+        if (d->name == name) {
+            auto it = std::find_if(routes_.begin(), routes_.end(), [&](auto &&r) {
+                return r.first.size() < prefix.size();
+            });
+            routes_.emplace(it, prefix, d.get());
+            return true;
+        }
+    }
+    return false;
+}
+
+NewClientHandler ZstdEncoder::wrap(NewClientHandler h) {
+    return [ptr = std::shared_ptr<const ZstdEncoder>(shared_from_this()), h = std::move(h)]() {
+        return RequestHandler(ZstdHandler(ptr, h()));
+    };
+}
+
+std::shared_ptr<ZstdEncoder> ZstdEncoder::create(int level, size_t minSize) {
+    return std::shared_ptr<ZstdEncoder>(new ZstdEncoder(level, minSize));
+}
+
+}
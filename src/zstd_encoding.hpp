@@ -0,0 +1,45 @@
+#ifndef SIMPLE_HTTP_SERVER_ZSTD_ENCODING_HPP
+#define SIMPLE_HTTP_SERVER_ZSTD_ENCODING_HPP
+
+#include "http_server.hpp"
+#include<string>
+#include<vector>
+#include<memory>
+
+namespace SHS1 {
+
+struct ZstdDictionary;
+
+// zstd content-encoding of response bodies
+// dictionaries (trained offline with `zstd --train`) are loaded at startup and selected
+// per route by longest target prefix; a dictionary is only used when the client announces
+// it holds the same one (Available-Dictionary, encoding "dcz"), otherwise plain zstd is sent
+class ZstdEncoder final : private DisableCopy,
+                          public std::enable_shared_from_this<ZstdEncoder> {
+public:
+    ~ZstdEncoder();
+
+    bool loadDictionary(const std::string &name, const std::string &path, int &ec);
+
+    // returns false if no dictionary with this name was loaded
+    bool addRoute(const std::string &prefix, const std::string &name);
+
+    // wraps every handler created by h, must be called after all dictionaries and routes are set
+    NewClientHandler wrap(NewClientHandler h);
+
+    static std::shared_ptr<ZstdEncoder> create(int level, size_t minSize);
+
+private:
+    int level_;
+    size_t minSize_;
+    std::vector<std::unique_ptr<ZstdDictionary>> dicts_;
+    std::vector<std::pair<std::string, const ZstdDictionary *>> routes_;
+
+    ZstdEncoder(int level, size_t minSize);
+
+    friend class ZstdHandler;
+};
+
+}
+
+#endif //SIMPLE_HTTP_SERVER_ZSTD_ENCODING_HPP
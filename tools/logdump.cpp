@@ -0,0 +1,105 @@
+// decode binary access logs (--access-log-format binary) to JSON lines or CSV
+//
+// usage: shs_logdump [--csv] [--status CODE|Nxx] [--method M] [--prefix TARGET_PREFIX]
+//                    [--slower-than MS] [FILE...]
+// without files, or for "-", standard input is read
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "access_log_format.hpp"
+
+namespace {
+
+using SHS1::AccessRecord;
+
+struct Filter {
+    int status = 0, statusClass = 0;
+    std::string method, prefix;
+    double slowerMs = -1;
+
+    bool match(const AccessRecord &r) const {
+        if (status && r.status != status) return false;
+        if (statusClass && r.status / 100 != statusClass) return false;
+        if (!method.empty() && method.compare(0, std::string::npos, r.method, r.methodLen()) != 0) return false;
+        if (!prefix.empty() && (r.keptTargetLen() < prefix.size() || memcmp(r.target, prefix.data(), prefix.size())))
+            return false;
+        return slowerMs < 0 || double(r.latency) / 1e6 > slowerMs;
+    }
+};
+
+bool dump(FILE *in, const char *name, const Filter &filter, bool csv, std::string &out) {
+    SHS1::AccessLogDecoder decoder;
+    std::string error;
+    std::vector<char> buf(1 << 20);
+    auto emit = [&](const AccessRecord &r) {
+        if (!filter.match(r)) return;
+        csv ? SHS1::appendAccessCsv(out, r) : SHS1::appendAccessJson(out, r);
+        if (out.size() >= (1 << 16)) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    };
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        if (!decoder.feed(buf.data(), n, emit, error)) {
+            fprintf(stderr, "%s: %s\n", name, error.c_str());
+            return false;
+        }
+    }
+    if (!decoder.idle()) {
+        fprintf(stderr, "%s: truncated last block ignored\n", name);
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Filter filter;
+    bool csv = false;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--csv")) {
+            csv = true;
+        } else if (!strcmp(argv[i], "--status") && hasValue) {
+            const char *v = argv[++i];
+            if (strlen(v) == 3 && !strcmp(v + 1, "xx")) {
+                filter.statusClass = v[0] - '0';
+            } else {
+                filter.status = atoi(v);
+            }
+        } else if (!strcmp(argv[i], "--method") && hasValue) {
+            filter.method = argv[++i];
+        } else if (!strcmp(argv[i], "--prefix") && hasValue) {
+            filter.prefix = argv[++i];
+        } else if (!strcmp(argv[i], "--slower-than") && hasValue) {
+            filter.slowerMs = atof(argv[++i]);
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+            return 2;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) files.push_back("-");
+
+    std::string out;
+    if (csv) out.append(SHS1::ACCESS_CSV_HEADER);
+    bool ok = true;
+    for (const char *f: files) {
+        FILE *in = strcmp(f, "-") ? fopen(f, "rb") : stdin;
+        if (!in) {
+            perror(f);
+            ok = false;
+            continue;
+        }
+        ok &= dump(in, f, filter, csv, out);
+        if (in != stdin) fclose(in);
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return ok ? 0 : 1;
+}
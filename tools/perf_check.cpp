@@ -0,0 +1,197 @@
+// run the microbenchmarks and a loopback load test, compare them with a stored baseline
+//
+// usage: shs_perf_check --baseline FILE --micro SHS_MICRO_BENCH --load SHS_BENCH [--port N] [--update]
+//
+// the baseline is JSON: "config" holds the load test parameters, "metrics" maps every checked
+// metric to {"value", "tolerance", "better", "slack"}. A metric regresses when it is worse than
+// value * (1 +- tolerance) by more than slack (absolute). A null value has no baseline and fails
+// the check; --update records the measured values (and new metrics) and keeps tolerances.
+// exit status: 0 within tolerance, 1 regression, 2 a benchmark could not run or a metric has no
+// recorded baseline
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/wait.h>
+#include "json.h"
+
+namespace {
+
+bool run(const std::string &cmd, std::string &out) {
+    fprintf(stderr, "+ %s\n", cmd.c_str());
+    FILE *p = popen(cmd.c_str(), "r");
+    if (!p) return false;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), p)) > 0) out.append(buf, n);
+    int status = pclose(p);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool parse(const std::string &s, Json::Value &v) {
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    std::string err;
+    return reader->parse(s.data(), s.data() + s.size(), &v, &err);
+}
+
+double toNs(double t, const std::string &unit) {
+    if (unit == "us") return t * 1e3;
+    if (unit == "ms") return t * 1e6;
+    if (unit == "s") return t * 1e9;
+    return t;
+}
+
+// medians of repeated runs: micro/NAME/ns and, where counted, micro/NAME/allocs
+bool runMicro(const std::string &bin, std::map<std::string, double> &m) {
+    std::string out;
+    Json::Value v;
+    if (!run(bin + " --benchmark_format=json --benchmark_repetitions=5 --benchmark_report_aggregates_only=true",
+             out) || !parse(out, v)) {
+        return false;
+    }
+    for (auto &&b: v["benchmarks"]) {
+        if (b["aggregate_name"].asString() != "median") continue;
+        std::string name = "micro/" + b["run_name"].asString();
+        m[name + "/ns"] = toNs(b["cpu_time"].asDouble(), b["time_unit"].asString());
+        if (b.isMember("allocs")) m[name + "/allocs"] = b["allocs"].asDouble();
+    }
+    return !m.empty();
+}
+
+bool runLoad(const std::string &bin, const Json::Value &config, int port, std::map<std::string, double> &m) {
+    std::string common = bin + " --in-process --json --duration " + config.get("duration", 5).asString() +
+                         " --connections " + config.get("connections", 32).asString() +
+                         " --threads " + config.get("threads", 2).asString() +
+                         " --server-threads " + config.get("server_threads", 2).asString();
+    std::string out;
+    Json::Value v;
+    if (!run(common + " --port " + std::to_string(port) + " --depth " + config.get("depth", 4).asString(), out) ||
+        !parse(out, v)) {
+        return false;
+    }
+    m["load/closed/throughput"] = v["throughput"].asDouble();
+    m["load/closed/p99_ms"] = v["service_ms"]["p99"].asDouble();
+    out.clear();
+    if (!run(common + " --port " + std::to_string(port + 1) + " --rate " + config.get("rate", 20000).asString(),
+             out) || !parse(out, v)) {
+        return false;
+    }
+    m["load/rate/p99_ms"] = v["corrected_ms"]["p99"].asDouble();
+    m["load/rate/p99.9_ms"] = v["corrected_ms"]["p99.9"].asDouble();
+    return true;
+}
+
+// defaults for metrics not in the baseline yet
+Json::Value newMetric(const std::string &name) {
+    Json::Value v = Json::objectValue;
+    v["value"] = Json::nullValue;
+    v["better"] = "lower";
+    v["tolerance"] = 0.2;
+    if (name.ends_with("/allocs")) {
+        v["tolerance"] = 0;
+        v["slack"] = 0.5;
+    } else if (name.ends_with("/throughput")) {
+        v["better"] = "higher";
+    } else if (name.ends_with("p99.9_ms")) {
+        v["tolerance"] = 1.0;
+    } else if (name.ends_with("_ms")) {
+        v["tolerance"] = 0.5;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, char **argv) {
+    std::string baselinePath, micro, load;
+    int port = 18180;
+    bool update = false;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--update")) {
+            update = true;
+        } else if (!strcmp(argv[i], "--baseline") && hasValue) {
+            baselinePath = argv[++i];
+        } else if (!strcmp(argv[i], "--micro") && hasValue) {
+            micro = argv[++i];
+        } else if (!strcmp(argv[i], "--load") && hasValue) {
+            load = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && hasValue) {
+            port = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "unknown or incomplete option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (baselinePath.empty() || micro.empty() || load.empty()) {
+        fprintf(stderr, "--baseline, --micro and --load are required\n");
+        return 2;
+    }
+
+    Json::Value baseline;
+    std::ifstream in(baselinePath);
+    if (!in || !parse(std::string(std::istreambuf_iterator<char>(in), {}), baseline)) {
+        fprintf(stderr, "cannot read baseline %s\n", baselinePath.c_str());
+        return 2;
+    }
+    std::map<std::string, double> measured;
+    if (!runMicro(micro, measured) || !runLoad(load, baseline["config"], port, measured)) {
+        fprintf(stderr, "benchmark run failed\n");
+        return 2;
+    }
+
+    Json::Value &metrics = baseline["metrics"];
+    for (auto &&[name, value]: measured) {
+        if (!metrics.isMember(name)) metrics[name] = newMetric(name);
+    }
+    int regressions = 0, unrecorded = 0;
+    printf("%-44s %12s %12s %8s\n", "metric", "baseline", "measured", "change");
+    for (auto &&name: metrics.getMemberNames()) {
+        Json::Value &b = metrics[name];
+        auto it = measured.find(name);
+        if (it == measured.end()) {
+            printf("%-44s %12s %12s %8s  missing\n", name.c_str(), "", "", "");
+            ++regressions;
+            continue;
+        }
+        double now = it->second;
+        if (b["value"].isNull()) {
+            printf("%-44s %12s %12.2f %8s  NO BASELINE\n", name.c_str(), "-", now, "");
+            ++unrecorded;
+        } else {
+            double ref = b["value"].asDouble(), tol = b["tolerance"].asDouble(), slack = b.get("slack", 0).asDouble();
+            bool higher = b["better"].asString() == "higher";
+            bool bad = higher ? now < ref * (1 - tol) - slack : now > ref * (1 + tol) + slack;
+            double change = ref != 0 ? (now - ref) / ref * 100 : 0;
+            printf("%-44s %12.2f %12.2f %+7.1f%%  %s\n", name.c_str(), ref, now, change, bad ? "REGRESSION" : "ok");
+            regressions += bad;
+        }
+        if (update) b["value"] = std::round(now * 100) / 100;
+    }
+
+    if (update) {
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "  ";
+        std::ofstream out(baselinePath);
+        out << Json::writeString(builder, baseline) << "\n";
+        printf("baseline %s updated\n", baselinePath.c_str());
+        return 0;
+    }
+    if (unrecorded) {
+        fprintf(stderr, "%d metric(s) have no baseline value, record one with `make perf_baseline`\n",
+                unrecorded);
+        return 2;
+    }
+    if (regressions) {
+        printf("%d metric(s) regressed\n", regressions);
+        return 1;
+    }
+    return 0;
+}